@@ -7,6 +7,7 @@
 
 #include "AuthenticationService.h"
 
+#include <pthread.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <string.h>
@@ -23,6 +24,9 @@
 #define DATABASE_FILE "serverdata/password.dat"
 
 
+// the database is accessed by the server's worker threads
+static pthread_mutex_t database_lock = PTHREAD_MUTEX_INITIALIZER;
+
 
 
 void initialize_authentication_service() {
@@ -64,8 +68,10 @@ bool check_user(const char* username, const char* password) {
 	// check for username and password in database
 	char cur_line[MAX_LINE_LEN];
 
+	pthread_mutex_lock(&database_lock);
 	FILE* db_file = fopen(DATABASE_FILE, "rb");
 	if (db_file == NULL) {
+		pthread_mutex_unlock(&database_lock);
 		return false;
 	}
 
@@ -74,10 +80,12 @@ bool check_user(const char* username, const char* password) {
 		if (strcmp(cur_line, username) == 0) {
 			memcpy(correct_hash, cur_line + MAX_USERNAME_LEN + 1, HASH_LEN);
 			fclose(db_file);
+			pthread_mutex_unlock(&database_lock);
 			return compare_hash(hash, correct_hash);
 		}
 	}
 	fclose(db_file);
+	pthread_mutex_unlock(&database_lock);
 	return false;
 }
 
@@ -95,6 +103,7 @@ bool create_user(const char* username, const char* password) {
 
 	// make sure username doesn't already exist
 	// if so add the username and hash to database
+	pthread_mutex_lock(&database_lock);
 	FILE* db_file = fopen(DATABASE_FILE, "a+b");
 	char cur_line[MAX_LINE_LEN];
 
@@ -102,6 +111,7 @@ bool create_user(const char* username, const char* password) {
 		if (strcmp(cur_line, username) == 0) {
 			// username already exist
 			fclose(db_file);
+			pthread_mutex_unlock(&database_lock);
 			return false;
 		}
 	}
@@ -113,5 +123,6 @@ bool create_user(const char* username, const char* password) {
 	memcpy(cur_line + MAX_USERNAME_LEN + 1, &hash, HASH_LEN);
 	fwrite(cur_line, 1, MAX_LINE_LEN, db_file);
 	fclose(db_file);
+	pthread_mutex_unlock(&database_lock);
 	return true;
 }
\ No newline at end of file
@@ -0,0 +1,315 @@
+#include "ChangeLog.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+
+/** Start of every log file, followed by the header then the records */
+static const char LOG_MAGIC[8] = "GMMLOG01";
+
+
+/**
+ * Header of a log file
+ */
+struct ChangeLogHeader {
+    char magic[sizeof(LOG_MAGIC)];
+    uint32_t log_id;
+    uint32_t reserved;
+    /** Generation of the log before its first record */
+    uint64_t first_generation;
+};
+
+
+/*
+ * Helper functions
+ */
+
+/**
+ * Read exactly len bytes at the given offset
+ * @return true if success, false if error or the file is too short
+ */
+static bool read_exactly(int fd, void* buffer, size_t len, off_t offset) {
+    size_t n_read = 0;
+    while (n_read < len) {
+        ssize_t n_new_bytes = pread(fd, (char*)buffer + n_read, len - n_read, offset + n_read);
+        if (n_new_bytes <= 0) {
+            return false;
+        }
+        n_read += n_new_bytes;
+    }
+    return true;
+}
+
+
+/**
+ * Write exactly len bytes at the current offset
+ * @return true if success, false if error
+ */
+static bool write_exactly(int fd, const void* buffer, size_t len) {
+    size_t n_written = 0;
+    while (n_written < len) {
+        ssize_t n_new_bytes = write(fd, (const char*)buffer + n_written, len - n_written);
+        if (n_new_bytes <= 0) {
+            return false;
+        }
+        n_written += n_new_bytes;
+    }
+    return true;
+}
+
+
+static void set_log_entry(struct ChangeLogEntry* entry, const char* file_name,
+        uint32_t checksum, bool is_valid, bool is_removed) {
+    memset(entry, 0, sizeof(*entry));
+    strncpy(entry->name, file_name, MAX_FILE_NAME_LEN - 1);
+    entry->checksum = checksum;
+    entry->is_valid = is_valid;
+    entry->is_removed = is_removed;
+}
+
+
+/**
+ * Order records by name, then by position in the log
+ */
+static int compare_records(const void* a, const void* b) {
+    const struct ChangeLogEntry* record_a = *(const struct ChangeLogEntry* const*)a;
+    const struct ChangeLogEntry* record_b = *(const struct ChangeLogEntry* const*)b;
+    int result = strncmp(record_a->name, record_b->name, MAX_FILE_NAME_LEN);
+    if (result == 0) {
+        result = (record_a > record_b) - (record_a < record_b);
+    }
+    return result;
+}
+
+
+/**
+ * Open the log file, and lock it. The lock is taken on the current log,
+ * since the log may be replaced while waiting for the lock.
+ * @param  lock_operation LOCK_SH to read the log, LOCK_EX to change it
+ * @return Descriptor of the log file, or -1 if the log doesn't exist
+ */
+static int open_locked_log(const char* log_path, int flags, int lock_operation) {
+    while (true) {
+        int fd = open(log_path, flags | O_CLOEXEC);
+        if (fd < 0) {
+            return -1;
+        }
+        if (flock(fd, lock_operation) < 0) {
+            close(fd);
+            return -1;
+        }
+        struct stat fd_stat;
+        struct stat path_stat;
+        if (fstat(fd, &fd_stat) == 0 && stat(log_path, &path_stat) == 0
+                && fd_stat.st_dev == path_stat.st_dev && fd_stat.st_ino == path_stat.st_ino) {
+            return fd;
+        }
+        close(fd);
+    }
+}
+
+
+/**
+ * Keep the last change of each file, sorted by name
+ */
+static void collapse_records(const struct ChangeLogEntry* records, size_t n_records,
+        struct ChangeLog* log) {
+    const struct ChangeLogEntry** sorted = malloc(n_records * sizeof(struct ChangeLogEntry*));
+    size_t i;
+    for (i = 0; i < n_records; i++) {
+        sorted[i] = &records[i];
+    }
+    qsort(sorted, n_records, sizeof(struct ChangeLogEntry*), compare_records);
+
+    log->entries = malloc(n_records * sizeof(struct ChangeLogEntry));
+    for (i = 0; i < n_records; i++) {
+        if (i + 1 < n_records
+                && strncmp(sorted[i]->name, sorted[i + 1]->name, MAX_FILE_NAME_LEN) == 0) {
+            continue;  // a later change of the same file follows
+        }
+        log->entries[log->n_entries++] = *sorted[i];
+    }
+    free(sorted);
+}
+
+
+/*
+ * Public functions
+ */
+
+
+int create_change_log(const char* log_path, uint32_t log_id, uint64_t generation,
+        const struct FileCatalog* files, bool is_replaced) {
+    struct ChangeLogHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, LOG_MAGIC, sizeof(LOG_MAGIC));
+    header.log_id = log_id;
+    header.first_generation = generation - files->n_files;
+
+    // the log is written next to its path, then moved there at once,
+    // so that readers never see a half-written log
+    size_t log_path_len = strlen(log_path);
+    char* temp_path = malloc(log_path_len + 8);
+    memcpy(temp_path, log_path, log_path_len);
+    memcpy(temp_path + log_path_len, ".XXXXXX", 8);
+    int temp_fd = mkstemp(temp_path);
+    if (temp_fd >= 0) {
+        fchmod(temp_fd, 0644);
+    }
+    bool is_written = temp_fd >= 0 && write_exactly(temp_fd, &header, sizeof(header));
+    size_t i;
+    for (i = 0; i < files->n_files && is_written; i++) {
+        struct ChangeLogEntry entry;
+        set_log_entry(&entry, catalog_file_name(files, i), files->checksums[i], true, false);
+        is_written = write_exactly(temp_fd, &entry, sizeof(entry));
+    }
+    if (temp_fd >= 0) {
+        close(temp_fd);
+    }
+    if (is_written) {
+        // a link fails if a log already exists, rather than replacing it
+        is_written = is_replaced ? rename(temp_path, log_path) == 0 : link(temp_path, log_path) == 0;
+    }
+    if (temp_fd >= 0 && (!is_written || !is_replaced)) {
+        remove(temp_path);
+    }
+    free(temp_path);
+    return is_written ? 0 : -1;
+}
+
+
+int append_change_log(const char* log_path, const char* file_name,
+        uint32_t checksum, bool is_valid, bool is_removed) {
+    // readers take a shared lock, so that they don't see half a record
+    int fd = open_locked_log(log_path, O_WRONLY | O_APPEND, LOCK_EX);
+    if (fd < 0) {
+        return -1;
+    }
+    struct ChangeLogEntry entry;
+    set_log_entry(&entry, file_name, checksum, is_valid, is_removed);
+    int result = write_exactly(fd, &entry, sizeof(entry)) ? 0 : -1;
+    close(fd);
+    return result;
+}
+
+
+int load_change_log(const char* log_path, uint64_t since_generation, struct ChangeLog* log) {
+    memset(log, 0, sizeof(*log));
+    int fd = open_locked_log(log_path, O_RDONLY, LOCK_SH);
+    if (fd < 0) {
+        return -1;
+    }
+    int result = load_locked_change_log(fd, since_generation, log);
+    close(fd);
+    return result;
+}
+
+
+int lock_change_log(const char* log_path) {
+    return open_locked_log(log_path, O_RDONLY, LOCK_EX);
+}
+
+
+int load_locked_change_log(int log_fd, uint64_t since_generation, struct ChangeLog* log) {
+    memset(log, 0, sizeof(*log));
+    struct stat log_stat;
+    struct ChangeLogHeader header;
+    if (fstat(log_fd, &log_stat) < 0 || log_stat.st_size < (off_t)sizeof(header)
+            || (log_stat.st_size - sizeof(header)) % sizeof(struct ChangeLogEntry) != 0
+            || !read_exactly(log_fd, &header, sizeof(header), 0)
+            || memcmp(header.magic, LOG_MAGIC, sizeof(LOG_MAGIC)) != 0) {
+        return -1;
+    }
+    size_t n_records = (log_stat.st_size - sizeof(header)) / sizeof(struct ChangeLogEntry);
+    log->log_id = header.log_id;
+    log->generation = header.first_generation + n_records;
+
+    // a generation older than the log gets all its records, and one newer
+    // than the log (of another log) gets none
+    log->is_complete = since_generation >= header.first_generation
+            && since_generation <= log->generation;
+    size_t first_record = 0;
+    if (since_generation > log->generation) {
+        first_record = n_records;
+    } else if (log->is_complete) {
+        first_record = since_generation - header.first_generation;
+    }
+
+    size_t n_read = n_records - first_record;
+    struct ChangeLogEntry* records = malloc(n_read * sizeof(struct ChangeLogEntry));
+    bool is_read = read_exactly(log_fd, records, n_read * sizeof(struct ChangeLogEntry),
+            sizeof(header) + first_record * sizeof(struct ChangeLogEntry));
+    if (!is_read) {
+        free(records);
+        return -1;
+    }
+    collapse_records(records, n_read, log);
+    free(records);
+    return 0;
+}
+
+
+struct FileCatalog* apply_change_log(const struct FileCatalog* catalog, const struct ChangeLog* log) {
+    struct FileCatalog* result = create_file_catalog(catalog->n_files + log->n_entries,
+            catalog->names_len + log->n_entries * MAX_FILE_NAME_LEN);
+
+    // both are sorted by name, and merged. A changed file takes the
+    // checksum of its change, unless it was removed.
+    size_t i = 0;
+    size_t j = 0;
+    while (i < catalog->n_files || j < log->n_entries) {
+        int order;
+        if (i == catalog->n_files) {
+            order = 1;
+        } else if (j == log->n_entries) {
+            order = -1;
+        } else {
+            order = strcmp(catalog_file_name(catalog, i), log->entries[j].name);
+        }
+        if (order < 0) {
+            add_catalog_file(result, catalog_file_name(catalog, i), catalog->checksums[i]);
+            i++;
+            continue;
+        }
+        const struct ChangeLogEntry* entry = &log->entries[j];
+        if (!entry->is_removed) {
+            add_catalog_file(result, entry->name, entry->checksum);
+        }
+        if (order == 0) {
+            i++;
+        }
+        j++;
+    }
+    return result;
+}
+
+
+bool matches_change_log(const struct ChangeLog* log, const struct FileCatalog* files) {
+    // both are sorted by name, and removed files are skipped in the log
+    size_t i = 0;
+    size_t j;
+    for (j = 0; j < log->n_entries; j++) {
+        const struct ChangeLogEntry* entry = &log->entries[j];
+        if (entry->is_removed) {
+            continue;
+        }
+        if (i == files->n_files || strcmp(catalog_file_name(files, i), entry->name) != 0
+                || (entry->is_valid && files->checksums[i] != entry->checksum)) {
+            return false;
+        }
+        i++;
+    }
+    return i == files->n_files;
+}
+
+
+void free_change_log(struct ChangeLog* log) {
+    free(log->entries);
+    log->entries = NULL;
+    log->n_entries = 0;
+}
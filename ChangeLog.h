@@ -0,0 +1,130 @@
+/**
+ * Contains an append-only log of the changes made to a directory of files,
+ * so that a client only receives the files changed since it last looked.
+ *
+ * Each change is a record appended to the log file, and the generation of
+ * the directory is the number of changes made since the log started. A log
+ * starts with a record for each file already in the directory, and is
+ * identified by a random number, so that generations of different logs
+ * (of a server that started over) are never mixed.
+ */
+
+#ifndef CHANGE_LOG_H_
+#define CHANGE_LOG_H_
+
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "FileCatalog.h"
+
+
+/**
+ * A change of a file. This is also the format of each record of the log file.
+ */
+struct ChangeLogEntry {
+    char name[MAX_FILE_NAME_LEN];
+    uint32_t checksum;
+    /** 0 if the checksum is unknown, and the file must be checksummed again */
+    uint32_t is_valid;
+    /** 1 if the file was removed, 0 if it was added or rewritten */
+    uint32_t is_removed;
+};
+
+
+/**
+ * The changes of a log after a given generation, one per file (its last
+ * change), sorted by name
+ */
+struct ChangeLog {
+    uint32_t log_id;
+    /** Generation of the log, after its last change */
+    uint64_t generation;
+    /**
+     * Whether the entries are all the changes after the given generation.
+     * Otherwise the generation is older than the log, and the entries are
+     * all the changes of the log, or newer, and there are no entries.
+     */
+    bool is_complete;
+    struct ChangeLogEntry* entries;
+    size_t n_entries;
+};
+
+
+/**
+ * Create a log file holding the given files, replacing any log at its path
+ * @param  log_id     Random number identifying the log, other than 0
+ * @param  generation Generation of the log, after the records of the files
+ *                    (at least the number of files)
+ * @param  files      Files of the directory when the log starts
+ * @param  is_replaced Whether an existing log is replaced. Otherwise the
+ *                    log is only created if there is none.
+ * @return 0 if success, -1 if fail (or the log exists and isn't replaced)
+ */
+int create_change_log(const char* log_path, uint32_t log_id, uint64_t generation,
+        const struct FileCatalog* files, bool is_replaced);
+
+
+/**
+ * Append a change to an existing log file
+ * @param  is_valid   Whether the checksum is known
+ * @param  is_removed Whether the file was removed
+ * @return 0 if success, -1 if fail or the log doesn't exist
+ */
+int append_change_log(const char* log_path, const char* file_name,
+        uint32_t checksum, bool is_valid, bool is_removed);
+
+
+/**
+ * Read the changes of a log file made after the given generation
+ * @param  log   [out] Address of the struct to store the changes.
+ *               Must be freed with free_change_log()
+ * @return 0 if success, -1 if the log is missing or corrupted
+ */
+int load_change_log(const char* log_path, uint64_t since_generation, struct ChangeLog* log);
+
+
+/**
+ * Lock a log file, so that no change is appended to it and it isn't
+ * replaced until the lock is released (other than by the caller)
+ * @return Descriptor of the log file, to be closed to release the lock,
+ *         or -1 if the log doesn't exist
+ */
+int lock_change_log(const char* log_path);
+
+
+/**
+ * Read the changes of a log file locked with lock_change_log(), made
+ * after the given generation
+ * @param  log   [out] Address of the struct to store the changes.
+ *               Must be freed with free_change_log()
+ * @return 0 if success, -1 if the log is corrupted
+ */
+int load_locked_change_log(int log_fd, uint64_t since_generation, struct ChangeLog* log);
+
+
+/**
+ * Apply changes to a catalog of files
+ * @param  catalog Catalog sorted by name
+ * @return New catalog sorted by name. Must be freed with free_file_catalog()
+ */
+struct FileCatalog* apply_change_log(const struct FileCatalog* catalog, const struct ChangeLog* log);
+
+
+/**
+ * @param  log   All the changes of a log
+ * @param  files Catalog sorted by name
+ * @return Whether the files are the ones left after the changes of the
+ *         log. A file whose checksum is unknown to the log only needs to exist.
+ */
+bool matches_change_log(const struct ChangeLog* log, const struct FileCatalog* files);
+
+
+/**
+ * Release the entries of the log
+ */
+void free_change_log(struct ChangeLog* log);
+
+
+#endif // CHANGE_LOG_H_
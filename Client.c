@@ -6,12 +6,42 @@
 #include <sys/stat.h>
 
 #include "AuthenticationService.h"
+#include "FileIndex.h"
 #include "NetworkHeader.h"
 #include "Protocol.h"
 #include "StorageService.h"
 
 
 #define CLIENT_DIR "clientdata"
+/** Checksums of the files in CLIENT_DIR, so that unchanged files aren't read again */
+#define CLIENT_INDEX "clientdata.idx"
+/**
+ * The server's files as of the last diff, named <prefix><username>, so that
+ * the next diff only receives the files changed since
+ */
+#define SERVER_SNAPSHOT_PREFIX "clientdata.server."
+
+
+/**
+ * Packets received from the server. It holds a few FILE_DATA packets, so
+ * that a download takes few recv() calls.
+ */
+static struct PacketReader server_reader;
+
+
+/** Path of the snapshot of the logged on user's files at server */
+static char* server_snapshot_path;
+
+
+/**
+ * Connection the server's hash tree is fetched through
+ */
+struct TreeFetchContext {
+    int server_socket;
+    uint32_t session_token;
+    /** Buffer of MAX_REQUEST_LEN bytes to make the requests */
+    char* request;
+};
 
 
 /**
@@ -50,30 +80,117 @@ int create_socket(const char* server, const char* server_port);
 
 
 /**
- * Query the server for the list of files belong to the user
+ * Query the server for the list of files belong to the user. The list is
+ * then received page by page with receive_server_files().
  *
  * @param  server_socket Server socket
- * @param  buffer        Buffer to receive packet
+ * @param  buffer        Buffer to make the request packet
  * @param  session_token Session token of current user
- * @param  n_files       [out] Address of variable to store number of files
- * @return Linked list of file infos at server. This is dynamically allocated,
- *         and require a call to free_file_info() to release memory.
  */
-struct FileInfo* get_server_files(int server_socket, char* buffer, uint32_t session_token, int* n_files);
+void request_server_files(int server_socket, char* buffer, uint32_t session_token);
+
+
+/**
+ * Receive the next page of the list of files at server
+ *
+ * @param  server_socket Server socket
+ * @param  is_last       [out] Address of variable to store whether this is
+ *                       the last page of the list
+ * @return Catalog of the files of the page. This is dynamically allocated,
+ *         and require a call to free_file_catalog() to release memory.
+ */
+struct FileCatalog* receive_server_files(int server_socket, bool* is_last);
+
+
+/**
+ * Ask the server for the files that only exist in client or in server,
+ * sending it the client's files
+ *
+ * @param  server_socket   Server socket
+ * @param  session_token   Session token of current user
+ * @param  client_files    Catalog of the client's files
+ * @param  client_missings [out] Address of variable to store catalog of files
+ *                         missing from client
+ * @param  server_missings [out] Address of variable to store catalog of files
+ *                         missing from server
+ * @return 0 if success, -1 if the files don't fit in a DIFF request or
+ *         response (the diff must then be made from a LIST response)
+ */
+int get_server_diffs(int server_socket, uint32_t session_token, const struct FileCatalog* client_files,
+        struct FileCatalog** client_missings, struct FileCatalog** server_missings);
+
+
+/**
+ * Find the files that only exist in client or in server from the snapshot
+ * of the server's files taken by the last diff, and the changes made at
+ * server since
+ *
+ * @param  server_socket   Server socket
+ * @param  buffer          Buffer to make the request packets
+ * @param  session_token   Session token of current user
+ * @param  client_files    Catalog of the client's files
+ * @param  changes         [out] Changes received. Their log id and generation
+ *                         are the ones of a new snapshot, when the server's
+ *                         files are found by other requests. The log id is 0
+ *                         if the server doesn't keep a log of changes.
+ * @param  client_missings [out] Address of variable to store catalog of files
+ *                         missing from client
+ * @param  server_missings [out] Address of variable to store catalog of files
+ *                         missing from server
+ * @return 0 if success, -1 if there is no snapshot, it's of another log than
+ *         the server's current one, or the server doesn't keep a log
+ */
+int get_change_diffs(int server_socket, char* buffer, uint32_t session_token,
+        const struct FileCatalog* client_files, struct ChangeLog* changes,
+        struct FileCatalog** client_missings, struct FileCatalog** server_missings);
+
+
+/**
+ * Save the snapshot of the server's files compared by the next diff
+ * @param  changes      Changes received, giving the log id and generation
+ *                      of the server's files. Nothing is saved if the log
+ *                      id is 0 (the server doesn't keep a log).
+ * @param  server_files Catalog of all the server's files
+ */
+void save_server_snapshot(const struct ChangeLog* changes, const struct FileCatalog* server_files);
 
 
 /**
- * Return a linked list of files that appear in src but doesn't appear in dst.
- * The criteria for file equality is checksum
- * This method allocate memory for the returned list, while not changing the
- * original lists.
+ * Asks the server for parts of its hash tree, through TREE and LEAF requests.
+ * Exits the program if a response is malformed.
+ *
+ * @param context Address of a TreeFetchContext
+ * @see   struct MerkleFetcher
  */
-struct FileInfo* get_missing_files(struct FileInfo* src, struct FileInfo* dst);
+ssize_t fetch_server_children(void* context, int level, const uint32_t* nodes, size_t n_nodes,
+        const unsigned char** children);
+ssize_t fetch_server_leaves(void* context, const uint32_t* leaves, size_t n_leaves,
+        struct FileCatalog** leaf_files);
 
 
 /**
- * Get the files that only exist in client or in server. The 2 lists returned
- * are dynamically allocated, and must be freed using free_file_info()
+ * Find the files that only exist in client or in server by comparing the
+ * hash trees of both, descending only into the subtrees that differ
+ *
+ * @param  server_socket   Server socket
+ * @param  session_token   Session token of current user
+ * @param  client_tree     Hash tree of the client's files
+ * @param  server_files    [out] Address of variable to store catalog of all
+ *                         the server's files, rebuilt from the leaves
+ * @param  client_missings [out] Address of variable to store catalog of files
+ *                         missing from client
+ * @param  server_missings [out] Address of variable to store catalog of files
+ *                         missing from server
+ * @return 0 if success, -1 if a leaf of the tree doesn't fit in a packet
+ */
+int get_tree_diffs(int server_socket, uint32_t session_token, const struct MerkleTree* client_tree,
+        struct FileCatalog** server_files, struct FileCatalog** client_missings,
+        struct FileCatalog** server_missings);
+
+
+/**
+ * Get the files that only exist in client or in server. The 2 catalogs
+ * returned are dynamically allocated, and must be freed using free_file_catalog()
  *
  * @param  server_socket   Server socket
  * @param  buffer          Buffer to receive packet
@@ -84,7 +201,7 @@ struct FileInfo* get_missing_files(struct FileInfo* src, struct FileInfo* dst);
  *                         missing from server
  */
 void get_client_server_diffs(int server_socket, char* buffer, uint32_t session_token, 
-        struct FileInfo** client_missings, struct FileInfo** server_missings);
+        struct FileCatalog** client_missings, struct FileCatalog** server_missings);
 
 
 /**
@@ -135,6 +252,7 @@ int main (int argc, char *argv[]) {
     
     int server_socket = create_socket(server, port);
     char buffer[BUFFSIZE];
+    init_packet_reader(&server_reader, 2 * (HEADER_LEN + MAX_FILE_DATA_LEN));
 
     /*
      * Initialize database
@@ -183,6 +301,8 @@ int main (int argc, char *argv[]) {
 
     // Release resource and exit
     close(server_socket);
+    free_packet_reader(&server_reader);
+    free(server_snapshot_path);
     return 0;
 }
 
@@ -292,82 +412,261 @@ int create_socket(const char* server, const char* server_port) {
 }
 
 
-struct FileInfo* get_server_files(int server_socket, char* buffer, uint32_t session_token, int* n_files) {
-    // Ask for list of files from server
-    ssize_t packet_len = make_list_request(buffer, BUFFSIZE, session_token);
+void request_server_files(int server_socket, char* buffer, uint32_t session_token) {
+    // Ask for list of files from server, from the first one
+    ssize_t packet_len = make_list_request(buffer, BUFFSIZE, session_token, NULL);
     send(server_socket, buffer, packet_len, 0);
+}
 
-    // receive list of files from server
-    packet_len = receive_packet(server_socket, buffer, BUFFSIZE);
-    if (packet_len <= 0) {
+
+struct FileCatalog* receive_server_files(int server_socket, bool* is_last) {
+    // receive a page of the list of files from server
+    char* packet;
+    ssize_t packet_len = read_packet(&server_reader, server_socket, &packet);
+    struct PacketHeader* header = (struct PacketHeader*) packet;
+    if (packet_len <= 0
+            || (header->type != TYPE_LIST_RESPONSE && header->type != TYPE_LIST_PAGE)) {
         printf("Error when receiving list repsonse\n");
         exit(1);
     }
+    *is_last = header->type == TYPE_LIST_RESPONSE;
 
-    // parse packet into a list of files
-    struct FileInfo* server_files = NULL;
-    *n_files = (packet_len - HEADER_LEN) / (MAX_FILE_NAME_LEN+4);
-    char* cur_entry = buffer + HEADER_LEN;
-    int i;
-    for (i = 0; i < *n_files; i++) {
-        struct FileInfo* cur_file = malloc(sizeof(struct FileInfo));
-        // copy file name
-        memcpy(cur_file->name, cur_entry, MAX_FILE_NAME_LEN);
-        cur_entry += MAX_FILE_NAME_LEN;
-        // copy file checksum (with endian corrected)
-        memcpy(&cur_file->checksum, cur_entry, 4);
-        cur_file->checksum = ntohl(cur_file->checksum);
-        cur_entry += 4;
-        // add file to head of server file list
-        cur_file->next = server_files;
-        server_files = cur_file;
+    // parse packet into a catalog of files
+    struct FileCatalog* server_files = parse_list_files(packet, packet_len);
+    if (server_files == NULL) {
+        printf("Error when parsing list response\n");
+        exit(1);
     }
     return server_files;
 }
 
 
-struct FileInfo* get_missing_files(struct FileInfo* src, struct FileInfo* dst) {
-    struct FileInfo* cur_src;
-    struct FileInfo* cur_dst;
-    struct FileInfo* missing = NULL;
-    for (cur_src = src; cur_src != NULL; cur_src = cur_src->next) {
-        // check if current file in src is found in dst
-        bool found = false;
-        for (cur_dst = dst; cur_dst != NULL; cur_dst = cur_dst->next) {
-            if (cur_src->checksum == cur_dst->checksum) {
-                found = true;
-                break;
-            }
+int get_server_diffs(int server_socket, uint32_t session_token, const struct FileCatalog* client_files,
+        struct FileCatalog** client_missings, struct FileCatalog** server_missings) {
+    // send the client's files to server
+    char* request = malloc(MAX_REQUEST_LEN);
+    ssize_t packet_len = make_diff_request(request, MAX_REQUEST_LEN, session_token, client_files);
+    if (packet_len > 0) {
+        send(server_socket, request, packet_len, 0);
+    }
+    free(request);
+    if (packet_len < 0) {
+        return -1;
+    }
+
+    // receive the diff from server
+    char* packet;
+    packet_len = read_packet(&server_reader, server_socket, &packet);
+    if (packet_len <= 0) {
+        printf("Error when receiving diff response\n");
+        exit(1);
+    }
+    struct PacketHeader* header = (struct PacketHeader*) packet;
+    if (header->type != TYPE_DIFF_RESPONSE || packet_len < (ssize_t)HEADER_LEN + 4) {
+        // the diff is too large for a packet
+        return -1;
+    }
+
+    // the files only in server come first, then the ones only in client
+    uint32_t n_client_missings;
+    memcpy(&n_client_missings, packet + HEADER_LEN, 4);
+    const char* cur_file = packet + HEADER_LEN + 4;
+    *client_missings = parse_diff_files(&cur_file, packet + packet_len, ntohl(n_client_missings));
+    *server_missings = NULL;
+    if (*client_missings != NULL) {
+        *server_missings = parse_diff_files(&cur_file, packet + packet_len, SIZE_MAX);
+    }
+    if (*server_missings == NULL) {
+        printf("Error when parsing diff response\n");
+        exit(1);
+    }
+    return 0;
+}
+
+
+ssize_t fetch_server_children(void* context, int level, const uint32_t* nodes, size_t n_nodes,
+        const unsigned char** children) {
+    struct TreeFetchContext* fetch = context;
+    ssize_t packet_len = make_tree_request(fetch->request, MAX_REQUEST_LEN, fetch->session_token,
+            level, nodes, n_nodes);
+    send(fetch->server_socket, fetch->request, packet_len, 0);
+    char* packet;
+    packet_len = read_packet(&server_reader, fetch->server_socket, &packet);
+    // the server answers as many nodes as fit in its response
+    ssize_t n_answered = -1;
+    if (packet_len > 0) {
+        n_answered = parse_tree_response(packet, packet_len, n_nodes, children);
+    }
+    if (n_answered < 0) {
+        printf("Error when receiving tree response\n");
+        exit(1);
+    }
+    return n_answered;
+}
+
+
+ssize_t fetch_server_leaves(void* context, const uint32_t* leaves, size_t n_leaves,
+        struct FileCatalog** leaf_files) {
+    struct TreeFetchContext* fetch = context;
+    ssize_t packet_len = make_leaf_request(fetch->request, MAX_REQUEST_LEN, fetch->session_token,
+            leaves, n_leaves);
+    send(fetch->server_socket, fetch->request, packet_len, 0);
+    char* packet;
+    packet_len = read_packet(&server_reader, fetch->server_socket, &packet);
+    ssize_t n_answered = -1;
+    if (packet_len > 0) {
+        n_answered = parse_leaf_response(packet, packet_len, n_leaves, leaf_files);
+    }
+    if (n_answered < 0) {
+        printf("Error when receiving leaf response\n");
+        exit(1);
+    }
+    return n_answered;
+}
+
+
+int get_tree_diffs(int server_socket, uint32_t session_token, const struct MerkleTree* client_tree,
+        struct FileCatalog** server_files, struct FileCatalog** client_missings,
+        struct FileCatalog** server_missings) {
+    char* request = malloc(MAX_REQUEST_LEN);
+    char* packet;
+    ssize_t packet_len;
+    struct PacketHeader* header;
+
+    // compare the root hashes
+    packet_len = make_tree_request(request, MAX_REQUEST_LEN, session_token, 0, NULL, 0);
+    send(server_socket, request, packet_len, 0);
+    packet_len = read_packet(&server_reader, server_socket, &packet);
+    if (packet_len <= 0) {
+        printf("Error when receiving tree response\n");
+        exit(1);
+    }
+    header = (struct PacketHeader*) packet;
+    if (header->type != TYPE_TREE_RESPONSE || packet_len != (ssize_t)(HEADER_LEN + MERKLE_HASH_LEN)) {
+        free(request);
+        return -1;
+    }
+    unsigned char root_hash[MERKLE_HASH_LEN];
+    memcpy(root_hash, packet + HEADER_LEN, MERKLE_HASH_LEN);
+
+    // descend into the subtrees that differ, and get the server's files
+    // of the leaves that differ
+    struct TreeFetchContext context = { server_socket, session_token, request };
+    struct MerkleFetcher fetcher = { &context, fetch_server_children, fetch_server_leaves };
+    struct FileCatalog* files = fetch_merkle_files(client_tree, root_hash, &fetcher);
+    free(request);
+    if (files == NULL) {
+        // the files of a leaf don't fit in a response
+        return -1;
+    }
+    // the criteria for file equality is checksum
+    diff_file_catalogs(files, client_tree->catalog, client_missings, server_missings);
+    *server_files = files;
+    return 0;
+}
+
+
+int get_change_diffs(int server_socket, char* buffer, uint32_t session_token,
+        const struct FileCatalog* client_files, struct ChangeLog* changes,
+        struct FileCatalog** client_missings, struct FileCatalog** server_missings) {
+    memset(changes, 0, sizeof(*changes));
+
+    // ask for the changes since the snapshot, if any
+    struct ChangeLog snapshot;
+    bool has_snapshot = load_change_log(server_snapshot_path, 0, &snapshot) == 0;
+    ssize_t packet_len = make_changes_request(buffer, BUFFSIZE, session_token,
+            has_snapshot ? snapshot.log_id : 0, has_snapshot ? snapshot.generation : 0);
+    send(server_socket, buffer, packet_len, 0);
+
+    char* packet;
+    packet_len = read_packet(&server_reader, server_socket, &packet);
+    if (packet_len <= 0) {
+        printf("Error when receiving changes response\n");
+        exit(1);
+    }
+    struct PacketHeader* header = (struct PacketHeader*) packet;
+    if (header->type != TYPE_CHANGES_RESPONSE) {
+        if (has_snapshot) {
+            free_change_log(&snapshot);
         }
-        // if not found, add current file to missing list
-        if (!found) {
-            // copy the info into new struct
-            struct FileInfo* cur_file = malloc(sizeof(struct FileInfo));
-            memcpy(cur_file, cur_src, sizeof(struct FileInfo));
-            // add to the head of the missing list
-            cur_file->next = missing;
-            missing = cur_file;
+        return -1;
+    }
+    if (parse_changes_response(packet, packet_len, changes) < 0) {
+        printf("Error when parsing changes response\n");
+        exit(1);
+    }
+    if (!has_snapshot || !changes->is_complete) {
+        // the server started a new log (or its directory was changed
+        // behind its back), so the server's files must be found again
+        if (has_snapshot) {
+            free_change_log(&snapshot);
         }
+        return -1;
     }
-    return missing;
+
+    // the changes bring the snapshot up to date
+    struct FileCatalog* no_files = create_file_catalog(0, 0);
+    struct FileCatalog* snapshot_files = apply_change_log(no_files, &snapshot);
+    struct FileCatalog* server_files = apply_change_log(snapshot_files, changes);
+    free_file_catalog(snapshot_files);
+    free_file_catalog(no_files);
+    free_change_log(&snapshot);
+    save_server_snapshot(changes, server_files);
+
+    // the criteria for file equality is checksum
+    diff_file_catalogs(server_files, client_files, client_missings, server_missings);
+    free_file_catalog(server_files);
+    return 0;
 }
 
 
-void get_client_server_diffs(int server_socket, char* buffer, uint32_t session_token, 
-        struct FileInfo** client_missings, struct FileInfo** server_missings) {
-    int n_server_files, n_client_files;
-    struct FileInfo* server_files = get_server_files(server_socket, buffer, session_token, &n_server_files);
-    struct FileInfo* client_files = list_files(CLIENT_DIR, &n_client_files);
+void save_server_snapshot(const struct ChangeLog* changes, const struct FileCatalog* server_files) {
+    if (changes->log_id != 0) {
+        create_change_log(server_snapshot_path, changes->log_id, changes->generation, server_files, true);
+    }
+}
 
-    *client_missings = get_missing_files(server_files, client_files);
-    *server_missings = get_missing_files(client_files, server_files);
 
-    free_file_info(server_files);
-    free_file_info(client_files);
+void get_client_server_diffs(int server_socket, char* buffer, uint32_t session_token, 
+        struct FileCatalog** client_missings, struct FileCatalog** server_missings) {
+    struct MerkleTree* client_tree = build_merkle_tree(list_indexed_files(CLIENT_DIR, CLIENT_INDEX));
+    struct FileCatalog* client_files = client_tree->catalog;
+
+    // only receive the changes made at server since the last diff. Without
+    // a snapshot of the server's current log, compare the hash trees, which
+    // also rebuild the server's files for a new snapshot. Then let the server
+    // make the diff from its index, unless too many files are involved.
+    struct ChangeLog changes;
+    if (get_change_diffs(server_socket, buffer, session_token, client_files, &changes,
+                client_missings, server_missings) < 0) {
+        struct FileCatalog* server_files;
+        if (get_tree_diffs(server_socket, session_token, client_tree, &server_files,
+                    client_missings, server_missings) == 0) {
+            save_server_snapshot(&changes, server_files);
+            free_file_catalog(server_files);
+        } else if (get_server_diffs(server_socket, session_token, client_files,
+                    client_missings, server_missings) < 0) {
+            // the criteria for file equality is checksum. Each page of the
+            // list is diffed as it arrives.
+            struct CatalogDiff* diff = start_catalog_diff(client_files);
+            request_server_files(server_socket, buffer, session_token);
+            bool is_last = false;
+            while (!is_last) {
+                struct FileCatalog* page = receive_server_files(server_socket, &is_last);
+                add_catalog_diff_part(diff, page);
+                free_file_catalog(page);
+            }
+            finish_catalog_diff(diff, client_missings, server_missings);
+        }
+    }
+
+    free_change_log(&changes);
+    free_merkle_tree(client_tree);
 }
 
 
-void upload_file(int server_socket, char* buffer, uint32_t session_token, const char* file_name) {
+void upload_file(int server_socket, char* buffer, uint32_t session_token, const char* file_name,
+        uint32_t checksum) {
     printf("Uploading file %s\n", file_name);
     // open file descriptor
     char* file_path = join_path(CLIENT_DIR, file_name);
@@ -377,18 +676,29 @@ void upload_file(int server_socket, char* buffer, uint32_t session_token, const
         return;
     }
     // get size of file
-    fseek(file, 0, SEEK_END);
-    size_t file_size = ftell(file);
-    fseek(file, 0, SEEK_SET);
-    // send header
-    size_t packet_len = make_file_transfer_header(buffer, BUFFSIZE, session_token, MAX_FILE_NAME_LEN + file_size);
+    struct stat file_stat;
+    fstat(fileno(file), &file_stat);
+    uint64_t remaining = file_stat.st_size;
+    // send header, with file name, size and checksum
+    ssize_t packet_len = make_file_upload_header(buffer, BUFFSIZE, session_token,
+            file_name, remaining, checksum);
     send(server_socket, buffer, packet_len, 0);
-    // send file name
-    send(server_socket, file_name, MAX_FILE_NAME_LEN, 0);
-    // send the entire file
-    while ((packet_len = make_file_transfer_body(buffer, BUFFSIZE, file)) > 0) {
-        send(server_socket, buffer, packet_len, 0);
+
+    // send the entire file, in FILE_DATA packets
+    char* frame = malloc(HEADER_LEN + MAX_FILE_DATA_LEN);
+    while (remaining > 0) {
+        size_t data_len = remaining < MAX_FILE_DATA_LEN ? remaining : MAX_FILE_DATA_LEN;
+        ssize_t n_read = make_file_transfer_body(frame + HEADER_LEN, data_len, file);
+        if (n_read <= 0) {
+            // the file was truncated while being sent, and the promised
+            // size can't be delivered anymore
+            die_with_error("Failed to read file", file_name);
+        }
+        make_file_data_header(frame, HEADER_LEN, session_token, n_read);
+        send(server_socket, frame, HEADER_LEN + n_read, 0);
+        remaining -= n_read;
     }
+    free(frame);
     fclose(file);
 }
 
@@ -399,33 +709,48 @@ void download_file(int server_socket, char* buffer, uint32_t session_token, cons
     size_t packet_len = make_file_request(buffer, BUFFSIZE, session_token, file_name);
     send(server_socket, buffer, packet_len, 0);
 
-    // receive the file back
-    size_t n_received = receive_packet(server_socket, buffer, BUFFSIZE);
-    struct PacketHeader* header = (struct PacketHeader*) buffer;
-    size_t response_len = ntohs(header->packet_len);
+    // receive the file size
+    char* packet;
+    ssize_t n_received = read_packet(&server_reader, server_socket, &packet);
+    struct PacketHeader* header = (struct PacketHeader*) packet;
+    if (n_received < (ssize_t)(HEADER_LEN + 8) || header->type != TYPE_FILE_TRANSFER) {
+        printf("Failed to download file %s\n", file_name);
+        return;
+    }
+    uint64_t remaining = parse_file_size(packet + HEADER_LEN);
 
     // open a new file to write to
     char* file_path = join_path(CLIENT_DIR, file_name);
     FILE* file = fopen(file_path, "wb");
 
-    // write the file content to file
-    fwrite(buffer + HEADER_LEN, 1, n_received - HEADER_LEN, file);
-
-    // continue to receive more file content and write to file
-    while(n_received < response_len) {
-        int n_new_bytes = recv(server_socket, buffer, BUFFSIZE, 0);
-        if (n_new_bytes <= 0) {
+    // receive the file content, in FILE_DATA packets, and write to file
+    // straight from the reader's buffer
+    uint_fast32_t checksum = 0xFFFFFFFF;  // initial running checksum
+    while (remaining > 0) {
+        n_received = read_packet(&server_reader, server_socket, &packet);
+        header = (struct PacketHeader*) packet;
+        if (n_received < 0 || header->type != TYPE_FILE_DATA
+                || (uint64_t)(n_received - HEADER_LEN) > remaining) {
             // fail to recv
+            printf("Error when receiving file %s\n", file_name);
             fclose(file);
-            remove(file_path);        
+            remove(file_path);
             free(file_path);
             return;
         }
-        n_received += n_new_bytes;
-        fwrite(buffer, 1, n_new_bytes, file);
+        fwrite(packet + HEADER_LEN, 1, n_received - HEADER_LEN, file);
+        checksum = crc32_running_checksum((unsigned char*)packet + HEADER_LEN,
+                n_received - HEADER_LEN, checksum);
+        remaining -= n_received - HEADER_LEN;
     }
 
+    // record the checksum computed on the way, so that the next diff
+    // doesn't read the file again
     fclose(file);
+    struct stat file_stat;
+    if (stat(file_path, &file_stat) == 0) {
+        update_file_index(CLIENT_INDEX, file_name, &file_stat, checksum ^ 0xFFFFFFFF);
+    }
     free(file_path);
 }
 
@@ -460,17 +785,18 @@ uint32_t handle_logon(int server_socket, char* buffer) {
     send(server_socket, buffer, packet_len, 0);
 
     // Receive a session token
-    packet_len = receive_packet(server_socket, buffer, BUFFSIZE);
+    char* packet;
+    packet_len = read_packet(&server_reader, server_socket, &packet);
     if (packet_len <= 0) {
         die_with_error("Failed to login/signup", NULL);
     }
 
-    struct PacketHeader* header = (struct PacketHeader*) buffer;
+    struct PacketHeader* header = (struct PacketHeader*) packet;
     uint32_t session_token = header->session_token;
     
     // Check for error
     if (header->type == TYPE_ERROR) {
-        enum ErrorType error = buffer[HEADER_LEN] & 0xFF;
+        enum ErrorType error = packet[HEADER_LEN] & 0xFF;
         const char* err_msg = "Failed to login";
         if (error == ERROR_SERVER_BUSY) {
             die_with_error(err_msg, "Server busy");
@@ -485,71 +811,84 @@ uint32_t handle_logon(int server_socket, char* buffer) {
     }
 
     printf("\nWelcome, %s!\n", username);
+    server_snapshot_path = malloc(sizeof(SERVER_SNAPSHOT_PREFIX) + strlen(username));
+    sprintf(server_snapshot_path, "%s%s", SERVER_SNAPSHOT_PREFIX, username);
     return session_token;
 }
 
 
 void handle_list(int server_socket, char* buffer, uint32_t session_token) {
-    int n_files;
-    struct FileInfo* server_files = get_server_files(server_socket, buffer, session_token, &n_files);
-    printf("Found %d files on server\n", n_files);
-    if (n_files == 0) {
-        return;        
-    }
-    printf("%-32s%8s\n", "File name", "Checksum");
-    struct FileInfo* cur_file;
-    // print all file infos in the linked list
-    for (cur_file = server_files; cur_file != NULL; cur_file = cur_file->next) {
-        printf("%-32s%8x\n", cur_file->name, cur_file->checksum);
-    }
-    free_file_info(server_files);
+    request_server_files(server_socket, buffer, session_token);
+    // print the file infos of each page as it arrives
+    size_t n_files = 0;
+    bool is_last = false;
+    while (!is_last) {
+        struct FileCatalog* server_files = receive_server_files(server_socket, &is_last);
+        if (n_files == 0 && server_files->n_files > 0) {
+            printf("%-32s%8s\n", "File name", "Checksum");
+        }
+        size_t i;
+        for (i = 0; i < server_files->n_files; i++) {
+            printf("%-32s%8x\n", catalog_file_name(server_files, i), server_files->checksums[i]);
+        }
+        n_files += server_files->n_files;
+        free_file_catalog(server_files);
+    }
+    printf("Found %zu files on server\n", n_files);
 }
 
 
 void handle_diff(int server_socket, char* buffer, uint32_t session_token) {
     // get the diffs of server and client's files
-    struct FileInfo* client_missings;
-    struct FileInfo* server_missings;
+    struct FileCatalog* client_missings;
+    struct FileCatalog* server_missings;
     get_client_server_diffs(server_socket, buffer, session_token, &client_missings, &server_missings);
 
     // print the list of missing files
     printf("Files not in client:\n");
-    struct FileInfo* cur_file;
-    for (cur_file = client_missings; cur_file != NULL; cur_file = cur_file->next) {
-        printf("  %s\n", cur_file->name);
+    size_t i;
+    for (i = 0; i < client_missings->n_files; i++) {
+        printf("  %s\n", catalog_file_name(client_missings, i));
     }
     printf("\nFiles not in server:\n");
-    for (cur_file = server_missings; cur_file != NULL; cur_file = cur_file->next) {
-        printf("  %s\n", cur_file->name);
+    for (i = 0; i < server_missings->n_files; i++) {
+        printf("  %s\n", catalog_file_name(server_missings, i));
     }
 
     // release dynamically allocated resources
-    free_file_info(server_missings);
-    free_file_info(client_missings);
+    free_file_catalog(server_missings);
+    free_file_catalog(client_missings);
 }
 
 
 void handle_sync(int server_socket, char* buffer, uint32_t session_token) {
     // get the diffs of server and client's files
-    struct FileInfo* client_missings;
-    struct FileInfo* server_missings;
+    struct FileCatalog* client_missings;
+    struct FileCatalog* server_missings;
     get_client_server_diffs(server_socket, buffer, session_token, &client_missings, &server_missings);
 
-    struct FileInfo* cur_file;
+    size_t i;
     // upload to server the missing files
-    for (cur_file = server_missings; cur_file != NULL; cur_file = cur_file->next) {
+    for (i = 0; i < server_missings->n_files; i++) {
+        const char* file_name = catalog_file_name(server_missings, i);
         // send file to server
-        upload_file(server_socket, buffer, session_token, cur_file->name);
+        upload_file(server_socket, buffer, session_token, file_name, server_missings->checksums[i]);
         // receive confirmation from server
-        receive_packet(server_socket, buffer, BUFFSIZE);
+        char* packet;
+        ssize_t packet_len = read_packet(&server_reader, server_socket, &packet);
+        struct PacketHeader* header = (struct PacketHeader*) packet;
+        if (packet_len > (ssize_t)HEADER_LEN && header->type == TYPE_ERROR
+                && packet[HEADER_LEN] == ERROR_CHECKSUM_MISMATCH) {
+            printf("File %s was corrupted while uploading\n", file_name);
+        }
     }
 
-    for (cur_file = client_missings; cur_file != NULL; cur_file = cur_file->next) {
+    for (i = 0; i < client_missings->n_files; i++) {
         // download from server
-        download_file(server_socket, buffer, session_token, cur_file->name);
+        download_file(server_socket, buffer, session_token, catalog_file_name(client_missings, i));
     }
 
-    free_file_info(client_missings);
-    free_file_info(server_missings);
+    free_file_catalog(client_missings);
+    free_file_catalog(server_missings);
     printf("Sync completed\n");
 }
@@ -1,6 +1,14 @@
+#define _GNU_SOURCE  // for accept4()
+
 #include "ClientHandler.h"
 
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
 #include <stdbool.h>
+#include <sys/random.h>
+#include <sys/sendfile.h>
+#include <sys/stat.h>
 
 #include "AuthenticationService.h"
 #include "StorageService.h"
@@ -8,8 +16,49 @@
 #include "Protocol.h"
 
 
-/** Global buffer for reading/writing packet */
-static char packet_buffer[BUFFSIZE+1];
+/**
+ * Size of the buffer receiving requests of each client. Requests are at
+ * most MAX_REQUEST_LEN long, and most are small enough that a few
+ * pipelined ones fit at once.
+ */
+#define REQUEST_BUFFER_LEN MAX_REQUEST_LEN
+
+/**
+ * Max number of file bytes moved for a client per event, so that large
+ * transfers don't hold up other clients. This is also the size of the
+ * buffer used for each transfer.
+ */
+#define TRANSFER_SLICE_LEN (8 * BUFFSIZE)
+
+/**
+ * Number of registered io_uring buffers of each client table, which is
+ * also the max number of transfers using io_uring at the same time.
+ * Other transfers use the worker threads.
+ */
+#define N_RING_BUFFERS 64
+
+/** Size of the io_uring submission queue, enough for 2 operations per buffer */
+#define RING_ENTRIES (2 * N_RING_BUFFERS)
+
+_Static_assert((RING_ENTRIES & (RING_ENTRIES - 1)) == 0 && RING_ENTRIES <= MAX_RING_ENTRIES,
+        "io_uring queue size must be a power of 2, at most MAX_RING_ENTRIES");
+
+
+/**
+ * Result of a step of the connection state machine
+ */
+enum StepResult {
+    /** The step completed, continue with the next one */
+    STEP_CONTINUE,
+    /** The socket would block, wait for the next event */
+    STEP_BLOCKED,
+    /** The client used up its share of work for this event */
+    STEP_SLICE_USED,
+    /** Disk work was handed to a worker, wait for it to complete */
+    STEP_WORKING,
+    /** The connection must be closed */
+    STEP_CLOSE,
+};
 
 
 /*
@@ -18,10 +67,213 @@ static char packet_buffer[BUFFSIZE+1];
 
 
 /**
- * Close the connection to a client, and clear the client's info
+ * Close the connection to a client, and release the client's info.
+ * If work is in flight for the client, the release happens when it completes.
+ * @param table       Table storing the client's info
  * @param client_info Address of the struct storing the client's info
  */
-void remove_client(struct ClientInfo* client_info);
+void remove_client(struct ClientTable* table, struct ClientInfo* client_info);
+
+
+/**
+ * Close the client's socket and file, and free the client's info. An
+ * unfinished upload is first discarded by a worker, and the client is
+ * released when the work completes.
+ */
+void release_client(struct ClientTable* table, struct ClientInfo* client_info);
+
+
+/**
+ * Delete the half-received file of an unfinished upload, and record its
+ * removal in the user's change log. Run by a worker.
+ * @param context Address of the client info struct
+ */
+void discard_upload(void* context);
+
+
+/**
+ * Run the client's state machine until the socket would block,
+ * the client uses up its share of work, or the connection is closed
+ * @return true if the connection is still open, false if it was closed
+ */
+bool run_client(struct ClientTable* table, struct ClientInfo* client_info);
+
+
+/**
+ * Receive the rest of the current request. When it's complete, hand it to a worker
+ */
+enum StepResult receive_request(struct ClientTable* table, struct ClientInfo* client_info);
+
+
+/**
+ * Send the rest of the current response
+ */
+enum StepResult send_response(struct ClientInfo* client_info);
+
+
+/**
+ * Make the next page of the LIST response being sent, and send it
+ */
+enum StepResult send_listing_page(struct ClientInfo* client_info);
+
+
+/**
+ * Receive bytes from the client: first the ones its reader received
+ * ahead of the current request, then from the socket
+ * @return Number of bytes received, as recv()
+ */
+ssize_t receive_from_client(struct ClientInfo* client_info, char* buffer, size_t len);
+
+
+/**
+ * Receive a slice of the uploaded file, then hand it to a worker to write it to the file
+ * @param budget [in,out] Number of bytes the client is still allowed to move
+ */
+enum StepResult receive_upload(struct ClientTable* table, struct ClientInfo* client_info, size_t* budget);
+
+
+/**
+ * Receive file content of an upload with splice(), from the socket through
+ * the client's pipe into the file, without copying it through a buffer
+ * @param budget [in,out] Number of bytes the client is still allowed to move
+ */
+enum StepResult splice_upload(struct ClientInfo* client_info, size_t* budget);
+
+
+/**
+ * Create the client's upload pipe, if not created yet
+ * @return true if the client has a pipe, false if it can't be created
+ */
+bool open_upload_pipe(struct ClientInfo* client_info);
+
+
+/**
+ * Send the slice of the downloaded file read by a worker, then hand the
+ * reading of the next slice to a worker
+ * @param budget [in,out] Number of bytes the client is still allowed to move
+ */
+enum StepResult send_download(struct ClientTable* table, struct ClientInfo* client_info, size_t* budget);
+
+
+/**
+ * Send file content of a download with sendfile(), without copying it
+ * through a buffer
+ */
+enum StepResult sendfile_download(struct ClientInfo* client_info, size_t* budget);
+
+
+/**
+ * Receive the header of the next FILE_DATA packet of an upload, and
+ * check that it carries the rest of the file
+ */
+enum StepResult receive_frame_header(struct ClientInfo* client_info);
+
+
+/**
+ * Write the header of the next FILE_DATA packet of a download
+ * @param  header  Address to write the header to
+ * @param  max_len Max number of file bytes carried by the packet
+ * @return Number of file bytes carried by the packet
+ */
+size_t start_download_frame(struct ClientInfo* client_info, char* header, size_t max_len);
+
+
+/**
+ * Hand disk work for the client to a worker thread
+ * @param run Function run by the worker, with the client info as argument
+ */
+void start_work(struct ClientTable* table, struct ClientInfo* client_info, void (*run)(void*));
+
+
+/**
+ * Give the transfer a buffer: a registered io_uring buffer if available,
+ * else a buffer for the worker threads
+ */
+void prepare_transfer_buffer(struct ClientTable* table, struct Transfer* transfer);
+
+
+/**
+ * Queue the io_uring operations moving the next slice of a transfer:
+ * recv() linked to a write for uploads, and read linked to a send() for downloads
+ * @return true if queued, false if the submission queue is full. The
+ *         transfer is then left as it was, to go through the worker threads.
+ */
+bool start_ring_transfer(struct ClientTable* table, struct ClientInfo* client_info);
+
+
+/**
+ * Give up the registered buffer of a transfer whose io_uring operations
+ * can't be queued, for a buffer of the worker threads
+ */
+void fall_back_from_ring(struct ClientTable* table, struct Transfer* transfer);
+
+
+/**
+ * Update the transfer with the results of its completed io_uring operations
+ */
+void complete_ring_transfer(struct ClientTable* table, struct ClientInfo* client_info);
+
+
+/**
+ * Give back the registered io_uring buffer of a transfer, if it has one
+ */
+void release_transfer_ring_buffer(struct ClientTable* table, struct Transfer* transfer);
+
+
+/**
+ * Handle a complete request in the client's request buffer, and prepare
+ * the response and the following phase. Run by a worker.
+ */
+void handle_request(void* context);
+
+
+/**
+ * Write the received slice of an uploaded file. Run by a worker.
+ */
+void write_upload_slice(void* context);
+
+
+/**
+ * Read the next slice of a downloaded file. Run by a worker.
+ */
+void read_download_slice(void* context);
+
+
+/**
+ * Prepare a response of the given length in the client's response buffer
+ * to be sent, then continue with the given phase. The response is stamped
+ * with the client's protocol version, which chose its encoding.
+ */
+void queue_response(struct ClientInfo* client_info, ssize_t response_len,
+        enum ConnectionPhase phase_after_response);
+
+
+/**
+ * Release the file of the current transfer. If an upload didn't complete,
+ * the half-received file is deleted.
+ */
+void end_transfer(struct Transfer* transfer);
+
+
+/**
+ * End a completely received upload, record the new file in the user's
+ * index and change log, and prepare the confirmation. Run by a worker,
+ * since recording the file waits for the locks of the user's files.
+ * @param context Address of the client info struct
+ */
+void complete_upload(void* context);
+
+
+/**
+ * Watch for the socket events needed by the client's current phase
+ */
+void watch_client(struct ClientTable* table, struct ClientInfo* client_info);
+
+
+/**
+ * Add the client to the list of clients resumed by handle_pending_clients()
+ */
+void add_pending_client(struct ClientTable* table, struct ClientInfo* client_info);
 
 
 /**
@@ -46,6 +298,34 @@ ssize_t handle_leave(struct ClientInfo* client_info);
 ssize_t handle_list(struct ClientInfo* client_info, enum ErrorType* error);
 
 
+/**
+ * Handle a DIFF request. Send back the user's files missing from the
+ * client, and the client's files missing from the user directory.
+ */
+ssize_t handle_diff(struct ClientInfo* client_info, enum ErrorType* error);
+
+
+/**
+ * Handle a TREE request. Send back the root hash of the user's files,
+ * or the hashes of the children of the requested nodes.
+ */
+ssize_t handle_tree(struct ClientInfo* client_info, enum ErrorType* error);
+
+
+/**
+ * Handle a LEAF request. Send back the files of the requested leaves
+ * of the user's hash tree.
+ */
+ssize_t handle_leaf(struct ClientInfo* client_info, enum ErrorType* error);
+
+
+/**
+ * Handle a CHANGES request. Send back the user's files changed since the
+ * generation of the change log known to the client.
+ */
+ssize_t handle_changes(struct ClientInfo* client_info, enum ErrorType* error);
+
+
 /**
  * Handle a file request. Send back the file requested
  */
@@ -53,15 +333,15 @@ ssize_t handle_file_request(struct ClientInfo* client_info, enum ErrorType* erro
 
 
 /**
- * Handle a file transfer from client
+ * Handle a file transfer from client. Prepare the file to receive the
+ * content, which is uploaded in the following phase
  */
-ssize_t handle_file_transfer(int n_received, struct ClientInfo* client_info, enum ErrorType* error);
+ssize_t handle_file_transfer(struct ClientInfo* client_info, enum ErrorType* error);
 
 
 
 /**
- * Generate a 32 bit random token. Warning: Not secure random.
- * Used because security is not considered in this project.
+ * Generate a 32 bit random token, from the kernel's random source
  */
 uint32_t generate_random_token();
 
@@ -77,56 +357,785 @@ void initialize_client_handler() {
 }
 
 
-void accept_client(int server_socket, struct ClientInfo* client_infos, int max_connections) {
-    struct sockaddr_in client_addr;
-    socklen_t client_addr_len = sizeof(client_addr);
-    int client_socket = accept(server_socket, (struct sockaddr*) &client_addr, &client_addr_len);
-    if (client_socket < 0) {
-        // an error happens
-        char* error_detail = strerror(client_socket);
-        printf("Error when accepting new client: %s\n", error_detail);
-        return;
+int initialize_client_table(struct ClientTable* table, struct EventLoop* loop,
+        int n_workers, int max_connections, bool use_io_uring) {
+    table->workers = create_worker_pool(n_workers);
+    if (table->workers == NULL) {
+        return -1;
+    }
+    if (add_to_event_loop(loop, table->workers->notify_fd, EVENT_READ) < 0) {
+        free_worker_pool(table->workers);
+        return -1;
+    }
+    table->ring = NULL;
+    if (use_io_uring) {
+        table->ring = create_io_ring(RING_ENTRIES, N_RING_BUFFERS, TRANSFER_SLICE_LEN);
+        if (table->ring == NULL) {
+            printf("io_uring is not supported, transfers use worker threads\n");
+        } else if (add_to_event_loop(loop, table->ring->notify_fd, EVENT_READ) < 0) {
+            free_io_ring(table->ring);
+            table->ring = NULL;
+        }
+    }
+    table->clients = NULL;
+    table->capacity = 0;
+    table->n_clients = 0;
+    table->max_connections = max_connections;
+    table->loop = loop;
+    table->pending = NULL;
+    table->n_pending = 0;
+    table->pending_capacity = 0;
+    return 0;
+}
+
+
+int accept_client(int server_socket, struct ClientTable* table) {
+    int n_accepted = 0;
+    // keep accepting until there is no pending connection, so that no
+    // connection is missed in edge-triggered mode
+    while (true) {
+        struct sockaddr_in client_addr;
+        socklen_t client_addr_len = sizeof(client_addr);
+        int client_socket = accept4(server_socket, (struct sockaddr*) &client_addr,
+                &client_addr_len, SOCK_NONBLOCK);
+        if (client_socket < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                // an error happens
+                printf("Error when accepting new client: %s\n", strerror(errno));
+            }
+            return n_accepted;
+        }
+
+        if (table->n_clients >= table->max_connections) {
+            // max number of clients has been reached
+            // so we reject this new client
+            printf("Reject client, max number of connections exceeded\n");
+            char response[HEADER_LEN + 1];
+            ssize_t response_len = make_error_response(
+                    response, sizeof(response), 0, ERROR_SERVER_BUSY);
+            send(client_socket, response, response_len, MSG_NOSIGNAL);
+            close(client_socket);
+            continue;
+        }
+
+        // grow the table so that the socket descriptor has a slot
+        if (client_socket >= table->capacity) {
+            int new_capacity = table->capacity > 0 ? table->capacity : 64;
+            while (new_capacity <= client_socket) {
+                new_capacity *= 2;
+            }
+            table->clients = realloc(table->clients, new_capacity * sizeof(struct ClientInfo*));
+            memset(table->clients + table->capacity, 0,
+                    (new_capacity - table->capacity) * sizeof(struct ClientInfo*));
+            table->capacity = new_capacity;
+        }
+
+        // watch the new client for incoming requests
+        if (add_to_event_loop(table->loop, client_socket, EVENT_READ) < 0) {
+            printf("Error when watching new client: %s\n", strerror(errno));
+            close(client_socket);
+            continue;
+        }
+
+        // set up book-keeping data for the new client
+        struct ClientInfo* client_info = calloc(1, sizeof(struct ClientInfo));
+        client_info->client_socket = client_socket;
+        client_info->phase = PHASE_RECEIVE_REQUEST;
+        client_info->watched_events = EVENT_READ;
+        client_info->transfer.file_fd = -1;
+        client_info->transfer.ring_buffer = -1;
+        init_packet_reader(&client_info->reader, REQUEST_BUFFER_LEN);
+        client_info->upload_pipe[0] = -1;
+        client_info->upload_pipe[1] = -1;
+        client_info->work.context = client_info;
+        table->clients[client_socket] = client_info;
+        table->n_clients++;
+        n_accepted++;
+        printf("Accepted new client, assigned client ID = %d\n", client_socket);
+    }
+}
+
+
+bool handle_client(struct ClientTable* table, int client_socket, uint32_t events) {
+    struct ClientInfo* client_info = table->clients[client_socket];
+    if (client_info->is_working) {
+        // no event is watched while a worker has the client,
+        // so this is a reset or hang up
+        if (events & EVENT_ERROR) {
+            remove_client(table, client_info);
+            return false;
+        }
+        return true;
     }
-    // find an empty array slot to store client info
+    return run_client(table, client_info);
+}
+
+
+void handle_completed_work(struct ClientTable* table) {
+    struct WorkItem* item = take_completed_work(table->workers);
+    while (item != NULL) {
+        // the item is reused if the client starts new work
+        struct WorkItem* next = item->next;
+        struct ClientInfo* client_info = item->context;
+        client_info->is_working = false;
+        if (client_info->transfer.file_fd < 0) {
+            // the worker ended a transfer using a registered io_uring buffer
+            release_transfer_ring_buffer(table, &client_info->transfer);
+        }
+        if (client_info->is_closed) {
+            release_client(table, client_info);
+        } else {
+            run_client(table, client_info);
+        }
+        item = next;
+    }
+}
+
+
+void handle_ring_completions(struct ClientTable* table) {
+    struct IoRing* ring = table->ring;
+    clear_ring_notification(ring);
+
+    struct IoCompletion completion;
+    while (next_ring_completion(ring, &completion)) {
+        // the lowest bit tells which operation of the pair completed
+        struct ClientInfo* client_info = (struct ClientInfo*)(uintptr_t)(completion.user_data & ~1ULL);
+        struct Transfer* transfer = &client_info->transfer;
+        transfer->ring_results[completion.user_data & 1] = completion.result;
+        if (--transfer->n_ring_operations > 0) {
+            continue;
+        }
+
+        client_info->is_working = false;
+        if (client_info->is_closed) {
+            release_client(table, client_info);
+        } else {
+            complete_ring_transfer(table, client_info);
+            run_client(table, client_info);
+        }
+    }
+}
+
+
+void submit_queued_io(struct ClientTable* table) {
+    if (table->ring != NULL) {
+        submit_io_ring(table->ring);
+    }
+}
+
+
+bool has_pending_clients(struct ClientTable* table) {
+    return table->n_pending > 0;
+}
+
+
+void handle_pending_clients(struct ClientTable* table) {
+    // take the current list, since clients may be added back while
+    // they are resumed
+    int n_pending = table->n_pending;
+    int* pending = malloc(n_pending * sizeof(int));
+    memcpy(pending, table->pending, n_pending * sizeof(int));
+    table->n_pending = 0;
+
     int i;
-    for (i = 0; i < max_connections; i++) {
-        if (client_infos[i].client_socket <= 0) {
-            client_infos[i].client_socket = client_socket;  
-            printf("Accepted new client, assigned client ID = %d\n", i);
+    for (i = 0; i < n_pending; i++) {
+        struct ClientInfo* client_info = table->clients[pending[i]];
+        // the client may have been removed since it was added
+        if (client_info == NULL || !client_info->is_pending) {
+            continue;
+        }
+        client_info->is_pending = false;
+        if (!client_info->is_working) {
+            run_client(table, client_info);
+        }
+    }
+    free(pending);
+}
+
+
+/*
+ * Helper function implementations
+ */
+
+
+bool run_client(struct ClientTable* table, struct ClientInfo* client_info) {
+    // the number of file bytes this client can move before yielding
+    size_t budget = TRANSFER_SLICE_LEN;
+    while (true) {
+        enum StepResult result = STEP_CLOSE;
+        switch (client_info->phase) {
+            case PHASE_RECEIVE_REQUEST:
+                result = receive_request(table, client_info);
+                break;
+            case PHASE_SEND_RESPONSE:
+                result = send_response(client_info);
+                break;
+            case PHASE_SEND_LISTING:
+                result = send_listing_page(client_info);
+                break;
+            case PHASE_UPLOAD:
+                result = receive_upload(table, client_info, &budget);
+                break;
+            case PHASE_DOWNLOAD:
+                result = send_download(table, client_info, &budget);
+                break;
+            case PHASE_CLOSE:
+                result = STEP_CLOSE;
+                break;
+        }
+
+        switch (result) {
+            case STEP_CONTINUE:
+                break;
+            case STEP_BLOCKED:
+                watch_client(table, client_info);
+                return true;
+            case STEP_SLICE_USED:
+                add_pending_client(table, client_info);
+                return true;
+            case STEP_WORKING:
+                watch_client(table, client_info);
+                return true;
+            case STEP_CLOSE:
+                remove_client(table, client_info);
+                return false;
+        }
+    }
+}
+
+
+enum StepResult receive_request(struct ClientTable* table, struct ClientInfo* client_info) {
+    // a request may already be buffered, received together with the
+    // previous one. Otherwise receive more, as much as the buffer takes.
+    struct PacketReader* reader = &client_info->reader;
+    while (true) {
+        const struct PacketHeader* header = peek_packet_header(reader);
+        if (header != NULL) {
+            size_t request_len = ntohs(header->packet_len);
+            if (header->type == TYPE_FILE_TRANSFER && !has_framed_transfers(header->version)) {
+                // only the file name is part of the request,
+                // the file content is received in the upload phase
+                request_len = HEADER_LEN + MAX_FILE_NAME_LEN;
+            }
+            if (request_len < HEADER_LEN || request_len > MAX_REQUEST_LEN) {
+                printf("Error when receiving packet\n");
+                return STEP_CLOSE;
+            }
+            client_info->request = take_bytes(reader, request_len);
+            if (client_info->request != NULL) {
+                client_info->request_len = request_len;
+                break;
+            }
+        }
+
+        ssize_t n_new_bytes = fill_packet_reader(reader, client_info->client_socket);
+        if (n_new_bytes < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return STEP_BLOCKED;
+        }
+        if (n_new_bytes <= 0) {
+            // always close the session if any error happens
+            if (n_new_bytes < 0 || buffered_len(reader) > 0) {
+                printf("Error when receiving packet\n");
+            }
+            return STEP_CLOSE;
+        }
+    }
+
+    // requests may touch the disk (password database, directory scans,
+    // opening files), so they are handled by a worker
+    start_work(table, client_info, handle_request);
+    return STEP_WORKING;
+}
+
+
+enum StepResult send_response(struct ClientInfo* client_info) {
+    while (client_info->response_sent < client_info->response_len) {
+        ssize_t n_sent = send(client_info->client_socket,
+                client_info->response + client_info->response_sent,
+                client_info->response_len - client_info->response_sent, MSG_NOSIGNAL);
+        if (n_sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return STEP_BLOCKED;
+        }
+        if (n_sent < 0) {
+            return STEP_CLOSE;
+        }
+        client_info->response_sent += n_sent;
+    }
+    client_info->phase = client_info->phase_after_response;
+    return STEP_CONTINUE;
+}
+
+
+enum StepResult send_listing_page(struct ClientInfo* client_info) {
+    ssize_t response_len = make_list_response(client_info->response, BUFFSIZE,
+            client_info->session_token, client_info->listing,
+            client_info->version, &client_info->listing_next);
+    if (response_len < 0) {
+        return STEP_CLOSE;
+    }
+    if (client_info->listing_next < client_info->listing->n_files) {
+        queue_response(client_info, response_len, PHASE_SEND_LISTING);
+    } else {
+        free_file_catalog(client_info->listing);
+        client_info->listing = NULL;
+        queue_response(client_info, response_len, PHASE_RECEIVE_REQUEST);
+    }
+    return STEP_CONTINUE;
+}
+
+
+ssize_t receive_from_client(struct ClientInfo* client_info, char* buffer, size_t len) {
+    if (buffered_len(&client_info->reader) > 0) {
+        return copy_bytes(&client_info->reader, buffer, len);
+    }
+    return recv(client_info->client_socket, buffer, len, 0);
+}
+
+
+enum StepResult receive_upload(struct ClientTable* table, struct ClientInfo* client_info, size_t* budget) {
+    struct Transfer* transfer = &client_info->transfer;
+    if (transfer->remaining == 0 && transfer->buffered == 0) {
+        // the whole file is written, a worker records it
+        start_work(table, client_info, complete_upload);
+        return STEP_WORKING;
+    }
+    // file content received together with the request is copied out of
+    // the request buffer, and written with the buffered path. The rest goes
+    // from the socket straight to the file, unless it must be checksummed
+    // on the way: spliced content never reaches the server's memory.
+    bool has_buffered_content = buffered_len(&client_info->reader) > 0 || transfer->buffered > 0;
+    if (!has_buffered_content && !transfer->has_client_checksum && table->ring == NULL
+            && open_upload_pipe(client_info)) {
+        transfer->is_checksummed = false;
+        return splice_upload(client_info, budget);
+    }
+    if (transfer->buffer == NULL) {
+        prepare_transfer_buffer(table, transfer);
+    }
+    if (!has_buffered_content && transfer->ring_buffer >= 0) {
+        if (transfer->frame_remaining == 0 && transfer->remaining > 0) {
+            enum StepResult result = receive_frame_header(client_info);
+            if (result != STEP_CONTINUE) {
+                return result;
+            }
+        }
+        // io_uring receives the packet content and writes it to the file
+        if (start_ring_transfer(table, client_info)) {
+            return STEP_WORKING;
+        }
+        fall_back_from_ring(table, transfer);
+    }
+
+    // fill the buffer, then hand it to a worker to be written
+    while (transfer->remaining > 0 && transfer->buffered < TRANSFER_SLICE_LEN) {
+        if (*budget == 0) {
+            return STEP_SLICE_USED;
+        }
+        if (transfer->frame_remaining == 0) {
+            enum StepResult result = receive_frame_header(client_info);
+            if (result != STEP_CONTINUE) {
+                return result;
+            }
+        }
+        size_t chunk_len = TRANSFER_SLICE_LEN - transfer->buffered;
+        if (chunk_len > transfer->frame_remaining) {
+            chunk_len = transfer->frame_remaining;
+        }
+        if (chunk_len > *budget) {
+            chunk_len = *budget;
+        }
+        ssize_t n_new_bytes = receive_from_client(client_info,
+                transfer->buffer + transfer->buffered, chunk_len);
+        if (n_new_bytes < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return STEP_BLOCKED;
+        }
+        if (n_new_bytes <= 0) {
+            // fail to recv, the half-received file is deleted
+            printf("Error when receiving file\n");
+            return STEP_CLOSE;
+        }
+        transfer->buffered += n_new_bytes;
+        transfer->remaining -= n_new_bytes;
+        transfer->frame_remaining -= n_new_bytes;
+        *budget -= n_new_bytes;
+    }
+
+    start_work(table, client_info, write_upload_slice);
+    return STEP_WORKING;
+}
+
+
+enum StepResult splice_upload(struct ClientInfo* client_info, size_t* budget) {
+    struct Transfer* transfer = &client_info->transfer;
+    while (transfer->remaining > 0) {
+        if (*budget == 0) {
+            return STEP_SLICE_USED;
+        }
+        if (transfer->frame_remaining == 0) {
+            enum StepResult result = receive_frame_header(client_info);
+            if (result != STEP_CONTINUE) {
+                return result;
+            }
+        }
+        size_t chunk_len = transfer->frame_remaining < *budget ? transfer->frame_remaining : *budget;
+        if (chunk_len > TRANSFER_SLICE_LEN) {
+            chunk_len = TRANSFER_SLICE_LEN;
+        }
+        // move what the socket has into the pipe
+        ssize_t n_piped = splice(client_info->client_socket, NULL, client_info->upload_pipe[1], NULL,
+                chunk_len, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (n_piped < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return STEP_BLOCKED;
+        }
+        if (n_piped <= 0) {
+            // fail to recv, the half-received file is deleted
+            printf("Error when receiving file\n");
+            return STEP_CLOSE;
+        }
+        transfer->remaining -= n_piped;
+        transfer->frame_remaining -= n_piped;
+        *budget -= n_piped;
+
+        // then empty the pipe into the file, so it's never full when
+        // moving more from the socket
+        while (n_piped > 0) {
+            ssize_t n_written = splice(client_info->upload_pipe[0], NULL, transfer->file_fd,
+                    &transfer->offset, n_piped, SPLICE_F_MOVE);
+            if (n_written <= 0) {
+                printf("Error when writing file\n");
+                return STEP_CLOSE;
+            }
+            n_piped -= n_written;
+        }
+    }
+
+    // receive_upload() then hands the file to a worker to be recorded
+    return STEP_CONTINUE;
+}
+
+
+bool open_upload_pipe(struct ClientInfo* client_info) {
+    if (client_info->upload_pipe[0] >= 0) {
+        return true;
+    }
+    if (pipe2(client_info->upload_pipe, O_NONBLOCK | O_CLOEXEC) < 0) {
+        client_info->upload_pipe[0] = -1;
+        client_info->upload_pipe[1] = -1;
+        return false;
+    }
+    // room for a whole slice, so that a splice() from the socket isn't cut short
+    fcntl(client_info->upload_pipe[1], F_SETPIPE_SZ, TRANSFER_SLICE_LEN);
+    return true;
+}
+
+
+enum StepResult send_download(struct ClientTable* table, struct ClientInfo* client_info, size_t* budget) {
+    struct Transfer* transfer = &client_info->transfer;
+    if (transfer->use_sendfile) {
+        return sendfile_download(client_info, budget);
+    }
+    if (transfer->buffer == NULL) {
+        prepare_transfer_buffer(table, transfer);
+    }
+    if (transfer->ring_buffer >= 0 && transfer->buffer_sent == transfer->buffered) {
+        if (transfer->remaining == 0) {
+            release_transfer_ring_buffer(table, transfer);
+            end_transfer(transfer);
+            printf("File sent to client\n");
+            client_info->phase = PHASE_RECEIVE_REQUEST;
+            return STEP_CONTINUE;
+        }
+        // io_uring reads the slice and sends it
+        transfer->buffered = 0;
+        transfer->buffer_sent = 0;
+        if (start_ring_transfer(table, client_info)) {
+            return STEP_WORKING;
+        }
+        fall_back_from_ring(table, transfer);
+    }
+
+    // send the slice read by the worker, or the rest of a slice that
+    // io_uring only sent in part
+    while (transfer->buffer_sent < transfer->buffered) {
+        if (*budget == 0) {
+            return STEP_SLICE_USED;
+        }
+        size_t chunk_len = transfer->buffered - transfer->buffer_sent;
+        if (chunk_len > *budget) {
+            chunk_len = *budget;
+        }
+        ssize_t n_sent = send(client_info->client_socket,
+                transfer->buffer + transfer->buffer_sent, chunk_len, MSG_NOSIGNAL);
+        if (n_sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return STEP_BLOCKED;
+        }
+        if (n_sent < 0) {
+            return STEP_CLOSE;
+        }
+        transfer->buffer_sent += n_sent;
+        *budget -= n_sent;
+    }
+    if (transfer->ring_buffer >= 0) {
+        // back to io_uring for the next slice
+        return STEP_CONTINUE;
+    }
+
+    if (transfer->remaining == 0) {
+        end_transfer(transfer);
+        printf("File sent to client\n");
+        client_info->phase = PHASE_RECEIVE_REQUEST;
+        return STEP_CONTINUE;
+    }
+    if (*budget == 0) {
+        return STEP_SLICE_USED;
+    }
+
+    // hand the reading of the next slice to a worker
+    start_work(table, client_info, read_download_slice);
+    return STEP_WORKING;
+}
+
+
+enum StepResult sendfile_download(struct ClientInfo* client_info, size_t* budget) {
+    struct Transfer* transfer = &client_info->transfer;
+    while (transfer->remaining > 0) {
+        if (*budget == 0) {
+            return STEP_SLICE_USED;
+        }
+        if (transfer->frame_remaining == 0) {
+            start_download_frame(client_info, transfer->frame_header, MAX_FILE_DATA_LEN);
+            transfer->frame_header_done = 0;
+        }
+        // the packet header goes first
+        while (transfer->is_framed && transfer->frame_header_done < HEADER_LEN) {
+            ssize_t n_sent = send(client_info->client_socket,
+                    transfer->frame_header + transfer->frame_header_done,
+                    HEADER_LEN - transfer->frame_header_done, MSG_NOSIGNAL);
+            if (n_sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+                return STEP_BLOCKED;
+            }
+            if (n_sent < 0) {
+                return STEP_CLOSE;
+            }
+            transfer->frame_header_done += n_sent;
+        }
+
+        size_t chunk_len = transfer->frame_remaining < *budget ? transfer->frame_remaining : *budget;
+        ssize_t n_sent = sendfile(client_info->client_socket, transfer->file_fd,
+                &transfer->offset, chunk_len);
+        if (n_sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return STEP_BLOCKED;
+        }
+        if (n_sent <= 0) {
+            // connection closed, or the file was truncated while being sent
+            printf("Error when sending file\n");
+            return STEP_CLOSE;
+        }
+        transfer->remaining -= n_sent;
+        transfer->frame_remaining -= n_sent;
+        *budget -= n_sent;
+    }
+
+    end_transfer(transfer);
+    printf("File sent to client\n");
+    client_info->phase = PHASE_RECEIVE_REQUEST;
+    return STEP_CONTINUE;
+}
+
+
+enum StepResult receive_frame_header(struct ClientInfo* client_info) {
+    struct Transfer* transfer = &client_info->transfer;
+    while (transfer->frame_header_done < HEADER_LEN) {
+        ssize_t n_new_bytes = receive_from_client(client_info,
+                transfer->frame_header + transfer->frame_header_done,
+                HEADER_LEN - transfer->frame_header_done);
+        if (n_new_bytes < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return STEP_BLOCKED;
+        }
+        if (n_new_bytes <= 0) {
+            printf("Error when receiving file\n");
+            return STEP_CLOSE;
+        }
+        transfer->frame_header_done += n_new_bytes;
+    }
+    transfer->frame_header_done = 0;
+
+    struct PacketHeader* header = (struct PacketHeader*)transfer->frame_header;
+    size_t packet_len = ntohs(header->packet_len);
+    if (header->type != TYPE_FILE_DATA || header->session_token != client_info->session_token
+            || packet_len <= HEADER_LEN || packet_len - HEADER_LEN > MAX_FILE_DATA_LEN
+            || packet_len - HEADER_LEN > transfer->remaining) {
+        printf("Error when receiving file: malformed data packet\n");
+        return STEP_CLOSE;
+    }
+    transfer->frame_remaining = packet_len - HEADER_LEN;
+    return STEP_CONTINUE;
+}
+
+
+size_t start_download_frame(struct ClientInfo* client_info, char* header, size_t max_len) {
+    struct Transfer* transfer = &client_info->transfer;
+    size_t data_len = transfer->remaining;
+    if (data_len > MAX_FILE_DATA_LEN) {
+        data_len = MAX_FILE_DATA_LEN;
+    }
+    if (data_len > max_len) {
+        data_len = max_len;
+    }
+    make_file_data_header(header, HEADER_LEN, client_info->session_token, data_len);
+    ((struct PacketHeader*)header)->version = client_info->version;
+    transfer->frame_remaining = data_len;
+    return data_len;
+}
+
+
+void start_work(struct ClientTable* table, struct ClientInfo* client_info, void (*run)(void*)) {
+    client_info->work.run = run;
+    client_info->is_working = true;
+    submit_work(table->workers, &client_info->work);
+}
+
+
+void prepare_transfer_buffer(struct ClientTable* table, struct Transfer* transfer) {
+    if (table->ring != NULL) {
+        transfer->ring_buffer = acquire_ring_buffer(table->ring);
+        if (transfer->ring_buffer >= 0) {
+            transfer->buffer = ring_buffer_address(table->ring, transfer->ring_buffer);
             return;
         }
     }
-    // if get to here, max number of clients has been reached
-    // so we reject this new client
-    printf("Reject client, max number of connections exceeded\n");
-    ssize_t response_len = make_error_response(
-            packet_buffer, BUFFSIZE, 0, ERROR_SERVER_BUSY);
-    send(client_socket, packet_buffer, response_len, 0);
-    close(client_socket);
+    transfer->buffer = malloc(TRANSFER_SLICE_LEN);
 }
 
 
-void handle_client(struct ClientInfo* client_info) {
-    ssize_t request_len = receive_packet(client_info->client_socket, packet_buffer, BUFFSIZE);
-    if (request_len <= 0) {
-        // always close the session if any error happens
-        printf("Error when receiving packet\n");
-        remove_client(client_info);
+bool start_ring_transfer(struct ClientTable* table, struct ClientInfo* client_info) {
+    struct Transfer* transfer = &client_info->transfer;
+    uint64_t user_data = (uintptr_t)client_info;
+    // both operations are reserved first, so that a full queue never
+    // leaves the first one queued without the second
+    if (!reserve_ring_entries(table->ring, 2)) {
+        printf("io_uring submission queue is full\n");
+        return false;
+    }
+
+    // the second operation of the pair only starts if the first one moved
+    // the whole slice. Both are submitted together with other clients'
+    // operations in submit_queued_io().
+    if (client_info->phase == PHASE_UPLOAD) {
+        // the content of the current FILE_DATA packet (or the whole file for version 1)
+        size_t len = transfer->frame_remaining < TRANSFER_SLICE_LEN
+                ? transfer->frame_remaining : TRANSFER_SLICE_LEN;
+        queue_ring_recv(table->ring, client_info->client_socket, transfer->ring_buffer,
+                len, true, user_data);
+        queue_ring_write(table->ring, transfer->file_fd, transfer->ring_buffer,
+                len, transfer->offset, false, user_data | 1);
+        transfer->ring_expected[0] = len;
+        transfer->ring_expected[1] = len;
+    } else {
+        // a whole FILE_DATA packet is sent from the buffer, header first
+        size_t header_len = 0;
+        size_t len = transfer->remaining < TRANSFER_SLICE_LEN ? transfer->remaining : TRANSFER_SLICE_LEN;
+        if (transfer->is_framed) {
+            header_len = HEADER_LEN;
+            len = start_download_frame(client_info, transfer->buffer, TRANSFER_SLICE_LEN - header_len);
+        }
+        queue_ring_read(table->ring, transfer->file_fd, transfer->ring_buffer, header_len,
+                len, transfer->offset, true, user_data);
+        queue_ring_send(table->ring, client_info->client_socket, transfer->ring_buffer,
+                header_len + len, false, user_data | 1);
+        transfer->ring_expected[0] = len;
+        transfer->ring_expected[1] = header_len + len;
+    }
+    transfer->n_ring_operations = 2;
+    client_info->is_working = true;
+    return true;
+}
+
+
+void complete_ring_transfer(struct ClientTable* table, struct ClientInfo* client_info) {
+    struct Transfer* transfer = &client_info->transfer;
+    int32_t n_moved = transfer->ring_results[0];
+    if (client_info->phase == PHASE_UPLOAD && n_moved > 0 && n_moved < transfer->ring_expected[0]) {
+        // kernels before 5.18 don't retry a recv() cut short, even with
+        // MSG_WAITALL. The linked write is cancelled, or writes the stale
+        // end of the buffer, which is written over later. The bytes received
+        // stay in the buffer, which receive_upload() fills before a worker
+        // checksums and writes it.
+        transfer->buffered = n_moved;
+        transfer->remaining -= n_moved;
+        transfer->frame_remaining -= n_moved;
         return;
     }
-    struct PacketHeader* header = (struct PacketHeader*)packet_buffer;
+    int32_t n_sent = transfer->ring_results[1];
+    bool is_short_send = client_info->phase == PHASE_DOWNLOAD
+            && n_sent > 0 && n_sent < transfer->ring_expected[1];
+    if (n_moved != transfer->ring_expected[0]
+            || (n_sent != transfer->ring_expected[1] && !is_short_send)) {
+        // connection closed, or file truncated while being sent.
+        // A half-received file is deleted when the client is removed.
+        printf("Error when transferring file\n");
+        client_info->phase = PHASE_CLOSE;
+        return;
+    }
+    if (client_info->phase == PHASE_UPLOAD) {
+        transfer->checksum = crc32_running_checksum((unsigned char*)transfer->buffer,
+                n_moved, transfer->checksum);
+    }
+    transfer->offset += n_moved;
+    transfer->remaining -= n_moved;
+    transfer->frame_remaining = 0;
+    if (is_short_send) {
+        // likewise for a send() cut short: send_download() sends the
+        // rest of the packet from the buffer
+        transfer->buffered = transfer->ring_expected[1];
+        transfer->buffer_sent = n_sent;
+    }
+
+    // a completed upload is recorded by receive_upload(), on the next step
+    if (client_info->phase == PHASE_UPLOAD && transfer->remaining == 0) {
+        release_transfer_ring_buffer(table, transfer);
+    }
+}
+
+
+void fall_back_from_ring(struct ClientTable* table, struct Transfer* transfer) {
+    release_transfer_ring_buffer(table, transfer);
+    transfer->buffer = malloc(TRANSFER_SLICE_LEN);
+}
+
+
+void release_transfer_ring_buffer(struct ClientTable* table, struct Transfer* transfer) {
+    if (transfer->ring_buffer >= 0) {
+        release_ring_buffer(table->ring, transfer->ring_buffer);
+        transfer->ring_buffer = -1;
+        transfer->buffer = NULL;
+    }
+}
+
+
+void handle_request(void* context) {
+    struct ClientInfo* client_info = context;
+    struct PacketHeader* header = (struct PacketHeader*)client_info->request;
+    ssize_t request_len = client_info->request_len;
     
     // check if the header token is correct
     uint32_t session_token = header->session_token;
     if(session_token != client_info->session_token) {
         printf("Wrong session token!\n");
-        remove_client(client_info);
+        client_info->phase = PHASE_CLOSE;
+        return;
+    }
+    if (header->version < MIN_VERSION || header->version > VERSION) {
+        printf("Unsupported protocol version %d\n", header->version);
+        client_info->phase = PHASE_CLOSE;
         return;
     }
+    client_info->version = header->version;
 
     // construct response packet
     ssize_t response_len = -1;
     enum ErrorType error = ERROR_UNKNOWN;
+    enum ConnectionPhase phase_after_response = PHASE_RECEIVE_REQUEST;
     switch (header->type) {
         case TYPE_SIGNUP_REQUEST:
             response_len = handle_logon(request_len, client_info, true, &error);
@@ -140,43 +1149,247 @@ void handle_client(struct ClientInfo* client_info) {
         case TYPE_LIST_REQUEST:
             response_len = handle_list(client_info, &error);
             break;
+        case TYPE_DIFF_REQUEST:
+            response_len = handle_diff(client_info, &error);
+            break;
+        case TYPE_TREE_REQUEST:
+            response_len = handle_tree(client_info, &error);
+            break;
+        case TYPE_LEAF_REQUEST:
+            response_len = handle_leaf(client_info, &error);
+            break;
+        case TYPE_CHANGES_REQUEST:
+            response_len = handle_changes(client_info, &error);
+            break;
         case TYPE_FILE_REQUEST:
             response_len = handle_file_request(client_info, &error);
             break;
         case TYPE_FILE_TRANSFER:
-            response_len = handle_file_transfer(request_len, client_info, &error);
+            response_len = handle_file_transfer(client_info, &error);
             break;
     }
     if (response_len < 0) {
         // fatal error while handling client request
-        // close connection immediately
+        // close connection after sending the error
         response_len = make_error_response(
-                packet_buffer, BUFFSIZE, client_info->session_token, error);
-        send(client_info->client_socket, packet_buffer, response_len, 0);
-        remove_client(client_info);
+                client_info->response, BUFFSIZE, client_info->session_token, error);
+        phase_after_response = PHASE_CLOSE;
+    } else if (client_info->transfer.file_fd >= 0) {
+        // the request started a file transfer
+        phase_after_response = (header->type == TYPE_FILE_TRANSFER) ? PHASE_UPLOAD : PHASE_DOWNLOAD;
+        if (response_len == 0) {
+            client_info->phase = phase_after_response;
+            return;
+        }
+    } else if (client_info->listing != NULL) {
+        // the rest of the list follows, page by page
+        phase_after_response = PHASE_SEND_LISTING;
+    }
+
+    // send back response packet
+    queue_response(client_info, response_len, phase_after_response);
+}
+
+
+void write_upload_slice(void* context) {
+    struct ClientInfo* client_info = context;
+    struct Transfer* transfer = &client_info->transfer;
+
+    size_t n_written = 0;
+    while (n_written < transfer->buffered) {
+        ssize_t n_new_bytes = pwrite(transfer->file_fd, transfer->buffer + n_written,
+                transfer->buffered - n_written, transfer->offset + n_written);
+        if (n_new_bytes <= 0) {
+            // the half-received file is deleted when the client is removed
+            printf("Error when writing file\n");
+            client_info->phase = PHASE_CLOSE;
+            return;
+        }
+        n_written += n_new_bytes;
+    }
+    transfer->checksum = crc32_running_checksum((unsigned char*)transfer->buffer,
+            n_written, transfer->checksum);
+    transfer->offset += n_written;
+    transfer->buffered = 0;
+
+    if (transfer->remaining > 0) {
+        // continue to receive more file content
+        client_info->phase = PHASE_UPLOAD;
         return;
-    } else if (response_len == 0) {
+    }
+
+    complete_upload(client_info);
+}
+
+
+void read_download_slice(void* context) {
+    struct ClientInfo* client_info = context;
+    struct Transfer* transfer = &client_info->transfer;
+
+    // a FILE_DATA packet header goes before the content, once its length is known
+    size_t header_len = transfer->is_framed ? HEADER_LEN : 0;
+    size_t chunk_len = transfer->remaining < TRANSFER_SLICE_LEN - header_len
+            ? transfer->remaining : TRANSFER_SLICE_LEN - header_len;
+    if (transfer->is_framed && chunk_len > MAX_FILE_DATA_LEN) {
+        chunk_len = MAX_FILE_DATA_LEN;
+    }
+    ssize_t n_read = pread(transfer->file_fd, transfer->buffer + header_len, chunk_len, transfer->offset);
+    if (n_read <= 0) {
+        // the file was truncated while being sent, and the promised
+        // length can't be delivered anymore
+        printf("Error when reading file\n");
+        client_info->phase = PHASE_CLOSE;
         return;
     }
+    if (transfer->is_framed) {
+        make_file_data_header(transfer->buffer, HEADER_LEN, client_info->session_token, n_read);
+        ((struct PacketHeader*)transfer->buffer)->version = client_info->version;
+    }
+    transfer->offset += n_read;
+    transfer->remaining -= n_read;
+    transfer->buffered = header_len + n_read;
+    transfer->buffer_sent = 0;
+    client_info->phase = PHASE_DOWNLOAD;
+}
 
-    // send back response packet
-    send(client_info->client_socket, packet_buffer, response_len, 0);
+
+void queue_response(struct ClientInfo* client_info, ssize_t response_len,
+        enum ConnectionPhase phase_after_response) {
+    if (response_len >= HEADER_LEN) {
+        ((struct PacketHeader*)client_info->response)->version = client_info->version;
+    }
+    client_info->response_len = response_len;
+    client_info->response_sent = 0;
+    client_info->phase = PHASE_SEND_RESPONSE;
+    client_info->phase_after_response = phase_after_response;
 }
 
 
-/*
- * Helper function implementations
- */
+void end_transfer(struct Transfer* transfer) {
+    if (transfer->file_fd >= 0) {
+        close(transfer->file_fd);
+    }
+    if (transfer->file_path != NULL) {
+        if (transfer->remaining > 0 || transfer->buffered > 0) {
+            // delete the half-received file
+            remove(transfer->file_path);
+        }
+        free(transfer->file_path);
+    }
+    // a registered io_uring buffer is given back by the event loop thread,
+    // since a worker may end the transfer
+    if (transfer->ring_buffer < 0) {
+        free(transfer->buffer);
+        transfer->buffer = NULL;
+    }
+    transfer->file_fd = -1;
+    transfer->file_path = NULL;
+    transfer->offset = 0;
+    transfer->remaining = 0;
+    transfer->buffered = 0;
+    transfer->buffer_sent = 0;
+    transfer->use_sendfile = false;
+    transfer->is_checksummed = false;
+    transfer->has_client_checksum = false;
+    transfer->is_framed = false;
+    transfer->frame_remaining = 0;
+    transfer->frame_header_done = 0;
+}
+
+
+void complete_upload(void* context) {
+    struct ClientInfo* client_info = context;
+    struct Transfer* transfer = &client_info->transfer;
+    const char* file_name = strrchr(transfer->file_path, '/') + 1;
+    uint32_t checksum = transfer->checksum ^ 0xFFFFFFFF;
+    if (transfer->is_checksummed && transfer->has_client_checksum
+            && checksum != transfer->client_checksum) {
+        // the content was corrupted in transit. The file is deleted,
+        // and the client may upload it again.
+        printf("Checksum mismatch for file %s\n", file_name);
+        remove(transfer->file_path);
+        record_user_file_change(client_info->username, file_name, 0, false, true);
+        end_transfer(transfer);
+        queue_response(client_info,
+                make_error_response(client_info->response, BUFFSIZE,
+                        client_info->session_token, ERROR_CHECKSUM_MISMATCH),
+                PHASE_RECEIVE_REQUEST);
+        return;
+    }
+
+    // record the checksum computed on the way, so that the file isn't read
+    // again to list it. Else the file was rewritten, and its indexed
+    // checksum is stale even if its size and modification time look the same.
+    struct stat file_stat;
+    if (transfer->is_checksummed && fstat(transfer->file_fd, &file_stat) == 0) {
+        update_user_file_index(client_info->username, file_name, &file_stat, checksum);
+    } else {
+        update_user_file_index(client_info->username, file_name, NULL, 0);
+    }
+    record_user_file_change(client_info->username, file_name, checksum, transfer->is_checksummed, false);
+
+    end_transfer(transfer);
+    printf("File received\n");
+
+    // response with a confirmation
+    queue_response(client_info,
+            make_file_received_packet(client_info->response, BUFFSIZE, client_info->session_token),
+            PHASE_RECEIVE_REQUEST);
+}
+
+
+void discard_upload(void* context) {
+    struct ClientInfo* client_info = context;
+    struct Transfer* transfer = &client_info->transfer;
+    // the file is only deleted if some of its content is missing
+    bool is_removed = transfer->remaining > 0 || transfer->buffered > 0;
+    char* file_name = strdup(strrchr(transfer->file_path, '/') + 1);
+    end_transfer(transfer);
+    if (is_removed) {
+        record_user_file_change(client_info->username, file_name, 0, false, true);
+    }
+    free(file_name);
+}
+
+
+void watch_client(struct ClientTable* table, struct ClientInfo* client_info) {
+    uint32_t events = EVENT_READ;
+    if (client_info->is_working) {
+        // the worker has the client, nothing to do on the socket
+        events = 0;
+    } else if (client_info->phase == PHASE_SEND_RESPONSE || client_info->phase == PHASE_DOWNLOAD) {
+        events = EVENT_WRITE;
+    }
+    if (events != client_info->watched_events) {
+        modify_in_event_loop(table->loop, client_info->client_socket, events);
+        client_info->watched_events = events;
+    }
+}
+
+
+void add_pending_client(struct ClientTable* table, struct ClientInfo* client_info) {
+    if (client_info->is_pending) {
+        return;
+    }
+    if (table->n_pending == table->pending_capacity) {
+        table->pending_capacity = table->pending_capacity > 0 ? 2 * table->pending_capacity : 64;
+        table->pending = realloc(table->pending, table->pending_capacity * sizeof(int));
+    }
+    table->pending[table->n_pending++] = client_info->client_socket;
+    client_info->is_pending = true;
+}
 
 
 ssize_t handle_logon(int request_len, struct ClientInfo* client_info, bool is_new_user, enum ErrorType* error) {
-    char* request_end = packet_buffer + request_len;
+    char* request_end = client_info->request + request_len;
 
     /*
      * Extract username and password from packet
      */
-    char* username = packet_buffer + HEADER_LEN;
-    size_t username_len = strlen(username) + 1;  // include null terminator
+    // the request is followed by other bytes in the buffer,
+    // so the strings are only searched up to its end
+    char* username = client_info->request + HEADER_LEN;
+    size_t username_len = strnlen(username, request_end - username) + 1;  // include null terminator
     char* password = username + username_len;
     if (password >= request_end) {
         // username is not null terminated properly
@@ -184,7 +1397,7 @@ ssize_t handle_logon(int request_len, struct ClientInfo* client_info, bool is_ne
         return -1;
     }
 
-    size_t password_len = strlen(password) + 1;  // include null terminator
+    size_t password_len = strnlen(password, request_end - password) + 1;  // include null terminator
     if (password + password_len != request_end) {
         // password is not null terminated properly
         *error = ERROR_MALFORMED_REQUEST;
@@ -214,6 +1427,7 @@ ssize_t handle_logon(int request_len, struct ClientInfo* client_info, bool is_ne
      * Save info about user
      */
     create_user_directory(username);
+    start_user_change_log(username);
     memcpy(client_info->username, username, username_len);
 
     /*
@@ -223,7 +1437,7 @@ ssize_t handle_logon(int request_len, struct ClientInfo* client_info, bool is_ne
     client_info->session_token = token;
 
     // response contains user's session token
-    return make_token_response(packet_buffer, BUFFSIZE, token);
+    return make_token_response(client_info->response, BUFFSIZE, token);
 }
 
 
@@ -234,15 +1448,170 @@ ssize_t handle_leave(struct ClientInfo* client_info) {
 
 
 ssize_t handle_list(struct ClientInfo* client_info, enum ErrorType* error) {
-    int n_files;
-    struct FileInfo* client_files = list_user_files(client_info->username, &n_files);
+    struct FileCatalog* client_files = list_user_files(client_info->username);
     // print out list of files
-    printf("List: found %d files in user directory\n", n_files);
+    printf("List: found %zu files in user directory\n", client_files->n_files);
+
+    // the list starts after the name given in request, if any
+    size_t next_file = 0;
+    if (client_info->request_len > HEADER_LEN) {
+        const char* cursor = client_info->request + HEADER_LEN;
+        if (memchr(cursor, 0, client_info->request_len - HEADER_LEN) == NULL) {
+            free_file_catalog(client_files);
+            return -1;
+        }
+        next_file = find_catalog_file_after(client_files, cursor);
+    }
 
-    // response packet
-    ssize_t packet_len = make_list_response(
-            packet_buffer, BUFFSIZE, client_info->session_token, client_files, n_files);
-    free_file_info(client_files);
+    // first page of response. The others are made as they are sent.
+    ssize_t packet_len = make_list_response(client_info->response, BUFFSIZE,
+            client_info->session_token, client_files,
+            client_info->version, &next_file);
+    if (packet_len >= 0 && next_file < client_files->n_files
+            && !has_paged_lists(client_info->version)) {
+        // older clients don't know LIST_PAGE, and only get lists
+        // fitting in a single packet
+        printf("List: too many files for protocol version %d\n", client_info->version);
+        packet_len = make_error_response(client_info->response, BUFFSIZE,
+                client_info->session_token, ERROR_LIST_TOO_LARGE);
+        free_file_catalog(client_files);
+    } else if (packet_len >= 0 && next_file < client_files->n_files) {
+        client_info->listing = client_files;
+        client_info->listing_next = next_file;
+    } else {
+        free_file_catalog(client_files);
+    }
+    return packet_len;
+}
+
+
+ssize_t handle_diff(struct ClientInfo* client_info, enum ErrorType* error) {
+    // get the client's files from request
+    const char* request_files = client_info->request + HEADER_LEN;
+    struct FileCatalog* client_files = parse_diff_files(&request_files,
+            client_info->request + client_info->request_len, SIZE_MAX);
+    if (client_files == NULL) {
+        *error = ERROR_MALFORMED_REQUEST;
+        return -1;
+    }
+
+    // the user's checksums mostly come from the index
+    struct FileCatalog* user_files = list_user_files(client_info->username);
+    struct FileCatalog* server_only;
+    struct FileCatalog* client_only;
+    diff_file_catalogs(user_files, client_files, &server_only, &client_only);
+    printf("Diff: %zu files only in user directory, %zu files only in client\n",
+            server_only->n_files, client_only->n_files);
+
+    // response packet. If too many files differ, the client falls back
+    // to a LIST request
+    ssize_t packet_len = make_diff_response(client_info->response, BUFFSIZE,
+            client_info->session_token, server_only, client_only);
+    if (packet_len < 0) {
+        packet_len = make_error_response(client_info->response, BUFFSIZE,
+                client_info->session_token, ERROR_DIFF_TOO_LARGE);
+    }
+    free_file_catalog(user_files);
+    free_file_catalog(client_files);
+    free_file_catalog(server_only);
+    free_file_catalog(client_only);
+    return packet_len;
+}
+
+
+ssize_t handle_tree(struct ClientInfo* client_info, enum ErrorType* error) {
+    if (client_info->request_len == HEADER_LEN) {
+        // start over with the tree of the user's files as they are now
+        if (client_info->tree != NULL) {
+            free_merkle_tree(client_info->tree);
+        }
+        client_info->tree = build_merkle_tree(list_user_files(client_info->username));
+        printf("Tree: summarized %zu files in user directory\n", client_info->tree->catalog->n_files);
+        return make_tree_response(client_info->response, BUFFSIZE, client_info->session_token,
+                client_info->tree, 0, NULL, 0);
+    }
+
+    // get the nodes from request. They must be above the leaves,
+    // in the tree built for the root.
+    uint8_t level = client_info->request[HEADER_LEN];
+    uint32_t nodes[MERKLE_N_LEAVES / MERKLE_FANOUT];
+    ssize_t n_nodes = -1;
+    if (client_info->tree != NULL && level < MERKLE_DEPTH) {
+        n_nodes = parse_tree_nodes(client_info->request + HEADER_LEN + 1,
+                client_info->request + client_info->request_len, nodes, merkle_level_len(level));
+    }
+    ssize_t i;
+    for (i = 0; i < n_nodes; i++) {
+        if (nodes[i] >= merkle_level_len(level)) {
+            n_nodes = -1;
+        }
+    }
+    if (n_nodes <= 0) {
+        *error = ERROR_MALFORMED_REQUEST;
+        return -1;
+    }
+    return make_tree_response(client_info->response, BUFFSIZE, client_info->session_token,
+            client_info->tree, level, nodes, n_nodes);
+}
+
+
+ssize_t handle_leaf(struct ClientInfo* client_info, enum ErrorType* error) {
+    // get the leaves from request, in the tree built for the root
+    uint32_t* leaves = malloc(MERKLE_N_LEAVES * sizeof(uint32_t));
+    ssize_t n_leaves = -1;
+    if (client_info->tree != NULL) {
+        n_leaves = parse_tree_nodes(client_info->request + HEADER_LEN,
+                client_info->request + client_info->request_len, leaves, MERKLE_N_LEAVES);
+    }
+    ssize_t i;
+    for (i = 0; i < n_leaves; i++) {
+        if (leaves[i] >= MERKLE_N_LEAVES) {
+            n_leaves = -1;
+        }
+    }
+    ssize_t packet_len = -1;
+    if (n_leaves > 0) {
+        packet_len = make_leaf_response(client_info->response, BUFFSIZE, client_info->session_token,
+                client_info->tree, leaves, n_leaves);
+    } else {
+        *error = ERROR_MALFORMED_REQUEST;
+    }
+    free(leaves);
+    return packet_len;
+}
+
+
+ssize_t handle_changes(struct ClientInfo* client_info, enum ErrorType* error) {
+    // get the client's log id and generation from request
+    if (client_info->request_len != HEADER_LEN + 4 + 8) {
+        *error = ERROR_MALFORMED_REQUEST;
+        return -1;
+    }
+    uint32_t log_id_network_endian;
+    memcpy(&log_id_network_endian, client_info->request + HEADER_LEN, 4);
+    uint64_t since_generation = parse_file_size(client_info->request + HEADER_LEN + 4);
+
+    // the changes of another log than the client's are left out, and the
+    // client compares all files, then keeps the log id and generation sent
+    struct ChangeLog log;
+    if (list_user_changes(client_info->username, ntohl(log_id_network_endian),
+                since_generation, &log) < 0) {
+        // the client falls back to comparing all files
+        return make_error_response(client_info->response, BUFFSIZE,
+                client_info->session_token, ERROR_CHANGES_UNAVAILABLE);
+    }
+    printf("Changes: %zu files changed since generation %llu, now %llu\n", log.n_entries,
+            (unsigned long long)since_generation, (unsigned long long)log.generation);
+
+    // response packet. If too many files changed, the client lists all files.
+    ssize_t packet_len = make_changes_response(client_info->response, BUFFSIZE,
+            client_info->session_token, &log);
+    if (packet_len < 0) {
+        log.is_complete = false;
+        packet_len = make_changes_response(client_info->response, BUFFSIZE,
+                client_info->session_token, &log);
+    }
+    free_change_log(&log);
     return packet_len;
 }
 
@@ -250,93 +1619,177 @@ ssize_t handle_list(struct ClientInfo* client_info, enum ErrorType* error) {
 ssize_t handle_file_request(struct ClientInfo* client_info, enum ErrorType* error) {
     // get file name from request
     char file_name[MAX_FILE_NAME_LEN];
-    memcpy(file_name, packet_buffer + HEADER_LEN, MAX_FILE_NAME_LEN);
+    memcpy(file_name, client_info->request + HEADER_LEN, MAX_FILE_NAME_LEN);
+    file_name[MAX_FILE_NAME_LEN-1] = 0;
     printf("File %s requested\n", file_name);
 
     // open file descriptor
     char* dir_path = path_to_user(client_info->username);
     char* file_path = join_path(dir_path, file_name);
     free(dir_path);
-    FILE* file = fopen(file_path, "rb");
+    int file_fd = open(file_path, O_RDONLY);
     free(file_path);
-    if (file == NULL) {
+    struct stat file_stat;
+    if (file_fd < 0 || fstat(file_fd, &file_stat) < 0) {
         printf("ERROR: Requested file doesn't exist\n");
-        return make_error_response(packet_buffer, BUFFSIZE, client_info->session_token, ERROR_FILE_NOT_EXIST);
+        if (file_fd >= 0) {
+            close(file_fd);
+        }
+        return make_error_response(client_info->response, BUFFSIZE, client_info->session_token, ERROR_FILE_NOT_EXIST);
     }
 
-    // get size of file
-    fseek(file, 0, SEEK_END);
-    size_t file_size = ftell(file);
-    fseek(file, 0, SEEK_SET);
-    // send header
-    size_t packet_len = make_file_transfer_header(packet_buffer, BUFFSIZE, client_info->session_token, file_size);
-    send(client_info->client_socket, packet_buffer, packet_len, 0);
-    // send the entire file
-    while ((packet_len = make_file_transfer_body(packet_buffer, BUFFSIZE, file)) > 0) {
-        send(client_info->client_socket, packet_buffer, packet_len, 0);
+    bool is_framed = has_framed_transfers(client_info->version);
+    if (!is_framed && file_stat.st_size > UINT16_MAX - HEADER_LEN) {
+        // the size doesn't fit in a version 1 packet
+        printf("ERROR: Requested file is too large for protocol version 1\n");
+        close(file_fd);
+        return make_error_response(client_info->response, BUFFSIZE, client_info->session_token, ERROR_FILE_TOO_LARGE);
     }
-    fclose(file);
-    printf("File sent to client\n");
-    return 0;
+
+    // the file content is sent in the download phase, after the header
+    struct Transfer* transfer = &client_info->transfer;
+    transfer->file_fd = file_fd;
+    transfer->offset = 0;
+    transfer->remaining = file_stat.st_size;
+    transfer->is_framed = is_framed;
+    transfer->frame_remaining = is_framed ? 0 : transfer->remaining;
+    // regular files are sent straight from the page cache. Others (e.g. a
+    // FIFO placed in the user directory) are read into the transfer buffer.
+    transfer->use_sendfile = S_ISREG(file_stat.st_mode);
+    if (transfer->use_sendfile) {
+        posix_fadvise(file_fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    }
+    if (!is_framed) {
+        return make_v1_file_transfer_header(client_info->response, BUFFSIZE,
+                client_info->session_token, file_stat.st_size);
+    }
+    return make_file_transfer_header(client_info->response, BUFFSIZE, client_info->session_token, file_stat.st_size);
 }
 
 
-ssize_t handle_file_transfer(int n_received, struct ClientInfo* client_info, enum ErrorType* error) {
-    struct PacketHeader* header = (struct PacketHeader*)packet_buffer;
+ssize_t handle_file_transfer(struct ClientInfo* client_info, enum ErrorType* error) {
+    struct PacketHeader* header = (struct PacketHeader*)client_info->request;
     size_t request_len = ntohs(header->packet_len);
+    size_t header_len = HEADER_LEN + MAX_FILE_NAME_LEN;
+    bool is_framed = has_framed_transfers(client_info->version);
+    uint64_t file_size;
+    bool has_client_checksum = false;
+    uint32_t client_checksum = 0;
+    if (is_framed) {
+        // the file size follows the file name, then optionally the checksum
+        if (request_len != header_len + 8 && request_len != header_len + 8 + 4) {
+            *error = ERROR_MALFORMED_REQUEST;
+            return -1;
+        }
+        file_size = parse_file_size(client_info->request + header_len);
+        if (request_len == header_len + 8 + 4) {
+            has_client_checksum = true;
+            client_checksum = parse_file_checksum(client_info->request + header_len + 8);
+        }
+    } else {
+        // the file content follows the file name
+        if (request_len < header_len) {
+            *error = ERROR_MALFORMED_REQUEST;
+            return -1;
+        }
+        file_size = request_len - header_len;
+    }
 
     // get the file names
     char file_name[MAX_FILE_NAME_LEN];
-    memcpy(file_name, packet_buffer + HEADER_LEN, MAX_FILE_NAME_LEN);
-    printf("Client uploading file %s with size %ld\n", file_name, request_len - HEADER_LEN - MAX_FILE_NAME_LEN);
+    memcpy(file_name, client_info->request + HEADER_LEN, MAX_FILE_NAME_LEN);
+    file_name[MAX_FILE_NAME_LEN-1] = 0;
+    printf("Client uploading file %s with size %llu\n", file_name, (unsigned long long)file_size);
 
     // open a new file to write to
     char* dir_path = path_to_user(client_info->username);
     char* file_path = join_path(dir_path, file_name);
     free(dir_path);
-    FILE* file = fopen(file_path, "wb");
+    int file_fd = open(file_path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (file_fd < 0) {
+        free(file_path);
+        *error = ERROR_FILE_UPLOAD_FAILED;
+        return -1;
+    }
 
-    // write the packet content (except header and file name) to file
-    size_t header_len = HEADER_LEN + MAX_FILE_NAME_LEN;
-    fwrite(packet_buffer + header_len, 1, n_received - header_len, file);
+    // the file content is received in the upload phase,
+    // and the confirmation is sent after that
+    struct Transfer* transfer = &client_info->transfer;
+    transfer->file_fd = file_fd;
+    transfer->file_path = file_path;
+    transfer->offset = 0;
+    transfer->remaining = file_size;
+    transfer->is_framed = is_framed;
+    transfer->frame_remaining = is_framed ? 0 : file_size;
+    transfer->checksum = 0xFFFFFFFF;  // initial running checksum
+    transfer->is_checksummed = true;
+    transfer->has_client_checksum = has_client_checksum;
+    transfer->client_checksum = client_checksum;
+    return 0;
+}
 
-    // continue to receive more file content and write to file
-    while(n_received < request_len) {
-        int n_new_bytes = recv(client_info->client_socket, 
-                packet_buffer, BUFFSIZE, 0);
-        if (n_new_bytes <= 0) {
-            // fail to recv, delete the half-received file
-            fclose(file);
-            remove(file_path);
-            free(file_path);
-            return make_error_response(packet_buffer, BUFFSIZE, client_info->session_token, ERROR_FILE_UPLOAD_FAILED);
+
+void remove_client(struct ClientTable* table, struct ClientInfo* client_info) {
+    printf("Connection closed\n");
+    table->clients[client_info->client_socket] = NULL;
+    // only uploads keep the path of their file until they end
+    bool is_uploading = client_info->transfer.file_path != NULL;
+    if (client_info->is_working || is_uploading) {
+        // the worker still uses the client's state, or the upload is
+        // discarded by a worker first, so it is released when the work
+        // completes. The socket stays open until then, so that its
+        // descriptor isn't reused by a new client.
+        remove_from_event_loop(table->loop, client_info->client_socket);
+        client_info->is_closed = true;
+        // end any io_uring recv() or send() waiting on the socket
+        shutdown(client_info->client_socket, SHUT_RDWR);
+        if (client_info->is_working) {
+            return;
         }
-        n_received += n_new_bytes;
-        fwrite(packet_buffer, 1, n_new_bytes, file);
     }
-
-    fclose(file);
-    free(file_path);
-    printf("File received");
-
-    // response with a confirmation
-    return make_file_received_packet(packet_buffer, BUFFSIZE, client_info->session_token);
+    release_client(table, client_info);
 }
 
 
-void remove_client(struct ClientInfo* client_info) {
-    printf("Connection closed\n");
+void release_client(struct ClientTable* table, struct ClientInfo* client_info) {
+    if (client_info->transfer.file_path != NULL) {
+        // the change log is written by a worker, away from the event loop
+        start_work(table, client_info, discard_upload);
+        return;
+    }
+    // release the file and buffer of an unfinished download
+    release_transfer_ring_buffer(table, &client_info->transfer);
+    end_transfer(&client_info->transfer);
+    free_packet_reader(&client_info->reader);
+    if (client_info->upload_pipe[0] >= 0) {
+        close(client_info->upload_pipe[0]);
+        close(client_info->upload_pipe[1]);
+    }
+    if (client_info->tree != NULL) {
+        free_merkle_tree(client_info->tree);
+    }
+    if (client_info->listing != NULL) {
+        free_file_catalog(client_info->listing);
+    }
     // release resource for socket
+    // (closing the socket also removes it from the event loop)
     close(client_info->client_socket);
-    // clear client info
-    memset(client_info, 0, sizeof(struct ClientInfo));
+    // release client info
+    table->n_clients--;
+    free(client_info);
 }
 
 
 uint32_t generate_random_token() {
-    uint32_t x = rand() & 0xff;
-    x |= (rand() & 0xff) << 8;
-    x |= (rand() & 0xff) << 16;
-    x |= (rand() & 0xff) << 24;
-    return x;
+    // tokens come from the kernel's random source, which any thread can
+    // read without a lock, so that they can't be predicted from each other
+    uint32_t token = 0;
+    ssize_t n_bytes;
+    do {
+        n_bytes = getrandom(&token, sizeof(token), 0);
+    } while (n_bytes < 0 && errno == EINTR);
+    if (n_bytes != sizeof(token)) {
+        printf("Error when generating session token\n");
+    }
+    return token;
 }
\ No newline at end of file
@@ -6,11 +6,97 @@
 #define CLIENT_HANDLER_H_
 
 
+#include <stdbool.h>
 #include <stdint.h>
+#include <sys/types.h>
+
+#include "EventLoop.h"
+#include "IoRing.h"
+#include "NetworkHeader.h"
+#include "Protocol.h"
+#include "WorkerPool.h"
 
 #define USERNAME_LEN 128
 #define USERNAME_LEN_WITH_NULL 129
-#define MAX_CONNECTIONS 64
+#define MAX_CONNECTIONS 4096
+
+
+/**
+ * What a connection is currently doing. Sockets are non-blocking, so each
+ * phase can be suspended when the socket isn't ready, and resumed later.
+ */
+enum ConnectionPhase {
+	/** Receiving (the rest of) a request packet */
+	PHASE_RECEIVE_REQUEST,
+	/** Sending (the rest of) a response packet */
+	PHASE_SEND_RESPONSE,
+	/** Making the next page of a LIST response */
+	PHASE_SEND_LISTING,
+	/** Receiving file content uploaded by the client */
+	PHASE_UPLOAD,
+	/** Sending file content downloaded by the client */
+	PHASE_DOWNLOAD,
+	/** Closing the connection */
+	PHASE_CLOSE,
+};
+
+
+/**
+ * Progress of a file being uploaded or downloaded
+ */
+struct Transfer {
+	/** Descriptor of the file, -1 if no transfer */
+	int file_fd;
+	/** Position in the file of the next byte to move */
+	off_t offset;
+	/** Number of file bytes left to move */
+	size_t remaining;
+	/**
+	 * Whether the file content is split in FILE_DATA packets (protocol
+	 * version 2 and later), rather than following the FILE_TRANSFER header
+	 */
+	bool is_framed;
+	/** Number of file bytes left in the current FILE_DATA packet */
+	size_t frame_remaining;
+	/** Header of the current FILE_DATA packet, and the number of its bytes moved */
+	char frame_header[sizeof(struct PacketHeader)];
+	size_t frame_header_done;
+	/** Path of an uploaded file, so it can be removed if the upload fails */
+	char* file_path;
+	/**
+	 * Running checksum of the uploaded content, and whether it covers all
+	 * of it (not when the content is spliced from the socket to the file)
+	 */
+	uint_fast32_t checksum;
+	bool is_checksummed;
+	/** Checksum of the uploaded file sent by the client, if any */
+	bool has_client_checksum;
+	uint32_t client_checksum;
+	/**
+	 * Whether a download is sent with sendfile(), straight from the page cache.
+	 * Otherwise it goes through the buffer below.
+	 */
+	bool use_sendfile;
+	/**
+	 * Slice of file content between socket and file, its number of bytes,
+	 * and the number of those bytes already sent (for downloads)
+	 */
+	char* buffer;
+	size_t buffered;
+	size_t buffer_sent;
+	/**
+	 * Index of the registered io_uring buffer used as the transfer buffer,
+	 * -1 if the transfer uses the worker threads instead
+	 */
+	int ring_buffer;
+	/**
+	 * Number of io_uring operations in flight, their expected results
+	 * (the first one being the number of file bytes moved), and their results
+	 */
+	int n_ring_operations;
+	int32_t ring_expected[2];
+	int32_t ring_results[2];
+};
 
 
 /**
@@ -20,6 +106,85 @@ struct ClientInfo {
 	int client_socket;
 	char username[USERNAME_LEN_WITH_NULL];
 	uint32_t session_token;
+	/** Protocol version of the client's last request */
+	uint8_t version;
+
+	enum ConnectionPhase phase;
+	/** Phase to enter after the response is sent */
+	enum ConnectionPhase phase_after_response;
+	/** Events currently watched in the event loop */
+	uint32_t watched_events;
+	/** Whether the client is in the table's list of pending clients */
+	bool is_pending;
+	/**
+	 * Disk work for the client, run by a worker thread (or io_uring operations).
+	 * While it's in flight, only the worker touches the client's state.
+	 */
+	struct WorkItem work;
+	bool is_working;
+	/** Whether the connection was closed while work was in flight */
+	bool is_closed;
+
+	/** Bytes received from the client, split into requests */
+	struct PacketReader reader;
+	/** Request being handled, in the reader's buffer, and its length */
+	char* request;
+	size_t request_len;
+	/** Response being sent, its length, and number of bytes sent so far */
+	char response[BUFFSIZE];
+	size_t response_len;
+	size_t response_sent;
+
+	struct Transfer transfer;
+	/**
+	 * Pipe that uploads are spliced through, from the socket to the file,
+	 * created on the first upload. -1 if none.
+	 */
+	int upload_pipe[2];
+	/**
+	 * Hash tree of the user's files, built by a TREE request for the root
+	 * and used by the following TREE and LEAF requests. NULL if none.
+	 */
+	struct MerkleTree* tree;
+	/**
+	 * Files of a LIST response sent page by page, and the position of the
+	 * first file of the next page. NULL if none.
+	 */
+	struct FileCatalog* listing;
+	size_t listing_next;
+};
+
+
+/**
+ * Contains the info of all connected clients, indexed by socket descriptor,
+ * so that the info of a ready socket is found without scanning.
+ * Each reactor thread of the server has its own table.
+ */
+struct ClientTable {
+	/** Slot for each socket descriptor, NULL if not a connected client */
+	struct ClientInfo** clients;
+	/** Number of slots */
+	int capacity;
+	/** Number of connected clients */
+	int n_clients;
+	/** Max number of connections allowed */
+	int max_connections;
+	/** Event loop watching the client sockets */
+	struct EventLoop* loop;
+	/** Worker threads running disk work for the clients */
+	struct WorkerPool* workers;
+	/**
+	 * io_uring instance moving file content of transfers, or NULL if
+	 * transfers use the worker threads
+	 */
+	struct IoRing* ring;
+	/**
+	 * Sockets of clients that used up their share of work for one event,
+	 * and still have data to move. They are resumed by handle_pending_clients()
+	 */
+	int* pending;
+	int n_pending;
+	int pending_capacity;
 };
 
 
@@ -30,19 +195,79 @@ void initialize_client_handler();
 
 
 /**
- * Accept a new client connection. The client is rejected if number of current connections
- * already reached max number allowed.
- * Also set up book-keeping data for the new client.
- * @param server_socekt   Server socket
- * @param client_infos    Array of slots to store client info for each connected client
+ * Initialize an empty client table, and start its worker threads.
+ * Completed work is reported by the event loop on table->workers->notify_fd,
+ * and must be handled with handle_completed_work()
+ * If use_io_uring is set, file content of transfers is moved by io_uring
+ * instead. Its completions are reported on table->ring->notify_fd, and must be
+ * handled with handle_ring_completions(). If the kernel doesn't support io_uring,
+ * table->ring is NULL and the worker threads are used.
+ * @param table           Address of the table
+ * @param loop            Event loop that accepted clients are added to
+ * @param n_workers       Number of worker threads for disk work
  * @param max_connections Max number of connections allowed
+ * @param use_io_uring    Whether to move file content with io_uring
+ * @return 0 if success, -1 if fail
+ */
+int initialize_client_table(struct ClientTable* table, struct EventLoop* loop,
+        int n_workers, int max_connections, bool use_io_uring);
+
+
+/**
+ * Accept all pending client connections on a non-blocking server socket.
+ * A client is rejected if number of current connections already reached
+ * max number allowed.
+ * Also set up book-keeping data for each new client, and add it to the event loop.
+ * @param server_socket   Server socket
+ * @param table           Table storing client info for each connected client
+ * @return Number of clients accepted
  */ 
-void accept_client(int server_socket, struct ClientInfo* client_infos, int max_connections);
+int accept_client(int server_socket, struct ClientTable* table);
+
+
+/**
+ * Make progress on a client whose socket is ready: receive requests, send
+ * responses, and move a bounded slice of any file transfer, until the
+ * socket would block or disk work is handed to a worker.
+ * Update the client info if needed.
+ * If the connection is closed, the client is removed from the table.
+ * @param table         Table storing client info for each connected client
+ * @param client_socket Socket of the client that is ready
+ * @param events        Events reported for the socket (EVENT_* flags)
+ * @return true if the connection is still open, false if it was closed
+ */
+bool handle_client(struct ClientTable* table, int client_socket, uint32_t events);
+
+
+/**
+ * Resume the clients whose disk work was completed by the workers
+ */
+void handle_completed_work(struct ClientTable* table);
+
+
+/**
+ * Resume the clients whose io_uring operations completed
+ */
+void handle_ring_completions(struct ClientTable* table);
+
+
+/**
+ * Submit the io_uring operations queued while handling events, all at once.
+ * Call before waiting for the next events.
+ */
+void submit_queued_io(struct ClientTable* table);
+
+
+/**
+ * @return true if some clients used up their share of work and should be
+ *         resumed without waiting for new socket activity
+ */
+bool has_pending_clients(struct ClientTable* table);
 
 
 /**
- * Handle a client request, and update the client info if needed
+ * Resume each client that used up its share of work in the previous round
  */
-void handle_client(struct ClientInfo* client_info);
+void handle_pending_clients(struct ClientTable* table);
 
 #endif // CLIENT_HANDLER_H_
\ No newline at end of file
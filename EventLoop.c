@@ -0,0 +1,107 @@
+#include "EventLoop.h"
+
+#include <stdlib.h>
+#include <sys/epoll.h>
+#include <unistd.h>
+
+
+/*
+ * Helper functions
+ */
+
+/**
+ * Convert EVENT_* flags into the epoll event mask for a socket
+ */
+static uint32_t to_epoll_events(struct EventLoop* loop, uint32_t events) {
+    uint32_t epoll_events = 0;
+    if (events & EVENT_READ) {
+        epoll_events |= EPOLLIN | EPOLLRDHUP;
+    }
+    if (events & EVENT_WRITE) {
+        epoll_events |= EPOLLOUT;
+    }
+    if (loop->edge_triggered) {
+        epoll_events |= EPOLLET;
+    }
+    return epoll_events;
+}
+
+
+static int control_event_loop(struct EventLoop* loop, int operation, int fd, uint32_t events) {
+    struct epoll_event event;
+    event.events = to_epoll_events(loop, events);
+    event.data.fd = fd;
+    return epoll_ctl(loop->epoll_fd, operation, fd, &event);
+}
+
+
+/*
+ * Public functions
+ */
+
+
+struct EventLoop* create_event_loop(int max_events, bool edge_triggered) {
+    int epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (epoll_fd < 0) {
+        return NULL;
+    }
+
+    struct EventLoop* loop = malloc(sizeof(struct EventLoop));
+    loop->epoll_fd = epoll_fd;
+    loop->edge_triggered = edge_triggered;
+    loop->max_events = max_events;
+    loop->raw_events = malloc(max_events * sizeof(struct epoll_event));
+    loop->ready_events = malloc(max_events * sizeof(struct ReadyEvent));
+    return loop;
+}
+
+
+int add_to_event_loop(struct EventLoop* loop, int fd, uint32_t events) {
+    return control_event_loop(loop, EPOLL_CTL_ADD, fd, events);
+}
+
+
+int modify_in_event_loop(struct EventLoop* loop, int fd, uint32_t events) {
+    return control_event_loop(loop, EPOLL_CTL_MOD, fd, events);
+}
+
+
+int remove_from_event_loop(struct EventLoop* loop, int fd) {
+    return control_event_loop(loop, EPOLL_CTL_DEL, fd, 0);
+}
+
+
+int wait_for_events(struct EventLoop* loop, int timeout_ms) {
+    struct epoll_event* raw_events = loop->raw_events;
+    int n_ready = epoll_wait(loop->epoll_fd, raw_events, loop->max_events, timeout_ms);
+    if (n_ready < 0) {
+        return -1;
+    }
+
+    // convert to the loop's own event flags, so that callers don't
+    // depend on epoll
+    int i;
+    for (i = 0; i < n_ready; i++) {
+        uint32_t events = 0;
+        if (raw_events[i].events & (EPOLLIN | EPOLLRDHUP)) {
+            events |= EVENT_READ;
+        }
+        if (raw_events[i].events & EPOLLOUT) {
+            events |= EVENT_WRITE;
+        }
+        if (raw_events[i].events & (EPOLLERR | EPOLLHUP)) {
+            events |= EVENT_ERROR;
+        }
+        loop->ready_events[i].fd = raw_events[i].data.fd;
+        loop->ready_events[i].events = events;
+    }
+    return n_ready;
+}
+
+
+void free_event_loop(struct EventLoop* loop) {
+    close(loop->epoll_fd);
+    free(loop->raw_events);
+    free(loop->ready_events);
+    free(loop);
+}
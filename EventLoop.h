@@ -0,0 +1,90 @@
+/**
+ * Contains an epoll-based event loop used by the server to wait for
+ * activity on its sockets
+ */
+
+#ifndef EVENT_LOOP_H_
+#define EVENT_LOOP_H_
+
+
+#include <stdbool.h>
+#include <stdint.h>
+
+
+/** Event flags reported by and passed to the event loop */
+#define EVENT_READ  0x1
+#define EVENT_WRITE 0x2
+#define EVENT_ERROR 0x4
+
+
+/**
+ * A socket that is ready, as reported by wait_for_events()
+ */
+struct ReadyEvent {
+    int fd;
+    uint32_t events;  // combination of EVENT_* flags
+};
+
+
+/**
+ * Contains the state of an event loop
+ */
+struct EventLoop {
+    int epoll_fd;
+    /** Report readiness only on state changes, instead of as long as it lasts */
+    bool edge_triggered;
+    /** Maximum number of events returned by a single wait */
+    int max_events;
+    /** Scratch space for epoll_wait(), and the converted events */
+    void* raw_events;
+    struct ReadyEvent* ready_events;
+};
+
+
+/**
+ * Create a new event loop
+ * @param  max_events     Maximum number of ready sockets reported by each wait
+ * @param  edge_triggered Whether sockets are watched in edge-triggered mode.
+ *                        In this mode, handlers must consume all available
+ *                        data before waiting again.
+ * @return The event loop, or NULL if fail. Must be freed with free_event_loop()
+ */
+struct EventLoop* create_event_loop(int max_events, bool edge_triggered);
+
+
+/**
+ * Start watching a socket for the given events
+ * @return 0 if success, -1 if fail
+ */
+int add_to_event_loop(struct EventLoop* loop, int fd, uint32_t events);
+
+
+/**
+ * Change the events watched for a socket
+ * @return 0 if success, -1 if fail
+ */
+int modify_in_event_loop(struct EventLoop* loop, int fd, uint32_t events);
+
+
+/**
+ * Stop watching a socket. Closing a socket also removes it from the loop.
+ * @return 0 if success, -1 if fail
+ */
+int remove_from_event_loop(struct EventLoop* loop, int fd);
+
+
+/**
+ * Wait until some sockets are ready, then return them in loop->ready_events
+ * @param  timeout_ms Maximum time to wait, or -1 to wait indefinitely
+ * @return Number of ready sockets, or -1 if error
+ */
+int wait_for_events(struct EventLoop* loop, int timeout_ms);
+
+
+/**
+ * Release all resources used by the event loop
+ */
+void free_event_loop(struct EventLoop* loop);
+
+
+#endif // EVENT_LOOP_H_
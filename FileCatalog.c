@@ -0,0 +1,231 @@
+#include "FileCatalog.h"
+
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+
+/**
+ * A slot of a checksum set
+ */
+struct ChecksumSlot {
+    uint32_t checksum;
+    /** Whether the slot holds a checksum */
+    bool is_used;
+    /** Whether the checksum was found in the other catalog */
+    bool is_matched;
+};
+
+
+/**
+ * A set of checksums, with open addressing
+ */
+struct ChecksumSet {
+    struct ChecksumSlot* slots;
+    /** Number of slots minus 1, the number of slots being a power of 2 */
+    uint32_t mask;
+};
+
+
+/**
+ * A diff in progress: the set of checksums of the second catalog,
+ * and the files only in the first catalog, found part by part
+ */
+struct CatalogDiff {
+    const struct FileCatalog* catalog2;
+    struct ChecksumSet set2;
+    struct FileCatalog** parts_only_in_1;
+    size_t n_parts;
+    size_t max_parts;
+};
+
+
+/*
+ * Helper functions
+ */
+
+/**
+ * @return Slot of the checksum, or the empty slot where it belongs if it
+ *         isn't in the set
+ */
+static struct ChecksumSlot* find_checksum_slot(const struct ChecksumSet* set, uint32_t checksum) {
+    // checksums of similar files differ in few bits, which are mixed
+    // into the slot index
+    uint32_t i = (checksum * 0x9E3779B1u) & set->mask;
+    while (set->slots[i].is_used && set->slots[i].checksum != checksum) {
+        i = (i + 1) & set->mask;
+    }
+    return &set->slots[i];
+}
+
+
+/**
+ * Create a set of the checksums of a catalog, at most half full
+ * so that probes stay short
+ */
+static void init_checksum_set(struct ChecksumSet* set, const struct FileCatalog* catalog) {
+    uint32_t n_slots = 16;
+    while (n_slots < 2 * catalog->n_files) {
+        n_slots *= 2;
+    }
+    set->slots = calloc(n_slots, sizeof(struct ChecksumSlot));
+    set->mask = n_slots - 1;
+    size_t i;
+    for (i = 0; i < catalog->n_files; i++) {
+        struct ChecksumSlot* slot = find_checksum_slot(set, catalog->checksums[i]);
+        slot->checksum = catalog->checksums[i];
+        slot->is_used = true;
+    }
+}
+
+
+/*
+ * Public functions
+ */
+
+
+struct FileCatalog* create_file_catalog(size_t max_files, size_t max_names_len) {
+    // the struct, arrays and name pool share a single allocation,
+    // the arrays right after the struct, then the names
+    size_t arrays_len = 2 * max_files * sizeof(uint32_t);
+    struct FileCatalog* catalog = malloc(sizeof(struct FileCatalog) + arrays_len + max_names_len);
+    catalog->n_files = 0;
+    catalog->checksums = (uint32_t*)(catalog + 1);
+    catalog->name_offsets = catalog->checksums + max_files;
+    catalog->names = (char*)(catalog->name_offsets + max_files);
+    catalog->names_len = 0;
+    catalog->max_files = max_files;
+    catalog->max_names_len = max_names_len;
+    return catalog;
+}
+
+
+int add_catalog_file(struct FileCatalog* catalog, const char* name, uint32_t checksum) {
+    size_t name_len = strnlen(name, MAX_FILE_NAME_LEN - 1);
+    if (catalog->n_files == catalog->max_files
+            || catalog->names_len + name_len + 1 > catalog->max_names_len) {
+        return -1;
+    }
+    char* catalog_name = catalog->names + catalog->names_len;
+    memcpy(catalog_name, name, name_len);
+    catalog_name[name_len] = 0;
+    catalog->checksums[catalog->n_files] = checksum;
+    catalog->name_offsets[catalog->n_files] = catalog->names_len;
+    catalog->names_len += name_len + 1;
+    catalog->n_files++;
+    return 0;
+}
+
+
+const char* catalog_file_name(const struct FileCatalog* catalog, size_t i) {
+    return catalog->names + catalog->name_offsets[i];
+}
+
+
+struct FileCatalog* join_file_catalogs(struct FileCatalog* const* parts, size_t n_parts) {
+    size_t n_files = 0;
+    size_t names_len = 0;
+    size_t i;
+    for (i = 0; i < n_parts; i++) {
+        n_files += parts[i]->n_files;
+        names_len += parts[i]->names_len;
+    }
+    struct FileCatalog* catalog = create_file_catalog(n_files, names_len);
+    for (i = 0; i < n_parts; i++) {
+        size_t j;
+        for (j = 0; j < parts[i]->n_files; j++) {
+            add_catalog_file(catalog, catalog_file_name(parts[i], j), parts[i]->checksums[j]);
+        }
+    }
+    return catalog;
+}
+
+
+size_t find_catalog_file_after(const struct FileCatalog* catalog, const char* name) {
+    size_t low = 0;
+    size_t high = catalog->n_files;
+    while (low < high) {
+        size_t middle = low + (high - low) / 2;
+        if (strcmp(catalog_file_name(catalog, middle), name) <= 0) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+    return low;
+}
+
+
+struct CatalogDiff* start_catalog_diff(const struct FileCatalog* catalog2) {
+    struct CatalogDiff* diff = malloc(sizeof(struct CatalogDiff));
+    diff->catalog2 = catalog2;
+    init_checksum_set(&diff->set2, catalog2);
+    diff->n_parts = 0;
+    diff->max_parts = 8;
+    diff->parts_only_in_1 = malloc(diff->max_parts * sizeof(struct FileCatalog*));
+    return diff;
+}
+
+
+void add_catalog_diff_part(struct CatalogDiff* diff, const struct FileCatalog* part1) {
+    // the files of the part not in the set are only in the first catalog,
+    // the others mark their checksum as present in both
+    struct FileCatalog* only_in_1 = create_file_catalog(part1->n_files, part1->names_len);
+    size_t i;
+    for (i = 0; i < part1->n_files; i++) {
+        struct ChecksumSlot* slot = find_checksum_slot(&diff->set2, part1->checksums[i]);
+        if (slot->is_used) {
+            slot->is_matched = true;
+        } else {
+            add_catalog_file(only_in_1, catalog_file_name(part1, i), part1->checksums[i]);
+        }
+    }
+
+    if (diff->n_parts == diff->max_parts) {
+        diff->max_parts *= 2;
+        diff->parts_only_in_1 = realloc(diff->parts_only_in_1,
+                diff->max_parts * sizeof(struct FileCatalog*));
+    }
+    diff->parts_only_in_1[diff->n_parts++] = only_in_1;
+}
+
+
+void finish_catalog_diff(struct CatalogDiff* diff,
+        struct FileCatalog** only_in_1, struct FileCatalog** only_in_2) {
+    // join the files only in the first catalog, found in each part
+    size_t i;
+    if (diff->n_parts == 1) {
+        *only_in_1 = diff->parts_only_in_1[0];
+    } else {
+        *only_in_1 = join_file_catalogs(diff->parts_only_in_1, diff->n_parts);
+        for (i = 0; i < diff->n_parts; i++) {
+            free_file_catalog(diff->parts_only_in_1[i]);
+        }
+    }
+
+    // the files of catalog2 whose checksum wasn't marked are only in catalog2
+    const struct FileCatalog* catalog2 = diff->catalog2;
+    *only_in_2 = create_file_catalog(catalog2->n_files, catalog2->names_len);
+    for (i = 0; i < catalog2->n_files; i++) {
+        if (!find_checksum_slot(&diff->set2, catalog2->checksums[i])->is_matched) {
+            add_catalog_file(*only_in_2, catalog_file_name(catalog2, i), catalog2->checksums[i]);
+        }
+    }
+
+    free(diff->set2.slots);
+    free(diff->parts_only_in_1);
+    free(diff);
+}
+
+
+void diff_file_catalogs(const struct FileCatalog* catalog1, const struct FileCatalog* catalog2,
+        struct FileCatalog** only_in_1, struct FileCatalog** only_in_2) {
+    struct CatalogDiff* diff = start_catalog_diff(catalog2);
+    add_catalog_diff_part(diff, catalog1);
+    finish_catalog_diff(diff, only_in_1, only_in_2);
+}
+
+
+void free_file_catalog(struct FileCatalog* catalog) {
+    free(catalog);
+}
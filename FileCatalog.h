@@ -0,0 +1,128 @@
+/**
+ * Contains a catalog of file names and checksums, held in a single block
+ * of memory: the checksums and the name offsets in arrays, and the names
+ * one after the other in a pool
+ */
+
+#ifndef FILE_CATALOG_H_
+#define FILE_CATALOG_H_
+
+
+#include <stddef.h>
+#include <stdint.h>
+
+
+#define MAX_FILE_NAME_LEN 64 // this includes null-terminator
+
+
+/**
+ * The files of a catalog, in the order they were added
+ */
+struct FileCatalog {
+    /** Number of files in the catalog */
+    size_t n_files;
+    /** Checksum of each file */
+    uint32_t* checksums;
+    /** Offset of each file's name in the name pool */
+    uint32_t* name_offsets;
+    /** Null-terminated names of the files, one after the other */
+    char* names;
+    size_t names_len;
+
+    /** Room the catalog was created with */
+    size_t max_files;
+    size_t max_names_len;
+};
+
+
+/**
+ * Create an empty catalog, with room for the given number of files
+ * @param  max_files     Max number of files
+ * @param  max_names_len Max total length of the names, including
+ *                       their null terminators
+ * @return The catalog. Must be freed with free_file_catalog()
+ */
+struct FileCatalog* create_file_catalog(size_t max_files, size_t max_names_len);
+
+
+/**
+ * Add a file at the end of the catalog. Names longer than
+ * MAX_FILE_NAME_LEN - 1 are truncated.
+ * @return 0 if success, -1 if the catalog is full
+ */
+int add_catalog_file(struct FileCatalog* catalog, const char* name, uint32_t checksum);
+
+
+/**
+ * @return Name of the file at the given position in the catalog
+ */
+const char* catalog_file_name(const struct FileCatalog* catalog, size_t i);
+
+
+/**
+ * Join catalogs one after the other
+ * @return The joined catalog. Must be freed with free_file_catalog()
+ */
+struct FileCatalog* join_file_catalogs(struct FileCatalog* const* parts, size_t n_parts);
+
+
+/**
+ * @return Position of the first file whose name comes after the given
+ *         name, in a catalog sorted by name
+ */
+size_t find_catalog_file_after(const struct FileCatalog* catalog, const char* name);
+
+
+/**
+ * A diff of two catalogs in progress, the first catalog being received
+ * part by part
+ */
+struct CatalogDiff;
+
+
+/**
+ * Start a diff against the given catalog, which must stay valid until
+ * the diff is finished
+ * @return The diff. Must be finished with finish_catalog_diff()
+ */
+struct CatalogDiff* start_catalog_diff(const struct FileCatalog* catalog2);
+
+
+/**
+ * Add the next part of the first catalog to the diff
+ */
+void add_catalog_diff_part(struct CatalogDiff* diff, const struct FileCatalog* part1);
+
+
+/**
+ * Finish the diff, and release it
+ * @param  only_in_1     [out] Address of variable to store the catalog of files
+ *                       only in the first catalog, in the order of its parts
+ * @param  only_in_2     [out] Address of variable to store the catalog of files
+ *                       only in catalog2, in the order of catalog2
+ */
+void finish_catalog_diff(struct CatalogDiff* diff,
+        struct FileCatalog** only_in_1, struct FileCatalog** only_in_2);
+
+
+/**
+ * Find the files of each catalog whose checksum isn't in the other one,
+ * in a single pass over each catalog
+ * @param  catalog1      First catalog
+ * @param  catalog2      Second catalog
+ * @param  only_in_1     [out] Address of variable to store the catalog of files
+ *                       only in catalog1, in the order of catalog1
+ * @param  only_in_2     [out] Address of variable to store the catalog of files
+ *                       only in catalog2, in the order of catalog2
+ */
+void diff_file_catalogs(const struct FileCatalog* catalog1, const struct FileCatalog* catalog2,
+        struct FileCatalog** only_in_1, struct FileCatalog** only_in_2);
+
+
+/**
+ * Release the catalog, and all its names
+ */
+void free_file_catalog(struct FileCatalog* catalog);
+
+
+#endif // FILE_CATALOG_H_
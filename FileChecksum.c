@@ -1,122 +1,691 @@
-#include "FileChecksum.h"
-
-#include <stdlib.h>
-#include <stdint.h>  /* integer types of exact size */
-#include <stdio.h>   /* file IO */
-
-typedef uint_fast32_t UINT32;
-
-static const UINT32 DEFAULT_INITAL_CHECKSUM = 0xFFFFFFFF;
-static const int BUFFER_SIZE = 8;
-
-/** Memoize the result of calculation performed on each byte */
-static const UINT32 CRC32_TABLE[] = {
-    0x00000000, 0x77073096, 0xEE0E612C, 0x990951BA,
-    0x076DC419, 0x706AF48F, 0xE963A535, 0x9E6495A3,
-    0x0EDB8832, 0x79DCB8A4, 0xE0D5E91E, 0x97D2D988,
-    0x09B64C2B, 0x7EB17CBD, 0xE7B82D07, 0x90BF1D91,
-    0x1DB71064, 0x6AB020F2, 0xF3B97148, 0x84BE41DE,
-    0x1ADAD47D, 0x6DDDE4EB, 0xF4D4B551, 0x83D385C7,
-    0x136C9856, 0x646BA8C0, 0xFD62F97A, 0x8A65C9EC,
-    0x14015C4F, 0x63066CD9, 0xFA0F3D63, 0x8D080DF5,
-    0x3B6E20C8, 0x4C69105E, 0xD56041E4, 0xA2677172,
-    0x3C03E4D1, 0x4B04D447, 0xD20D85FD, 0xA50AB56B,
-    0x35B5A8FA, 0x42B2986C, 0xDBBBC9D6, 0xACBCF940,
-    0x32D86CE3, 0x45DF5C75, 0xDCD60DCF, 0xABD13D59,
-    0x26D930AC, 0x51DE003A, 0xC8D75180, 0xBFD06116,
-    0x21B4F4B5, 0x56B3C423, 0xCFBA9599, 0xB8BDA50F,
-    0x2802B89E, 0x5F058808, 0xC60CD9B2, 0xB10BE924,
-    0x2F6F7C87, 0x58684C11, 0xC1611DAB, 0xB6662D3D,
-    0x76DC4190, 0x01DB7106, 0x98D220BC, 0xEFD5102A,
-    0x71B18589, 0x06B6B51F, 0x9FBFE4A5, 0xE8B8D433,
-    0x7807C9A2, 0x0F00F934, 0x9609A88E, 0xE10E9818,
-    0x7F6A0DBB, 0x086D3D2D, 0x91646C97, 0xE6635C01,
-    0x6B6B51F4, 0x1C6C6162, 0x856530D8, 0xF262004E,
-    0x6C0695ED, 0x1B01A57B, 0x8208F4C1, 0xF50FC457,
-    0x65B0D9C6, 0x12B7E950, 0x8BBEB8EA, 0xFCB9887C,
-    0x62DD1DDF, 0x15DA2D49, 0x8CD37CF3, 0xFBD44C65,
-    0x4DB26158, 0x3AB551CE, 0xA3BC0074, 0xD4BB30E2,
-    0x4ADFA541, 0x3DD895D7, 0xA4D1C46D, 0xD3D6F4FB,
-    0x4369E96A, 0x346ED9FC, 0xAD678846, 0xDA60B8D0,
-    0x44042D73, 0x33031DE5, 0xAA0A4C5F, 0xDD0D7CC9,
-    0x5005713C, 0x270241AA, 0xBE0B1010, 0xC90C2086,
-    0x5768B525, 0x206F85B3, 0xB966D409, 0xCE61E49F,
-    0x5EDEF90E, 0x29D9C998, 0xB0D09822, 0xC7D7A8B4,
-    0x59B33D17, 0x2EB40D81, 0xB7BD5C3B, 0xC0BA6CAD,
-    0xEDB88320, 0x9ABFB3B6, 0x03B6E20C, 0x74B1D29A,
-    0xEAD54739, 0x9DD277AF, 0x04DB2615, 0x73DC1683,
-    0xE3630B12, 0x94643B84, 0x0D6D6A3E, 0x7A6A5AA8,
-    0xE40ECF0B, 0x9309FF9D, 0x0A00AE27, 0x7D079EB1,
-    0xF00F9344, 0x8708A3D2, 0x1E01F268, 0x6906C2FE,
-    0xF762575D, 0x806567CB, 0x196C3671, 0x6E6B06E7,
-    0xFED41B76, 0x89D32BE0, 0x10DA7A5A, 0x67DD4ACC,
-    0xF9B9DF6F, 0x8EBEEFF9, 0x17B7BE43, 0x60B08ED5,
-    0xD6D6A3E8, 0xA1D1937E, 0x38D8C2C4, 0x4FDFF252,
-    0xD1BB67F1, 0xA6BC5767, 0x3FB506DD, 0x48B2364B,
-    0xD80D2BDA, 0xAF0A1B4C, 0x36034AF6, 0x41047A60,
-    0xDF60EFC3, 0xA867DF55, 0x316E8EEF, 0x4669BE79,
-    0xCB61B38C, 0xBC66831A, 0x256FD2A0, 0x5268E236,
-    0xCC0C7795, 0xBB0B4703, 0x220216B9, 0x5505262F,
-    0xC5BA3BBE, 0xB2BD0B28, 0x2BB45A92, 0x5CB36A04,
-    0xC2D7FFA7, 0xB5D0CF31, 0x2CD99E8B, 0x5BDEAE1D,
-    0x9B64C2B0, 0xEC63F226, 0x756AA39C, 0x026D930A,
-    0x9C0906A9, 0xEB0E363F, 0x72076785, 0x05005713,
-    0x95BF4A82, 0xE2B87A14, 0x7BB12BAE, 0x0CB61B38,
-    0x92D28E9B, 0xE5D5BE0D, 0x7CDCEFB7, 0x0BDBDF21,
-    0x86D3D2D4, 0xF1D4E242, 0x68DDB3F8, 0x1FDA836E,
-    0x81BE16CD, 0xF6B9265B, 0x6FB077E1, 0x18B74777,
-    0x88085AE6, 0xFF0F6A70, 0x66063BCA, 0x11010B5C,
-    0x8F659EFF, 0xF862AE69, 0x616BFFD3, 0x166CCF45,
-    0xA00AE278, 0xD70DD2EE, 0x4E048354, 0x3903B3C2,
-    0xA7672661, 0xD06016F7, 0x4969474D, 0x3E6E77DB,
-    0xAED16A4A, 0xD9D65ADC, 0x40DF0B66, 0x37D83BF0,
-    0xA9BCAE53, 0xDEBB9EC5, 0x47B2CF7F, 0x30B5FFE9,
-    0xBDBDF21C, 0xCABAC28A, 0x53B39330, 0x24B4A3A6,
-    0xBAD03605, 0xCDD70693, 0x54DE5729, 0x23D967BF,
-    0xB3667A2E, 0xC4614AB8, 0x5D681B02, 0x2A6F2B94,
-    0xB40BBE37, 0xC30C8EA1, 0x5A05DF1B, 0x2D02EF8D
-};
-
-
-/**
- * Calculate the running checksum of a byte array
- * by starting with the given initial_checksum instead of 0xFFFFFFFF
- * This is used as a helper for computing the checksum of a large file,
- * by reading the file in chunk, then compute the running checksum of
- * the chunks so far.
- *
- * @param  data             Byte array whose checksum need to be computed
- * @param  data_len         Length of the byte array
- * @param  initial_checksum The running checksum of the previous data
- * @return The running checksum of all previous data and the current data
- *         xor by 0xFFFFFFFF
- */
-UINT32 crc32_running_checksum(unsigned char *data, size_t data_len, UINT32 inital_checksum) {
-    UINT32 checksum = inital_checksum;
-    int i;
-    for (i = 0; i < data_len; i++) {
-        int lookup_ind = (checksum ^ data[i]) & 0xFF;
-        checksum = (checksum >> 8) ^ CRC32_TABLE[lookup_ind];
-    }
-    return checksum;
-}
-
-
-UINT32 crc32_file_checksum(FILE *fd) {
-    // create a buffer to store a large chunk of the file
-    unsigned char buffer[BUFFER_SIZE];
-
-    UINT32 checksum = DEFAULT_INITAL_CHECKSUM;
-
-    // the file will be processed in chunk of BUFFER_SIZE
-    // this loop repeatedly read a new chunk, then incrementally
-    // find the running checksum
-    size_t bytes_read = 0;
-    while((bytes_read = fread(buffer, 1, BUFFER_SIZE, fd)) > 0) {
-        checksum = crc32_running_checksum(buffer, bytes_read, checksum);
-    }
-
-    // the final running checksum is negated, according to CRC-32 specification
-    checksum ^= 0xFFFFFFFF;
-    return checksum;
-}
+#include "FileChecksum.h"
+
+#include <endian.h>   /* le32toh */
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <stdint.h>  /* integer types of exact size */
+#include <stdio.h>   /* file IO */
+#include <string.h>  /* memcpy */
+#include <fcntl.h>   /* posix_fadvise */
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>  /* pread */
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#define HAS_CLMUL_KERNELS
+#include <immintrin.h>
+#endif
+
+typedef uint_fast32_t UINT32;
+
+static const UINT32 DEFAULT_INITAL_CHECKSUM = 0xFFFFFFFF;
+/** Files are read in blocks of this size */
+#define BUFFER_SIZE (128 * 1024)
+/** Files checksummed with CHECKSUM_READ_STREAM are read in blocks of this size */
+#define STREAM_BUFFER_SIZE (256 * 1024)
+/**
+ * Pages read with CHECKSUM_READ_STREAM are dropped from the page cache with
+ * this lag. The kernel caches file content in folios larger than a block,
+ * and a folio is only dropped once all of it is read.
+ */
+#define STREAM_DROP_WINDOW (8 * 1024 * 1024)
+/**
+ * Min number of bytes checksummed by each thread of a parallel checksum.
+ * Ranges are multiples of STREAM_BUFFER_SIZE, so they start at a page boundary.
+ */
+#define MIN_PARALLEL_RANGE_LEN (4 * 1024 * 1024)
+/**
+ * Files shorter than this are read like with CHECKSUM_READ_CACHED, even with
+ * CHECKSUM_READ_STREAM. They evict little of the page cache, and finding and
+ * dropping their pages would cost more than reading them.
+ */
+#define MIN_STREAM_FILE_LEN MIN_PARALLEL_RANGE_LEN
+/** Reflected CRC-32 polynomial */
+#define CRC32_POLYNOMIAL 0xEDB88320
+
+/** Memoize the result of calculation performed on each byte */
+static const UINT32 CRC32_TABLE[] = {
+    0x00000000, 0x77073096, 0xEE0E612C, 0x990951BA,
+    0x076DC419, 0x706AF48F, 0xE963A535, 0x9E6495A3,
+    0x0EDB8832, 0x79DCB8A4, 0xE0D5E91E, 0x97D2D988,
+    0x09B64C2B, 0x7EB17CBD, 0xE7B82D07, 0x90BF1D91,
+    0x1DB71064, 0x6AB020F2, 0xF3B97148, 0x84BE41DE,
+    0x1ADAD47D, 0x6DDDE4EB, 0xF4D4B551, 0x83D385C7,
+    0x136C9856, 0x646BA8C0, 0xFD62F97A, 0x8A65C9EC,
+    0x14015C4F, 0x63066CD9, 0xFA0F3D63, 0x8D080DF5,
+    0x3B6E20C8, 0x4C69105E, 0xD56041E4, 0xA2677172,
+    0x3C03E4D1, 0x4B04D447, 0xD20D85FD, 0xA50AB56B,
+    0x35B5A8FA, 0x42B2986C, 0xDBBBC9D6, 0xACBCF940,
+    0x32D86CE3, 0x45DF5C75, 0xDCD60DCF, 0xABD13D59,
+    0x26D930AC, 0x51DE003A, 0xC8D75180, 0xBFD06116,
+    0x21B4F4B5, 0x56B3C423, 0xCFBA9599, 0xB8BDA50F,
+    0x2802B89E, 0x5F058808, 0xC60CD9B2, 0xB10BE924,
+    0x2F6F7C87, 0x58684C11, 0xC1611DAB, 0xB6662D3D,
+    0x76DC4190, 0x01DB7106, 0x98D220BC, 0xEFD5102A,
+    0x71B18589, 0x06B6B51F, 0x9FBFE4A5, 0xE8B8D433,
+    0x7807C9A2, 0x0F00F934, 0x9609A88E, 0xE10E9818,
+    0x7F6A0DBB, 0x086D3D2D, 0x91646C97, 0xE6635C01,
+    0x6B6B51F4, 0x1C6C6162, 0x856530D8, 0xF262004E,
+    0x6C0695ED, 0x1B01A57B, 0x8208F4C1, 0xF50FC457,
+    0x65B0D9C6, 0x12B7E950, 0x8BBEB8EA, 0xFCB9887C,
+    0x62DD1DDF, 0x15DA2D49, 0x8CD37CF3, 0xFBD44C65,
+    0x4DB26158, 0x3AB551CE, 0xA3BC0074, 0xD4BB30E2,
+    0x4ADFA541, 0x3DD895D7, 0xA4D1C46D, 0xD3D6F4FB,
+    0x4369E96A, 0x346ED9FC, 0xAD678846, 0xDA60B8D0,
+    0x44042D73, 0x33031DE5, 0xAA0A4C5F, 0xDD0D7CC9,
+    0x5005713C, 0x270241AA, 0xBE0B1010, 0xC90C2086,
+    0x5768B525, 0x206F85B3, 0xB966D409, 0xCE61E49F,
+    0x5EDEF90E, 0x29D9C998, 0xB0D09822, 0xC7D7A8B4,
+    0x59B33D17, 0x2EB40D81, 0xB7BD5C3B, 0xC0BA6CAD,
+    0xEDB88320, 0x9ABFB3B6, 0x03B6E20C, 0x74B1D29A,
+    0xEAD54739, 0x9DD277AF, 0x04DB2615, 0x73DC1683,
+    0xE3630B12, 0x94643B84, 0x0D6D6A3E, 0x7A6A5AA8,
+    0xE40ECF0B, 0x9309FF9D, 0x0A00AE27, 0x7D079EB1,
+    0xF00F9344, 0x8708A3D2, 0x1E01F268, 0x6906C2FE,
+    0xF762575D, 0x806567CB, 0x196C3671, 0x6E6B06E7,
+    0xFED41B76, 0x89D32BE0, 0x10DA7A5A, 0x67DD4ACC,
+    0xF9B9DF6F, 0x8EBEEFF9, 0x17B7BE43, 0x60B08ED5,
+    0xD6D6A3E8, 0xA1D1937E, 0x38D8C2C4, 0x4FDFF252,
+    0xD1BB67F1, 0xA6BC5767, 0x3FB506DD, 0x48B2364B,
+    0xD80D2BDA, 0xAF0A1B4C, 0x36034AF6, 0x41047A60,
+    0xDF60EFC3, 0xA867DF55, 0x316E8EEF, 0x4669BE79,
+    0xCB61B38C, 0xBC66831A, 0x256FD2A0, 0x5268E236,
+    0xCC0C7795, 0xBB0B4703, 0x220216B9, 0x5505262F,
+    0xC5BA3BBE, 0xB2BD0B28, 0x2BB45A92, 0x5CB36A04,
+    0xC2D7FFA7, 0xB5D0CF31, 0x2CD99E8B, 0x5BDEAE1D,
+    0x9B64C2B0, 0xEC63F226, 0x756AA39C, 0x026D930A,
+    0x9C0906A9, 0xEB0E363F, 0x72076785, 0x05005713,
+    0x95BF4A82, 0xE2B87A14, 0x7BB12BAE, 0x0CB61B38,
+    0x92D28E9B, 0xE5D5BE0D, 0x7CDCEFB7, 0x0BDBDF21,
+    0x86D3D2D4, 0xF1D4E242, 0x68DDB3F8, 0x1FDA836E,
+    0x81BE16CD, 0xF6B9265B, 0x6FB077E1, 0x18B74777,
+    0x88085AE6, 0xFF0F6A70, 0x66063BCA, 0x11010B5C,
+    0x8F659EFF, 0xF862AE69, 0x616BFFD3, 0x166CCF45,
+    0xA00AE278, 0xD70DD2EE, 0x4E048354, 0x3903B3C2,
+    0xA7672661, 0xD06016F7, 0x4969474D, 0x3E6E77DB,
+    0xAED16A4A, 0xD9D65ADC, 0x40DF0B66, 0x37D83BF0,
+    0xA9BCAE53, 0xDEBB9EC5, 0x47B2CF7F, 0x30B5FFE9,
+    0xBDBDF21C, 0xCABAC28A, 0x53B39330, 0x24B4A3A6,
+    0xBAD03605, 0xCDD70693, 0x54DE5729, 0x23D967BF,
+    0xB3667A2E, 0xC4614AB8, 0x5D681B02, 0x2A6F2B94,
+    0xB40BBE37, 0xC30C8EA1, 0x5A05DF1B, 0x2D02EF8D
+};
+
+
+/**
+ * Tables for processing 16 bytes per step ("slicing-by-16").
+ * SLICE_TABLES[k][b] is the checksum of byte b followed by k zero bytes,
+ * so the bytes of a block can be looked up independently and combined.
+ * SLICE_TABLES[0] is CRC32_TABLE.
+ */
+static uint32_t SLICE_TABLES[16][256];
+static pthread_once_t checksum_once = PTHREAD_ONCE_INIT;
+
+/**
+ * Carry-less multiplication kernel for the CPU, or NULL if it has none.
+ * It processes a multiple of 16 bytes, at least 64, and is chosen with
+ * the slicing tables.
+ */
+static uint32_t (*clmul_kernel)(const unsigned char* data, size_t data_len, uint32_t checksum) = NULL;
+
+/** How files are read, set with set_checksum_read_mode() */
+static enum ChecksumReadMode read_mode = CHECKSUM_READ_CACHED;
+
+/** X_POW_2N[n] is x^(2^n) mod P, used to combine checksums */
+static uint32_t X_POW_2N[32];
+
+
+/**
+ * A range of a file checksummed by one thread
+ */
+struct ChecksumRange {
+    pthread_t thread;
+    int fd;
+    off_t offset;
+    off_t len;
+    /** Whether the range is read with crc32_streamed_range_checksum() */
+    bool is_streamed;
+    /** Pages of the file cached before the checksum, NULL if they are all kept */
+    const unsigned char* cached_pages;
+    UINT32 checksum;
+    /** Whether the range couldn't be read in full */
+    bool is_failed;
+};
+
+
+/*
+ * Helper functions
+ */
+
+static void init_slice_tables() {
+    int b, k;
+    for (b = 0; b < 256; b++) {
+        SLICE_TABLES[0][b] = CRC32_TABLE[b];
+    }
+    for (k = 1; k < 16; k++) {
+        for (b = 0; b < 256; b++) {
+            uint32_t previous = SLICE_TABLES[k-1][b];
+            SLICE_TABLES[k][b] = (previous >> 8) ^ CRC32_TABLE[previous & 0xFF];
+        }
+    }
+}
+
+
+static inline uint32_t load_le32(const unsigned char* data) {
+    uint32_t word;
+    memcpy(&word, data, 4);
+    return le32toh(word);
+}
+
+
+/**
+ * Process 16 bytes at a time
+ * @param n_blocks Number of 16-byte blocks
+ */
+static uint32_t crc32_slicing_by_16(const unsigned char* data, size_t n_blocks, uint32_t checksum) {
+    const uint32_t (*t)[256] = (const uint32_t (*)[256])SLICE_TABLES;
+    while (n_blocks-- > 0) {
+        uint32_t w0 = load_le32(data) ^ checksum;
+        uint32_t w1 = load_le32(data + 4);
+        uint32_t w2 = load_le32(data + 8);
+        uint32_t w3 = load_le32(data + 12);
+        checksum = t[15][w0 & 0xFF] ^ t[14][(w0 >> 8) & 0xFF]
+                ^ t[13][(w0 >> 16) & 0xFF] ^ t[12][w0 >> 24]
+                ^ t[11][w1 & 0xFF] ^ t[10][(w1 >> 8) & 0xFF]
+                ^ t[9][(w1 >> 16) & 0xFF] ^ t[8][w1 >> 24]
+                ^ t[7][w2 & 0xFF] ^ t[6][(w2 >> 8) & 0xFF]
+                ^ t[5][(w2 >> 16) & 0xFF] ^ t[4][w2 >> 24]
+                ^ t[3][w3 & 0xFF] ^ t[2][(w3 >> 8) & 0xFF]
+                ^ t[1][(w3 >> 16) & 0xFF] ^ t[0][w3 >> 24];
+        data += 16;
+    }
+    return checksum;
+}
+
+
+/**
+ * Process 8 bytes at a time
+ * @param n_blocks Number of 8-byte blocks
+ */
+static uint32_t crc32_slicing_by_8(const unsigned char* data, size_t n_blocks, uint32_t checksum) {
+    const uint32_t (*t)[256] = (const uint32_t (*)[256])SLICE_TABLES;
+    while (n_blocks-- > 0) {
+        uint32_t w0 = load_le32(data) ^ checksum;
+        uint32_t w1 = load_le32(data + 4);
+        checksum = t[7][w0 & 0xFF] ^ t[6][(w0 >> 8) & 0xFF]
+                ^ t[5][(w0 >> 16) & 0xFF] ^ t[4][w0 >> 24]
+                ^ t[3][w1 & 0xFF] ^ t[2][(w1 >> 8) & 0xFF]
+                ^ t[1][(w1 >> 16) & 0xFF] ^ t[0][w1 >> 24];
+        data += 8;
+    }
+    return checksum;
+}
+
+
+#ifdef HAS_CLMUL_KERNELS
+
+/*
+ * Carry-less multiplication ("folding") kernels, as described in Intel's
+ * "Fast CRC Computation for Generic Polynomials Using PCLMULQDQ Instruction".
+ * The data is folded into 128-bit lanes: multiplying a lane by x^D mod P moves
+ * it D bits forward, where it is added to the data there. Each constant pair
+ * is (x^(D+32) mod P, x^(D-32) mod P), bit-reflected and shifted left by 1,
+ * for a fold distance D.
+ */
+
+/** D = 512, folding 4 lanes at once, or a 4-lane register onto the next */
+static const uint64_t FOLD_512[2] = {0x0154442bd4, 0x01c6e41596};
+/** D = 128, folding 1 lane */
+static const uint64_t FOLD_128[2] = {0x01751997d0, 0x00ccaa009e};
+/** D = 2048, folding 4 registers of 4 lanes at once */
+static const uint64_t FOLD_2048[2] = {0x011542778a, 0x01322d1430};
+/** D = 384 and 256, folding the lanes of a register onto its last one */
+static const uint64_t FOLD_384[2] = {0x003db1ecdc, 0x0174359406};
+static const uint64_t FOLD_256[2] = {0x00f1da05aa, 0x015a546366};
+/** x^64 mod P, for the reduction from 64 to 32 bits */
+static const uint64_t REDUCE_64[2] = {0x0163cd6124, 0};
+/** P and floor(x^64 / P), for the final Barrett reduction */
+static const uint64_t BARRETT[2] = {0x01db710641, 0x01f7011641};
+
+
+__attribute__((target("pclmul,sse4.1")))
+static inline __m128i fold_128(__m128i lane, __m128i constants, __m128i next) {
+    __m128i low = _mm_clmulepi64_si128(lane, constants, 0x00);
+    __m128i high = _mm_clmulepi64_si128(lane, constants, 0x11);
+    return _mm_xor_si128(_mm_xor_si128(low, high), next);
+}
+
+
+/**
+ * Fold the remaining data into a lane, 16 bytes at a time,
+ * then reduce the lane to the 32-bit checksum
+ * @param data_len A multiple of 16
+ */
+__attribute__((target("pclmul,sse4.1")))
+static uint32_t fold_and_reduce(__m128i x1, const unsigned char* data, size_t data_len) {
+    __m128i k = _mm_loadu_si128((const __m128i*)FOLD_128);
+    for (; data_len >= 16; data += 16, data_len -= 16) {
+        x1 = fold_128(x1, k, _mm_loadu_si128((const __m128i*)data));
+    }
+
+    // 128 to 64 bits
+    __m128i mask = _mm_setr_epi32(~0, 0, ~0, 0);
+    __m128i x2 = _mm_clmulepi64_si128(x1, k, 0x10);
+    x1 = _mm_xor_si128(_mm_srli_si128(x1, 8), x2);
+
+    // 64 to 32 bits
+    k = _mm_loadu_si128((const __m128i*)REDUCE_64);
+    x2 = _mm_srli_si128(x1, 4);
+    x1 = _mm_and_si128(x1, mask);
+    x1 = _mm_clmulepi64_si128(x1, k, 0x00);
+    x1 = _mm_xor_si128(x1, x2);
+
+    // Barrett reduction
+    k = _mm_loadu_si128((const __m128i*)BARRETT);
+    x2 = _mm_and_si128(x1, mask);
+    x2 = _mm_clmulepi64_si128(x2, k, 0x10);
+    x2 = _mm_and_si128(x2, mask);
+    x2 = _mm_clmulepi64_si128(x2, k, 0x00);
+    x1 = _mm_xor_si128(x1, x2);
+    return _mm_extract_epi32(x1, 1);
+}
+
+
+/**
+ * Kernel using PCLMULQDQ, folding 4 lanes (64 bytes) per step
+ */
+__attribute__((target("pclmul,sse4.1")))
+static uint32_t crc32_pclmul(const unsigned char* data, size_t data_len, uint32_t checksum) {
+    __m128i x1 = _mm_loadu_si128((const __m128i*)data);
+    __m128i x2 = _mm_loadu_si128((const __m128i*)(data + 16));
+    __m128i x3 = _mm_loadu_si128((const __m128i*)(data + 32));
+    __m128i x4 = _mm_loadu_si128((const __m128i*)(data + 48));
+    x1 = _mm_xor_si128(x1, _mm_cvtsi32_si128(checksum));
+    data += 64;
+    data_len -= 64;
+
+    __m128i k = _mm_loadu_si128((const __m128i*)FOLD_512);
+    for (; data_len >= 64; data += 64, data_len -= 64) {
+        x1 = fold_128(x1, k, _mm_loadu_si128((const __m128i*)data));
+        x2 = fold_128(x2, k, _mm_loadu_si128((const __m128i*)(data + 16)));
+        x3 = fold_128(x3, k, _mm_loadu_si128((const __m128i*)(data + 32)));
+        x4 = fold_128(x4, k, _mm_loadu_si128((const __m128i*)(data + 48)));
+    }
+
+    // fold the 4 lanes into one
+    k = _mm_loadu_si128((const __m128i*)FOLD_128);
+    x1 = fold_128(x1, k, x2);
+    x1 = fold_128(x1, k, x3);
+    x1 = fold_128(x1, k, x4);
+    return fold_and_reduce(x1, data, data_len);
+}
+
+
+__attribute__((target("avx512f,avx512vl,vpclmulqdq")))
+static inline __m512i fold_512(__m512i lanes, __m512i constants, __m512i next) {
+    __m512i low = _mm512_clmulepi64_epi128(lanes, constants, 0x00);
+    __m512i high = _mm512_clmulepi64_epi128(lanes, constants, 0x11);
+    return _mm512_ternarylogic_epi64(low, high, next, 0x96);  // low ^ high ^ next
+}
+
+
+/**
+ * Kernel using VPCLMULQDQ on AVX-512 registers, folding 16 lanes (256 bytes)
+ * per step. Less than 256 bytes are left to the PCLMULQDQ kernel.
+ */
+__attribute__((target("avx512f,avx512vl,vpclmulqdq,pclmul,sse4.1")))
+static uint32_t crc32_vpclmul(const unsigned char* data, size_t data_len, uint32_t checksum) {
+    if (data_len < 256) {
+        return crc32_pclmul(data, data_len, checksum);
+    }
+    __m512i x0 = _mm512_loadu_si512((const void*)data);
+    __m512i x1 = _mm512_loadu_si512((const void*)(data + 64));
+    __m512i x2 = _mm512_loadu_si512((const void*)(data + 128));
+    __m512i x3 = _mm512_loadu_si512((const void*)(data + 192));
+    x0 = _mm512_xor_si512(x0, _mm512_zextsi128_si512(_mm_cvtsi32_si128(checksum)));
+    data += 256;
+    data_len -= 256;
+
+    __m512i k = _mm512_broadcast_i32x4(_mm_loadu_si128((const __m128i*)FOLD_2048));
+    for (; data_len >= 256; data += 256, data_len -= 256) {
+        x0 = fold_512(x0, k, _mm512_loadu_si512((const void*)data));
+        x1 = fold_512(x1, k, _mm512_loadu_si512((const void*)(data + 64)));
+        x2 = fold_512(x2, k, _mm512_loadu_si512((const void*)(data + 128)));
+        x3 = fold_512(x3, k, _mm512_loadu_si512((const void*)(data + 192)));
+    }
+
+    // fold the 4 registers into one, then the rest 64 bytes at a time
+    k = _mm512_broadcast_i32x4(_mm_loadu_si128((const __m128i*)FOLD_512));
+    x0 = fold_512(x0, k, x1);
+    x0 = fold_512(x0, k, x2);
+    x0 = fold_512(x0, k, x3);
+    for (; data_len >= 64; data += 64, data_len -= 64) {
+        x0 = fold_512(x0, k, _mm512_loadu_si512((const void*)data));
+    }
+
+    // fold the 4 lanes of the register onto the last one
+    __m128i lane = _mm512_extracti32x4_epi32(x0, 3);
+    lane = fold_128(_mm512_extracti32x4_epi32(x0, 0), _mm_loadu_si128((const __m128i*)FOLD_384), lane);
+    lane = fold_128(_mm512_extracti32x4_epi32(x0, 1), _mm_loadu_si128((const __m128i*)FOLD_256), lane);
+    lane = fold_128(_mm512_extracti32x4_epi32(x0, 2), _mm_loadu_si128((const __m128i*)FOLD_128), lane);
+    return fold_and_reduce(lane, data, data_len);
+}
+
+#endif // HAS_CLMUL_KERNELS
+
+
+/**
+ * Multiply 2 polynomials modulo P, in reflected bit order
+ */
+static uint32_t multiply_mod_p(uint32_t a, uint32_t b) {
+    uint32_t product = 0;
+    uint32_t mask = 1u << 31;  // x^0
+    for (; mask != 0; mask >>= 1) {
+        if (a & mask) {
+            product ^= b;
+        }
+        // b *= x
+        b = (b & 1) ? (b >> 1) ^ CRC32_POLYNOMIAL : b >> 1;
+    }
+    return product;
+}
+
+
+/**
+ * @return x^(8 * n_bytes) mod P, the factor moving a checksum past n_bytes of data
+ */
+static uint32_t x_pow_8n_mod_p(uint64_t n_bytes) {
+    uint32_t power = 1u << 31;  // x^0
+    int k = 3;                  // 8 * n_bytes = n_bytes * 2^3
+    for (; n_bytes != 0; n_bytes >>= 1, k++) {
+        if (n_bytes & 1) {
+            power = multiply_mod_p(X_POW_2N[k & 31], power);
+        }
+    }
+    return power;
+}
+
+
+/**
+ * Find which pages of a file are in the page cache. The file is mapped
+ * without being touched, only to ask the kernel with mincore().
+ * @return One byte per page, with bit 0 set if the page is cached, or NULL
+ *         if fail. Must be freed.
+ */
+static unsigned char* find_cached_pages(int fd, off_t file_len, size_t page_size) {
+    if (file_len == 0) {
+        return NULL;
+    }
+    void* map = mmap(NULL, file_len, PROT_READ, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) {
+        return NULL;
+    }
+    unsigned char* cached_pages = malloc((file_len + page_size - 1) / page_size);
+    if (cached_pages != NULL && mincore(map, file_len, cached_pages) < 0) {
+        free(cached_pages);
+        cached_pages = NULL;
+    }
+    munmap(map, file_len);
+    return cached_pages;
+}
+
+
+/**
+ * Drop from the page cache the pages of a part of a file that weren't
+ * cached before it was read
+ * @param offset       Start of the part, a multiple of the page size
+ * @param cached_pages Pages of the whole file cached before the read
+ */
+static void drop_uncached_pages(int fd, off_t offset, off_t len,
+        const unsigned char* cached_pages, size_t page_size) {
+    size_t i = offset / page_size;
+    size_t end_page = (offset + len + page_size - 1) / page_size;
+    while (i < end_page) {
+        if (cached_pages[i] & 1) {
+            i++;
+            continue;
+        }
+        size_t first_page = i;
+        while (i < end_page && !(cached_pages[i] & 1)) {
+            i++;
+        }
+        posix_fadvise(fd, first_page * page_size, (i - first_page) * page_size, POSIX_FADV_DONTNEED);
+    }
+}
+
+
+/**
+ * Checksum a range of a file in large blocks, with sequential readahead.
+ * The range is marked as failed if it can't be read in full.
+ * The pages read from disk are dropped from the page cache once checksummed,
+ * so that a scan of cold files doesn't evict the cached ones.
+ */
+static UINT32 crc32_streamed_range_checksum(struct ChecksumRange* range) {
+    size_t page_size = sysconf(_SC_PAGESIZE);
+    posix_fadvise(range->fd, range->offset, range->len, POSIX_FADV_SEQUENTIAL);
+    unsigned char* buffer = malloc(STREAM_BUFFER_SIZE);
+    UINT32 checksum = DEFAULT_INITAL_CHECKSUM;
+    off_t offset = range->offset;
+    off_t range_end = range->offset + range->len;
+    while (offset < range_end) {
+        size_t chunk_len = range_end - offset < STREAM_BUFFER_SIZE ? range_end - offset : STREAM_BUFFER_SIZE;
+        ssize_t bytes_read = pread(range->fd, buffer, chunk_len, offset);
+        if (bytes_read <= 0) {
+            range->is_failed = true;
+            break;
+        }
+        checksum = crc32_running_checksum(buffer, bytes_read, checksum);
+        offset += bytes_read;
+
+        // drop what was read in the last window, including the folios
+        // that were only partly read by the previous blocks (or by the
+        // thread checksumming the previous range)
+        if (range->cached_pages != NULL) {
+            off_t drop_offset = offset > STREAM_DROP_WINDOW ? offset - STREAM_DROP_WINDOW : 0;
+            drop_offset -= drop_offset % page_size;
+            drop_uncached_pages(range->fd, drop_offset, offset - drop_offset,
+                    range->cached_pages, page_size);
+        }
+    }
+    free(buffer);
+    return checksum ^ 0xFFFFFFFF;
+}
+
+
+/**
+ * Checksum a range of a file, read with pread() so that multiple
+ * threads can share the descriptor
+ */
+static UINT32 crc32_range_checksum(struct ChecksumRange* range) {
+    if (range->is_streamed) {
+        return crc32_streamed_range_checksum(range);
+    }
+    unsigned char* buffer = malloc(BUFFER_SIZE);
+    UINT32 checksum = DEFAULT_INITAL_CHECKSUM;
+    off_t offset = range->offset;
+    off_t len = range->len;
+    while (len > 0) {
+        size_t chunk_len = len < BUFFER_SIZE ? len : BUFFER_SIZE;
+        ssize_t bytes_read = pread(range->fd, buffer, chunk_len, offset);
+        if (bytes_read <= 0) {
+            range->is_failed = true;
+            break;
+        }
+        checksum = crc32_running_checksum(buffer, bytes_read, checksum);
+        offset += bytes_read;
+        len -= bytes_read;
+    }
+    free(buffer);
+    return checksum ^ 0xFFFFFFFF;
+}
+
+
+static void* run_range_checksum(void* arg) {
+    struct ChecksumRange* range = arg;
+    range->checksum = crc32_range_checksum(range);
+    return NULL;
+}
+
+
+/**
+ * Build the slicing tables and combination powers,
+ * and choose the fastest kernel the CPU supports
+ */
+static void init_checksum() {
+    init_slice_tables();
+    uint32_t power = 1u << 30;  // x^1
+    int n;
+    for (n = 0; n < 32; n++) {
+        X_POW_2N[n] = power;
+        power = multiply_mod_p(power, power);
+    }
+#ifdef HAS_CLMUL_KERNELS
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("pclmul") && __builtin_cpu_supports("sse4.1")) {
+        clmul_kernel = crc32_pclmul;
+        if (__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512vl")
+                && __builtin_cpu_supports("vpclmulqdq")) {
+            clmul_kernel = crc32_vpclmul;
+        }
+    }
+#endif
+}
+
+
+/*
+ * Public functions
+ */
+
+
+UINT32 crc32_running_checksum(const unsigned char *data, size_t data_len, UINT32 inital_checksum) {
+    pthread_once(&checksum_once, init_checksum);
+    uint32_t checksum = inital_checksum;
+
+    // with carry-less multiplication, the bulk of the data is folded
+    // 16 bytes at a time, and the rest goes through the tables
+    if (clmul_kernel != NULL && data_len >= 64) {
+        size_t folded_len = data_len & ~(size_t)15;
+        checksum = clmul_kernel(data, folded_len, checksum);
+        data += folded_len;
+        data_len -= folded_len;
+    }
+
+    // bulk of the data 16 bytes at a time, then what's left 8 bytes
+    // at a time, and the last few bytes one at a time
+    checksum = crc32_slicing_by_16(data, data_len / 16, checksum);
+    data += data_len & ~(size_t)15;
+    data_len &= 15;
+    checksum = crc32_slicing_by_8(data, data_len / 8, checksum);
+    data += data_len & ~(size_t)7;
+    data_len &= 7;
+
+    size_t i;
+    for (i = 0; i < data_len; i++) {
+        int lookup_ind = (checksum ^ data[i]) & 0xFF;
+        checksum = (checksum >> 8) ^ CRC32_TABLE[lookup_ind];
+    }
+    return checksum;
+}
+
+
+UINT32 crc32_file_checksum(FILE *fd) {
+    // create a buffer to store a large chunk of the file
+    unsigned char* buffer = malloc(BUFFER_SIZE);
+
+    UINT32 checksum = DEFAULT_INITAL_CHECKSUM;
+
+    // the file will be processed in chunk of BUFFER_SIZE
+    // this loop repeatedly read a new chunk, then incrementally
+    // find the running checksum
+    size_t bytes_read = 0;
+    while((bytes_read = fread(buffer, 1, BUFFER_SIZE, fd)) > 0) {
+        checksum = crc32_running_checksum(buffer, bytes_read, checksum);
+    }
+
+    free(buffer);
+
+    // the final running checksum is negated, according to CRC-32 specification
+    checksum ^= 0xFFFFFFFF;
+    return checksum;
+}
+
+
+UINT32 crc32_combine(UINT32 checksum1, UINT32 checksum2, uint64_t len2) {
+    pthread_once(&checksum_once, init_checksum);
+    // the first checksum is moved past the second data, then both are added
+    return multiply_mod_p(x_pow_8n_mod_p(len2), checksum1) ^ checksum2;
+}
+
+
+int crc32_parallel_file_checksum(int fd, int n_threads, UINT32* checksum) {
+    pthread_once(&checksum_once, init_checksum);
+    struct stat file_stat;
+    if (fstat(fd, &file_stat) < 0) {
+        return -1;
+    }
+    off_t file_len = file_stat.st_size;
+
+    // the pages already cached are found before any read,
+    // since readahead caches the next blocks ahead of time
+    bool is_streamed = read_mode == CHECKSUM_READ_STREAM && file_len >= MIN_STREAM_FILE_LEN;
+    unsigned char* cached_pages = NULL;
+    if (is_streamed) {
+        cached_pages = find_cached_pages(fd, file_len, sysconf(_SC_PAGESIZE));
+    }
+
+    // each thread gets a large enough range to be worth starting it
+    off_t max_threads = file_len / MIN_PARALLEL_RANGE_LEN;
+    if (n_threads > max_threads) {
+        n_threads = max_threads;
+    }
+    if (n_threads < 1) {
+        n_threads = 1;
+    }
+
+    // split the file in equal ranges of whole blocks, the last one taking
+    // the remainder. The calling thread checksums the first range.
+    struct ChecksumRange* ranges = malloc(n_threads * sizeof(struct ChecksumRange));
+    off_t range_len = file_len / n_threads / STREAM_BUFFER_SIZE * STREAM_BUFFER_SIZE;
+    int i;
+    for (i = 0; i < n_threads; i++) {
+        ranges[i].fd = fd;
+        ranges[i].offset = i * range_len;
+        ranges[i].len = (i == n_threads - 1) ? file_len - ranges[i].offset : range_len;
+        ranges[i].is_streamed = is_streamed;
+        ranges[i].cached_pages = cached_pages;
+        ranges[i].is_failed = false;
+        if (i > 0 && pthread_create(&ranges[i].thread, NULL, run_range_checksum, &ranges[i]) != 0) {
+            // no thread available, checksum the range after the others
+            ranges[i].thread = pthread_self();
+        }
+    }
+    run_range_checksum(&ranges[0]);
+
+    // combine the checksums of the ranges in order
+    *checksum = ranges[0].checksum;
+    bool is_failed = ranges[0].is_failed;
+    for (i = 1; i < n_threads; i++) {
+        if (pthread_equal(ranges[i].thread, pthread_self())) {
+            run_range_checksum(&ranges[i]);
+        } else {
+            pthread_join(ranges[i].thread, NULL);
+        }
+        *checksum = crc32_combine(*checksum, ranges[i].checksum, ranges[i].len);
+        is_failed = is_failed || ranges[i].is_failed;
+    }
+
+    // readahead went past the end of each range, into the folios of the
+    // next one, which are dropped once all are read
+    if (cached_pages != NULL) {
+        drop_uncached_pages(fd, 0, file_len, cached_pages, sysconf(_SC_PAGESIZE));
+    }
+    free(ranges);
+    free(cached_pages);
+    return is_failed ? -1 : 0;
+}
+
+
+void set_checksum_read_mode(enum ChecksumReadMode mode) {
+    read_mode = mode;
+}
@@ -6,10 +6,44 @@
 #define FILE_CHECKSUM_H_
 
 
+#include <stddef.h>
 #include <stdio.h>   /* file IO */
 #include <stdint.h>  /* integer types of exact size */
 
 
+/**
+ * How files are read by crc32_parallel_file_checksum()
+ */
+enum ChecksumReadMode {
+    /** Blocks of 128KB, through the page cache like any other read */
+    CHECKSUM_READ_CACHED,
+    /**
+     * Blocks of 256KB with sequential readahead. The pages that weren't cached
+     * before are dropped from the page cache once checksummed, so that
+     * checksumming a cold library doesn't evict the data already cached.
+     * Files of less than a few MB are read like with CHECKSUM_READ_CACHED.
+     */
+    CHECKSUM_READ_STREAM,
+};
+
+
+/**
+ * Calculate the running checksum of a byte array
+ * by starting with the given initial_checksum instead of 0xFFFFFFFF
+ * This is used as a helper for computing the checksum of a large file,
+ * by reading the file in chunk, then compute the running checksum of
+ * the chunks so far.
+ *
+ * @param  data             Byte array whose checksum need to be computed
+ * @param  data_len         Length of the byte array
+ * @param  initial_checksum The running checksum of the previous data
+ * @return The running checksum of all previous data and the current data
+ *         xor by 0xFFFFFFFF
+ */
+uint_fast32_t crc32_running_checksum(const unsigned char *data, size_t data_len,
+        uint_fast32_t initial_checksum);
+
+
 /**
  * Compute the checksum of the given file
  *
@@ -19,4 +53,36 @@
 uint_fast32_t crc32_file_checksum(FILE *fd);
 
 
+/**
+ * Compute the checksum of the data made of 2 parts, from their checksums
+ *
+ * @param checksum1 The CRC-32 checksum of the first part
+ * @param checksum2 The CRC-32 checksum of the second part
+ * @param len2      Length of the second part
+ * @return The CRC-32 checksum of both parts
+ */
+uint_fast32_t crc32_combine(uint_fast32_t checksum1, uint_fast32_t checksum2, uint64_t len2);
+
+
+/**
+ * Compute the checksum of the given file, splitting it in ranges checksummed
+ * by multiple threads. Small files are checksummed by the calling thread only.
+ * The result is the same as crc32_file_checksum().
+ *
+ * @param fd        Descriptor of the file
+ * @param n_threads Max number of threads, including the calling thread
+ * @param checksum  [out] The CRC-32 checksum of the file
+ * @return 0 if success, -1 if the file couldn't be read in full
+ */
+int crc32_parallel_file_checksum(int fd, int n_threads, uint_fast32_t* checksum);
+
+
+/**
+ * Choose how files are read by crc32_parallel_file_checksum()
+ * (CHECKSUM_READ_CACHED by default). Must be called before any checksum
+ * is computed by other threads.
+ */
+void set_checksum_read_mode(enum ChecksumReadMode mode);
+
+
 #endif // FILE_CHECKSUM_H_
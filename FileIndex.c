@@ -0,0 +1,348 @@
+#include "FileIndex.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/file.h>
+#include <unistd.h>
+
+
+/** Start of every index file, followed by the entries */
+static const char INDEX_MAGIC[8] = "GMMIDX01";
+
+
+/*
+ * Helper functions
+ */
+
+/**
+ * Read exactly len bytes at the given offset
+ * @return true if success, false if error or the file is too short
+ */
+static bool read_exactly(int fd, void* buffer, size_t len, off_t offset) {
+    size_t n_read = 0;
+    while (n_read < len) {
+        ssize_t n_new_bytes = pread(fd, (char*)buffer + n_read, len - n_read, offset + n_read);
+        if (n_new_bytes <= 0) {
+            return false;
+        }
+        n_read += n_new_bytes;
+    }
+    return true;
+}
+
+
+/**
+ * Write exactly len bytes at the given offset
+ * @return true if success, false if error
+ */
+static bool write_exactly(int fd, const void* buffer, size_t len, off_t offset) {
+    size_t n_written = 0;
+    while (n_written < len) {
+        ssize_t n_new_bytes = pwrite(fd, (const char*)buffer + n_written, len - n_written, offset + n_written);
+        if (n_new_bytes <= 0) {
+            return false;
+        }
+        n_written += n_new_bytes;
+    }
+    return true;
+}
+
+
+/**
+ * @return Number of entries in an index file of the given length,
+ *         or -1 if the length is not the one of an index file
+ */
+static ssize_t count_index_entries(off_t file_len) {
+    if (file_len < (off_t)sizeof(INDEX_MAGIC)
+            || (file_len - sizeof(INDEX_MAGIC)) % sizeof(struct FileIndexEntry) != 0) {
+        return -1;
+    }
+    return (file_len - sizeof(INDEX_MAGIC)) / sizeof(struct FileIndexEntry);
+}
+
+
+static int compare_entries(const void* a, const void* b) {
+    const struct FileIndexEntry* entry_a = a;
+    const struct FileIndexEntry* entry_b = b;
+    return strncmp(entry_a->name, entry_b->name, MAX_FILE_NAME_LEN);
+}
+
+
+/**
+ * Order records by name, then by position in the index file
+ */
+static int compare_records(const void* a, const void* b) {
+    const struct FileIndexEntry* record_a = *(const struct FileIndexEntry* const*)a;
+    const struct FileIndexEntry* record_b = *(const struct FileIndexEntry* const*)b;
+    int result = compare_entries(record_a, record_b);
+    if (result == 0) {
+        result = (record_a > record_b) - (record_a < record_b);
+    }
+    return result;
+}
+
+
+/**
+ * Sort the records of the index by name, keeping only the last record
+ * of each file, since updates are appended after the earlier records
+ */
+static void compact_index(struct FileIndex* index) {
+    size_t n_records = index->n_entries;
+    struct FileIndexEntry** sorted = malloc(n_records * sizeof(struct FileIndexEntry*));
+    size_t i;
+    for (i = 0; i < n_records; i++) {
+        sorted[i] = &index->entries[i];
+    }
+    qsort(sorted, n_records, sizeof(struct FileIndexEntry*), compare_records);
+
+    struct FileIndexEntry* entries = malloc(n_records * sizeof(struct FileIndexEntry));
+    index->n_entries = 0;
+    for (i = 0; i < n_records; i++) {
+        if (i + 1 < n_records && compare_entries(sorted[i], sorted[i + 1]) == 0) {
+            continue;  // a later record of the same file follows
+        }
+        entries[index->n_entries++] = *sorted[i];
+    }
+    index->n_outdated = n_records - index->n_entries;
+    free(sorted);
+    free(index->entries);
+    index->entries = entries;
+}
+
+
+static void set_index_entry(struct FileIndexEntry* entry, const char* file_name,
+        const struct stat* file_stat, uint32_t checksum) {
+    memset(entry, 0, sizeof(*entry));
+    strncpy(entry->name, file_name, MAX_FILE_NAME_LEN - 1);
+    if (file_stat != NULL) {
+        entry->size = file_stat->st_size;
+        entry->mtime_sec = file_stat->st_mtim.tv_sec;
+        entry->mtime_nsec = file_stat->st_mtim.tv_nsec;
+        entry->inode = file_stat->st_ino;
+        entry->checksum = checksum;
+        entry->is_valid = 1;
+    }
+}
+
+
+/**
+ * Open the index file, creating it if missing, and lock it for writing
+ * @return Descriptor of the index file, or -1 if fail
+ */
+static int open_locked_index(const char* index_path) {
+    while (true) {
+        int fd = open(index_path, O_RDWR | O_CREAT | O_CLOEXEC, 0666);
+        if (fd < 0) {
+            return -1;
+        }
+        if (flock(fd, LOCK_EX) < 0) {
+            close(fd);
+            return -1;
+        }
+        // the index file may have been replaced while waiting for the lock,
+        // and the lock must be taken on the current one
+        struct stat fd_stat;
+        struct stat path_stat;
+        if (fstat(fd, &fd_stat) == 0 && stat(index_path, &path_stat) == 0
+                && fd_stat.st_dev == path_stat.st_dev && fd_stat.st_ino == path_stat.st_ino) {
+            return fd;
+        }
+        close(fd);
+    }
+}
+
+
+/**
+ * Add the records appended to the locked index file since the given index
+ * was loaded after the entries of the index, so that they replace them.
+ * All the records are added if the index file was replaced or started over
+ * since, by another save or an update.
+ */
+static void add_appended_records(int fd, struct FileIndex* index, const struct FileIndex* loaded_index) {
+    struct stat index_stat;
+    ssize_t n_records = fstat(fd, &index_stat) == 0 ? count_index_entries(index_stat.st_size) : -1;
+    char magic[sizeof(INDEX_MAGIC)];
+    if (n_records <= 0 || !read_exactly(fd, magic, sizeof(magic), 0)
+            || memcmp(magic, INDEX_MAGIC, sizeof(magic)) != 0) {
+        return;
+    }
+    size_t first_record = 0;
+    if (loaded_index != NULL && loaded_index->loaded_inode == (uint64_t)index_stat.st_ino
+            && loaded_index->n_loaded_records <= (size_t)n_records) {
+        first_record = loaded_index->n_loaded_records;
+    }
+    size_t n_appended = n_records - first_record;
+    if (n_appended == 0) {
+        return;
+    }
+    if (index->n_entries + n_appended > index->capacity) {
+        index->capacity = index->n_entries + n_appended;
+        index->entries = realloc(index->entries, index->capacity * sizeof(struct FileIndexEntry));
+    }
+    if (read_exactly(fd, index->entries + index->n_entries, n_appended * sizeof(struct FileIndexEntry),
+                sizeof(INDEX_MAGIC) + first_record * sizeof(struct FileIndexEntry))) {
+        index->n_entries += n_appended;
+    }
+}
+
+
+/*
+ * Public functions
+ */
+
+
+void load_file_index(const char* index_path, struct FileIndex* index) {
+    index->entries = NULL;
+    index->n_entries = 0;
+    index->capacity = 0;
+    index->n_outdated = 0;
+    index->n_loaded_records = 0;
+    index->loaded_inode = 0;
+
+    int fd = open(index_path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return;
+    }
+    flock(fd, LOCK_SH);
+    struct stat file_stat;
+    ssize_t n_entries = fstat(fd, &file_stat) == 0 ? count_index_entries(file_stat.st_size) : -1;
+    if (n_entries > 0) {
+        char magic[sizeof(INDEX_MAGIC)];
+        struct FileIndexEntry* entries = malloc(n_entries * sizeof(struct FileIndexEntry));
+        if (read_exactly(fd, magic, sizeof(magic), 0)
+                && memcmp(magic, INDEX_MAGIC, sizeof(magic)) == 0
+                && read_exactly(fd, entries, n_entries * sizeof(struct FileIndexEntry), sizeof(magic))) {
+            index->entries = entries;
+            index->n_entries = n_entries;
+            index->capacity = n_entries;
+            index->n_loaded_records = n_entries;
+            index->loaded_inode = file_stat.st_ino;
+        } else {
+            free(entries);
+        }
+    }
+    close(fd);
+
+    // updated entries are appended, so the file isn't always sorted,
+    // and may hold several records of a file
+    if (index->n_entries > 1) {
+        compact_index(index);
+    }
+}
+
+
+struct FileIndexEntry* find_index_entry(struct FileIndex* index, const char* file_name) {
+    if (index->n_entries == 0) {
+        return NULL;
+    }
+    struct FileIndexEntry key;
+    strncpy(key.name, file_name, MAX_FILE_NAME_LEN - 1);
+    key.name[MAX_FILE_NAME_LEN - 1] = 0;
+    return bsearch(&key, index->entries, index->n_entries, sizeof(struct FileIndexEntry), compare_entries);
+}
+
+
+bool matches_index_entry(const struct FileIndexEntry* entry, const struct stat* file_stat) {
+    return entry->is_valid
+            && entry->size == (uint64_t)file_stat->st_size
+            && entry->mtime_sec == file_stat->st_mtim.tv_sec
+            && entry->mtime_nsec == file_stat->st_mtim.tv_nsec
+            && entry->inode == (uint64_t)file_stat->st_ino;
+}
+
+
+void add_index_entry(struct FileIndex* index, const char* file_name,
+        const struct stat* file_stat, uint32_t checksum) {
+    if (index->n_entries == index->capacity) {
+        index->capacity = index->capacity > 0 ? 2 * index->capacity : 64;
+        index->entries = realloc(index->entries, index->capacity * sizeof(struct FileIndexEntry));
+    }
+    set_index_entry(&index->entries[index->n_entries++], file_name, file_stat, checksum);
+}
+
+
+int save_file_index(const char* index_path, struct FileIndex* index,
+        const struct FileIndex* loaded_index) {
+    // hold the lock of the current index while replacing it, so that
+    // updates wait, then apply to the new index
+    int fd = open_locked_index(index_path);
+    if (fd < 0) {
+        return -1;
+    }
+
+    // the updates made while the entries were found, such as files
+    // uploaded during a listing, are newer than them
+    add_appended_records(fd, index, loaded_index);
+    if (index->n_entries > 1) {
+        compact_index(index);
+    }
+
+    // the new index is written next to the current one, then replaces it
+    // at once, so that readers never see a half-written index
+    size_t index_path_len = strlen(index_path);
+    char* temp_path = malloc(index_path_len + 5);
+    memcpy(temp_path, index_path, index_path_len);
+    memcpy(temp_path + index_path_len, ".tmp", 5);
+    int temp_fd = open(temp_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+    bool is_written = temp_fd >= 0
+            && write_exactly(temp_fd, INDEX_MAGIC, sizeof(INDEX_MAGIC), 0)
+            && write_exactly(temp_fd, index->entries,
+                    index->n_entries * sizeof(struct FileIndexEntry), sizeof(INDEX_MAGIC));
+    if (temp_fd >= 0) {
+        close(temp_fd);
+    }
+    if (is_written) {
+        is_written = rename(temp_path, index_path) == 0;
+    }
+    if (!is_written) {
+        printf("Error when saving file index %s\n", index_path);
+        remove(temp_path);
+    }
+    free(temp_path);
+    close(fd);
+    return is_written ? 0 : -1;
+}
+
+
+int update_file_index(const char* index_path, const char* file_name,
+        const struct stat* file_stat, uint32_t checksum) {
+    int fd = open_locked_index(index_path);
+    if (fd < 0) {
+        return -1;
+    }
+    struct stat index_stat;
+    ssize_t n_entries = fstat(fd, &index_stat) == 0 ? count_index_entries(index_stat.st_size) : -1;
+    char magic[sizeof(INDEX_MAGIC)];
+    if (n_entries < 0 || !read_exactly(fd, magic, sizeof(magic), 0)
+            || memcmp(magic, INDEX_MAGIC, sizeof(magic)) != 0) {
+        // new or corrupted index, start over with an empty one
+        n_entries = 0;
+        if (ftruncate(fd, 0) < 0 || !write_exactly(fd, INDEX_MAGIC, sizeof(INDEX_MAGIC), 0)) {
+            close(fd);
+            return -1;
+        }
+    }
+
+    // the record is appended rather than written over the file's earlier
+    // one, so that an update doesn't search the index. The last record of
+    // a file wins when loading, and the others go when the index is saved.
+    struct FileIndexEntry new_entry;
+    set_index_entry(&new_entry, file_name, file_stat, checksum);
+    int result = write_exactly(fd, &new_entry, sizeof(new_entry),
+            sizeof(INDEX_MAGIC) + n_entries * sizeof(struct FileIndexEntry)) ? 0 : -1;
+    close(fd);
+    return result;
+}
+
+
+void free_file_index(struct FileIndex* index) {
+    free(index->entries);
+    index->entries = NULL;
+    index->n_entries = 0;
+    index->capacity = 0;
+    index->n_outdated = 0;
+    index->n_loaded_records = 0;
+    index->loaded_inode = 0;
+}
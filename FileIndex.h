@@ -0,0 +1,114 @@
+/**
+ * Contains a persistent index of file checksums, keyed by the file name,
+ * size, modification time and inode, so that listing a directory only
+ * needs to checksum the files that changed since the last listing
+ */
+
+#ifndef FILE_INDEX_H_
+#define FILE_INDEX_H_
+
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/stat.h>
+
+#include "StorageService.h"
+
+
+/**
+ * An indexed file. This is also the format of each record of the index file.
+ */
+struct FileIndexEntry {
+    char name[MAX_FILE_NAME_LEN];
+    uint64_t size;
+    int64_t mtime_sec;
+    int64_t mtime_nsec;
+    uint64_t inode;
+    uint32_t checksum;
+    /** 0 if the checksum is unknown, and the file must be checksummed again */
+    uint32_t is_valid;
+};
+
+
+/**
+ * The entries of an index file, sorted by name
+ */
+struct FileIndex {
+    struct FileIndexEntry* entries;
+    size_t n_entries;
+    size_t capacity;
+    /**
+     * Number of records of the index file replaced by a later record of
+     * the same file, which are dropped when the index is saved
+     */
+    size_t n_outdated;
+    /**
+     * Number of records and inode of the index file when it was loaded,
+     * so that the records appended by updates since can be found
+     */
+    size_t n_loaded_records;
+    uint64_t loaded_inode;
+};
+
+
+/**
+ * Read an index file. A missing or corrupted index file gives an empty index.
+ * @param  index_path Path to the index file
+ * @param  index      [out] Address of the struct to store the index.
+ *                    Must be freed with free_file_index()
+ */
+void load_file_index(const char* index_path, struct FileIndex* index);
+
+
+/**
+ * @return The entry of the given file, or NULL if the file isn't indexed
+ */
+struct FileIndexEntry* find_index_entry(struct FileIndex* index, const char* file_name);
+
+
+/**
+ * @return true if the entry holds a valid checksum of the file, as it is now
+ */
+bool matches_index_entry(const struct FileIndexEntry* entry, const struct stat* file_stat);
+
+
+/**
+ * Add an entry at the end of the index. The index must be saved before
+ * using find_index_entry() again.
+ */
+void add_index_entry(struct FileIndex* index, const char* file_name,
+        const struct stat* file_stat, uint32_t checksum);
+
+
+/**
+ * Replace the index file with the given entries, and the records appended
+ * by updates since the index file was loaded, which replace the entries
+ * @param  loaded_index Index loaded from the file, whose records the entries
+ *                      are made from, or NULL to keep all the records of
+ *                      the file
+ * @return 0 if success, -1 if fail
+ */
+int save_file_index(const char* index_path, struct FileIndex* index,
+        const struct FileIndex* loaded_index);
+
+
+/**
+ * Update the entry of a single file in the index file, by appending a
+ * record replacing any earlier one of the file
+ * @param  file_stat Status of the file, or NULL if its checksum is unknown
+ *                   (the entry is then invalidated)
+ * @param  checksum  Checksum of the file
+ * @return 0 if success, -1 if fail
+ */
+int update_file_index(const char* index_path, const char* file_name,
+        const struct stat* file_stat, uint32_t checksum);
+
+
+/**
+ * Release the entries of the index
+ */
+void free_file_index(struct FileIndex* index);
+
+
+#endif // FILE_INDEX_H_
@@ -0,0 +1,323 @@
+#include "IoRing.h"
+
+#include <linux/io_uring.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+
+/*
+ * Helper functions
+ */
+
+static int io_uring_setup(unsigned n_entries, struct io_uring_params* params) {
+    return syscall(__NR_io_uring_setup, n_entries, params);
+}
+
+
+static int io_uring_enter(int ring_fd, unsigned to_submit, unsigned min_complete, unsigned flags) {
+    return syscall(__NR_io_uring_enter, ring_fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+
+static int io_uring_register(int ring_fd, unsigned opcode, void* arg, unsigned n_args) {
+    return syscall(__NR_io_uring_register, ring_fd, opcode, arg, n_args);
+}
+
+
+/**
+ * Check that the kernel supports all the operations used by the server
+ */
+static bool supports_operations(int ring_fd) {
+    static const int OPERATIONS[] = {
+        IORING_OP_RECV, IORING_OP_SEND, IORING_OP_READ_FIXED, IORING_OP_WRITE_FIXED,
+    };
+    size_t probe_len = sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op);
+    struct io_uring_probe* probe = calloc(1, probe_len);
+    bool is_supported = io_uring_register(ring_fd, IORING_REGISTER_PROBE, probe, 256) == 0;
+    size_t i;
+    for (i = 0; is_supported && i < sizeof(OPERATIONS) / sizeof(OPERATIONS[0]); i++) {
+        int op = OPERATIONS[i];
+        is_supported = op <= probe->last_op && (probe->ops[op].flags & IO_URING_OP_SUPPORTED);
+    }
+    free(probe);
+    return is_supported;
+}
+
+
+/**
+ * Get a free submission queue entry, submitting the queued ones if the queue is full
+ */
+static struct io_uring_sqe* get_sqe(struct IoRing* ring) {
+    if (!reserve_ring_entries(ring, 1)) {
+        return NULL;
+    }
+    unsigned index = ring->sq_local_tail & *ring->sq_ring_mask;
+    struct io_uring_sqe* sqe = &ring->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    ring->sq_array[index] = index;
+    ring->sq_local_tail++;
+    ring->n_unsubmitted++;
+    return sqe;
+}
+
+
+/**
+ * @return true if queued, false if the submission queue is full
+ */
+static bool queue_operation(struct IoRing* ring, int opcode, int fd, int buffer_index,
+        size_t buffer_offset, size_t len, off_t offset, int msg_flags, bool link, uint64_t user_data) {
+    struct io_uring_sqe* sqe = get_sqe(ring);
+    if (sqe == NULL) {
+        return false;
+    }
+    sqe->opcode = opcode;
+    sqe->fd = fd;
+    sqe->addr = (uint64_t)(uintptr_t)(ring_buffer_address(ring, buffer_index) + buffer_offset);
+    sqe->len = len;
+    sqe->off = offset;
+    sqe->user_data = user_data;
+    if (opcode == IORING_OP_READ_FIXED || opcode == IORING_OP_WRITE_FIXED) {
+        sqe->buf_index = buffer_index;
+    } else {
+        sqe->msg_flags = msg_flags;
+    }
+    if (link) {
+        sqe->flags |= IOSQE_IO_LINK;
+    }
+    return true;
+}
+
+
+/*
+ * Public functions
+ */
+
+
+struct IoRing* create_io_ring(unsigned n_entries, int n_buffers, size_t buffer_len) {
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    int ring_fd = io_uring_setup(n_entries, &params);
+    if (ring_fd < 0) {
+        return NULL;
+    }
+    // without NODROP, completions could be lost when the queue is full
+    if (!(params.features & IORING_FEAT_NODROP) || !supports_operations(ring_fd)) {
+        close(ring_fd);
+        return NULL;
+    }
+
+    struct IoRing* ring = calloc(1, sizeof(struct IoRing));
+    ring->ring_fd = ring_fd;
+    ring->notify_fd = -1;
+
+    /*
+     * Map the queues shared with the kernel
+     */
+    ring->sq_mapping_len = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ring->cq_mapping_len = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        // both queues are in a single mapping
+        if (ring->cq_mapping_len > ring->sq_mapping_len) {
+            ring->sq_mapping_len = ring->cq_mapping_len;
+        }
+        ring->cq_mapping_len = 0;
+    }
+    ring->sq_mapping = mmap(NULL, ring->sq_mapping_len, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQ_RING);
+    if (ring->sq_mapping == MAP_FAILED) {
+        ring->sq_mapping = NULL;
+        free_io_ring(ring);
+        return NULL;
+    }
+    ring->cq_mapping = ring->sq_mapping;
+    if (ring->cq_mapping_len > 0) {
+        ring->cq_mapping = mmap(NULL, ring->cq_mapping_len, PROT_READ | PROT_WRITE,
+                MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_CQ_RING);
+        if (ring->cq_mapping == MAP_FAILED) {
+            ring->cq_mapping = NULL;
+            free_io_ring(ring);
+            return NULL;
+        }
+    }
+    ring->sqes_len = params.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqes_len, PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED) {
+        ring->sqes = NULL;
+        free_io_ring(ring);
+        return NULL;
+    }
+
+    char* sq = ring->sq_mapping;
+    ring->sq_head = (unsigned*)(sq + params.sq_off.head);
+    ring->sq_tail = (unsigned*)(sq + params.sq_off.tail);
+    ring->sq_ring_mask = (unsigned*)(sq + params.sq_off.ring_mask);
+    ring->sq_array = (unsigned*)(sq + params.sq_off.array);
+    ring->sq_local_tail = *ring->sq_tail;
+    char* cq = ring->cq_mapping;
+    ring->cq_head = (unsigned*)(cq + params.cq_off.head);
+    ring->cq_tail = (unsigned*)(cq + params.cq_off.tail);
+    ring->cq_ring_mask = (unsigned*)(cq + params.cq_off.ring_mask);
+    ring->cqes = (struct io_uring_cqe*)(cq + params.cq_off.cqes);
+
+    /*
+     * Get notified of completions through an eventfd
+     */
+    ring->notify_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (ring->notify_fd < 0
+            || io_uring_register(ring_fd, IORING_REGISTER_EVENTFD, &ring->notify_fd, 1) < 0) {
+        free_io_ring(ring);
+        return NULL;
+    }
+
+    /*
+     * Register the buffers
+     */
+    ring->buffer_len = buffer_len;
+    ring->buffers = mmap(NULL, n_buffers * buffer_len, PROT_READ | PROT_WRITE,
+            MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (ring->buffers == MAP_FAILED) {
+        ring->buffers = NULL;
+        free_io_ring(ring);
+        return NULL;
+    }
+    ring->n_buffers = n_buffers;
+    struct iovec* iovecs = malloc(n_buffers * sizeof(struct iovec));
+    ring->free_buffers = malloc(n_buffers * sizeof(int));
+    int i;
+    for (i = 0; i < n_buffers; i++) {
+        iovecs[i].iov_base = ring->buffers + i * buffer_len;
+        iovecs[i].iov_len = buffer_len;
+        ring->free_buffers[i] = n_buffers - 1 - i;
+    }
+    ring->n_free_buffers = n_buffers;
+    int result = io_uring_register(ring_fd, IORING_REGISTER_BUFFERS, iovecs, n_buffers);
+    free(iovecs);
+    if (result < 0) {
+        free_io_ring(ring);
+        return NULL;
+    }
+    return ring;
+}
+
+
+int acquire_ring_buffer(struct IoRing* ring) {
+    if (ring->n_free_buffers == 0) {
+        return -1;
+    }
+    return ring->free_buffers[--ring->n_free_buffers];
+}
+
+
+char* ring_buffer_address(struct IoRing* ring, int buffer_index) {
+    return ring->buffers + buffer_index * ring->buffer_len;
+}
+
+
+void release_ring_buffer(struct IoRing* ring, int buffer_index) {
+    ring->free_buffers[ring->n_free_buffers++] = buffer_index;
+}
+
+
+bool reserve_ring_entries(struct IoRing* ring, unsigned n_entries) {
+    unsigned n_free = *ring->sq_ring_mask + 1
+            - (ring->sq_local_tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE));
+    if (n_free < n_entries) {
+        submit_io_ring(ring);
+        n_free = *ring->sq_ring_mask + 1
+                - (ring->sq_local_tail - __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE));
+    }
+    return n_free >= n_entries;
+}
+
+
+bool queue_ring_recv(struct IoRing* ring, int socket, int buffer_index, size_t len,
+        bool link, uint64_t user_data) {
+    return queue_operation(ring, IORING_OP_RECV, socket, buffer_index, 0, len, 0,
+            MSG_WAITALL, link, user_data);
+}
+
+
+bool queue_ring_send(struct IoRing* ring, int socket, int buffer_index, size_t len,
+        bool link, uint64_t user_data) {
+    return queue_operation(ring, IORING_OP_SEND, socket, buffer_index, 0, len, 0,
+            MSG_WAITALL | MSG_NOSIGNAL, link, user_data);
+}
+
+
+bool queue_ring_read(struct IoRing* ring, int fd, int buffer_index, size_t buffer_offset,
+        size_t len, off_t offset, bool link, uint64_t user_data) {
+    return queue_operation(ring, IORING_OP_READ_FIXED, fd, buffer_index, buffer_offset, len, offset,
+            0, link, user_data);
+}
+
+
+bool queue_ring_write(struct IoRing* ring, int fd, int buffer_index, size_t len, off_t offset,
+        bool link, uint64_t user_data) {
+    return queue_operation(ring, IORING_OP_WRITE_FIXED, fd, buffer_index, 0, len, offset,
+            0, link, user_data);
+}
+
+
+int submit_io_ring(struct IoRing* ring) {
+    if (ring->n_unsubmitted == 0) {
+        return 0;
+    }
+    // publish the new entries to the kernel
+    __atomic_store_n(ring->sq_tail, ring->sq_local_tail, __ATOMIC_RELEASE);
+    int n_submitted = io_uring_enter(ring->ring_fd, ring->n_unsubmitted, 0, 0);
+    if (n_submitted < 0) {
+        return -1;
+    }
+    ring->n_unsubmitted -= n_submitted;
+    return n_submitted;
+}
+
+
+bool next_ring_completion(struct IoRing* ring, struct IoCompletion* completion) {
+    unsigned head = *ring->cq_head;
+    if (head == __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+        return false;
+    }
+    struct io_uring_cqe* cqe = &ring->cqes[head & *ring->cq_ring_mask];
+    completion->user_data = cqe->user_data;
+    completion->result = cqe->res;
+    __atomic_store_n(ring->cq_head, head + 1, __ATOMIC_RELEASE);
+    return true;
+}
+
+
+void clear_ring_notification(struct IoRing* ring) {
+    uint64_t count;
+    ssize_t n_read = read(ring->notify_fd, &count, sizeof(count));
+    (void)n_read;
+}
+
+
+void free_io_ring(struct IoRing* ring) {
+    // closing the ring also unregisters the buffers and the eventfd
+    close(ring->ring_fd);
+    if (ring->notify_fd >= 0) {
+        close(ring->notify_fd);
+    }
+    if (ring->sqes != NULL) {
+        munmap(ring->sqes, ring->sqes_len);
+    }
+    if (ring->cq_mapping != NULL && ring->cq_mapping != ring->sq_mapping) {
+        munmap(ring->cq_mapping, ring->cq_mapping_len);
+    }
+    if (ring->sq_mapping != NULL) {
+        munmap(ring->sq_mapping, ring->sq_mapping_len);
+    }
+    if (ring->buffers != NULL) {
+        munmap(ring->buffers, ring->n_buffers * ring->buffer_len);
+    }
+    free(ring->free_buffers);
+    free(ring);
+}
@@ -0,0 +1,181 @@
+/**
+ * Contains a minimal io_uring interface, used by the server to move file
+ * content between sockets and files with batched, asynchronous submissions
+ * instead of one system call per read, write, recv and send
+ */
+
+#ifndef IO_RING_H_
+#define IO_RING_H_
+
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+
+/** Max size of a submission queue, above which io_uring_setup() fails */
+#define MAX_RING_ENTRIES 32768
+
+
+/**
+ * A completed operation
+ */
+struct IoCompletion {
+    /** Value given when the operation was submitted */
+    uint64_t user_data;
+    /** Result of the operation, as returned by the equivalent system call (-errno if fail) */
+    int32_t result;
+};
+
+
+/**
+ * Contains the state of an io_uring instance and its registered buffers
+ */
+struct IoRing {
+    int ring_fd;
+
+    /** Submission queue, shared with the kernel */
+    unsigned* sq_head;
+    unsigned* sq_tail;
+    unsigned* sq_ring_mask;
+    unsigned* sq_array;
+    struct io_uring_sqe* sqes;
+    /** Tail including the entries not submitted yet */
+    unsigned sq_local_tail;
+    /** Number of entries not submitted yet */
+    unsigned n_unsubmitted;
+
+    /** Completion queue, shared with the kernel */
+    unsigned* cq_head;
+    unsigned* cq_tail;
+    unsigned* cq_ring_mask;
+    struct io_uring_cqe* cqes;
+
+    /** Mappings of the queues, released when the ring is freed */
+    void* sq_mapping;
+    size_t sq_mapping_len;
+    void* cq_mapping;
+    size_t cq_mapping_len;
+    size_t sqes_len;
+
+    /** Readable when there are completions, so it can be watched by an event loop */
+    int notify_fd;
+
+    /**
+     * Buffers registered with the kernel, so they aren't mapped again
+     * for each operation, and the indices of the ones not in use
+     */
+    char* buffers;
+    size_t buffer_len;
+    int n_buffers;
+    int* free_buffers;
+    int n_free_buffers;
+};
+
+
+/**
+ * Create an io_uring instance with registered buffers.
+ * @param  n_entries  Size of the submission queue (a power of 2, at most
+ *                    MAX_RING_ENTRIES)
+ * @param  n_buffers  Number of registered buffers
+ * @param  buffer_len Size of each registered buffer
+ * @return The ring, or NULL if the kernel doesn't support io_uring or
+ *         the operations used by the server. Must be freed with free_io_ring()
+ */
+struct IoRing* create_io_ring(unsigned n_entries, int n_buffers, size_t buffer_len);
+
+
+/**
+ * Take a registered buffer for exclusive use
+ * @return Index of the buffer, or -1 if all are in use
+ */
+int acquire_ring_buffer(struct IoRing* ring);
+
+
+/**
+ * @return Address of a registered buffer
+ */
+char* ring_buffer_address(struct IoRing* ring, int buffer_index);
+
+
+/**
+ * Give back a registered buffer taken with acquire_ring_buffer()
+ */
+void release_ring_buffer(struct IoRing* ring, int buffer_index);
+
+
+/**
+ * Make sure the given number of operations can be queued, submitting the
+ * queued ones if needed. Operations linked together must be reserved
+ * first, so that the chain isn't cut in half by a full queue.
+ * @return true if there is room, false if the submission queue is full
+ */
+bool reserve_ring_entries(struct IoRing* ring, unsigned n_entries);
+
+
+/**
+ * Queue a recv() from a socket into a registered buffer. The operation
+ * completes only when len bytes are received, or the connection ends.
+ * Like the other queue_ring_*() functions, it fails if the submission
+ * queue is full even after submitting it.
+ * @return true if queued, false if the submission queue is full
+ * @param link Whether the next queued operation only starts after this one
+ *             succeeds in full (else it fails with -ECANCELED)
+ */
+bool queue_ring_recv(struct IoRing* ring, int socket, int buffer_index, size_t len,
+        bool link, uint64_t user_data);
+
+
+/**
+ * Queue a send() of a registered buffer. The operation completes only
+ * when len bytes are sent, or the connection fails.
+ */
+bool queue_ring_send(struct IoRing* ring, int socket, int buffer_index, size_t len,
+        bool link, uint64_t user_data);
+
+
+/**
+ * Queue a pread() of a file into a registered buffer, from buffer_offset
+ * in the buffer (leaving room for a packet header before the file content)
+ */
+bool queue_ring_read(struct IoRing* ring, int fd, int buffer_index, size_t buffer_offset,
+        size_t len, off_t offset, bool link, uint64_t user_data);
+
+
+/**
+ * Queue a pwrite() of a registered buffer into a file
+ */
+bool queue_ring_write(struct IoRing* ring, int fd, int buffer_index, size_t len, off_t offset,
+        bool link, uint64_t user_data);
+
+
+/**
+ * Submit all queued operations to the kernel, with a single system call
+ * @return Number of operations submitted, or -1 if error
+ */
+int submit_io_ring(struct IoRing* ring);
+
+
+/**
+ * Take the next completed operation
+ * @param  completion [out] Address of the struct to store the completion
+ * @return true if an operation was completed, false if none
+ */
+bool next_ring_completion(struct IoRing* ring, struct IoCompletion* completion);
+
+
+/**
+ * Clear the notification on ring->notify_fd. Call before taking the
+ * completions, so that an operation completed afterward notifies again.
+ */
+void clear_ring_notification(struct IoRing* ring);
+
+
+/**
+ * Release all resources used by the ring
+ */
+void free_io_ring(struct IoRing* ring);
+
+
+#endif // IO_RING_H_
@@ -0,0 +1,269 @@
+#include "MerkleTree.h"
+
+#include <arpa/inet.h>  /* htonl */
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+
+/*
+ * Helper functions
+ */
+
+/**
+ * @return Leaf of a file, from the first bits of the hash of its name
+ */
+static uint32_t find_leaf(const char* name) {
+    unsigned char name_hash[SHA256_DIGEST_LEN];
+    sha256(name, strlen(name), name_hash);
+    uint32_t prefix = (uint32_t)name_hash[0] << 8 | name_hash[1];
+    return prefix % MERKLE_N_LEAVES;
+}
+
+
+static bool is_zero_hash(const unsigned char* hash) {
+    int i;
+    for (i = 0; i < MERKLE_HASH_LEN; i++) {
+        if (hash[i] != 0) {
+            return false;
+        }
+    }
+    return true;
+}
+
+
+/**
+ * Hash the files of a leaf, each as its null-terminated name followed by
+ * its 4-byte big-endian checksum
+ */
+static void hash_leaf(const struct MerkleTree* tree, uint32_t leaf, unsigned char* hash) {
+    if (tree->leaf_starts[leaf] == tree->leaf_starts[leaf + 1]) {
+        memset(hash, 0, MERKLE_HASH_LEN);
+        return;
+    }
+    struct Sha256Context context;
+    sha256_init(&context);
+    uint32_t i;
+    for (i = tree->leaf_starts[leaf]; i < tree->leaf_starts[leaf + 1]; i++) {
+        uint32_t file = tree->leaf_files[i];
+        const char* name = catalog_file_name(tree->catalog, file);
+        sha256_update(&context, name, strlen(name) + 1);
+        uint32_t checksum_network_endian = htonl(tree->catalog->checksums[file]);
+        sha256_update(&context, &checksum_network_endian, 4);
+    }
+    sha256_final(&context, hash);
+}
+
+
+/**
+ * Find the leaves whose hashes differ from the other tree's, descending
+ * level by level into the nodes whose hashes differ
+ * @param  leaves [out] Array of MERKLE_N_LEAVES positions, to store the
+ *                leaves in order
+ * @return Number of leaves that differ, or -1 if a fetch failed
+ */
+static ssize_t find_different_leaves(const struct MerkleTree* tree, const struct MerkleFetcher* fetcher,
+        uint32_t* leaves) {
+    uint32_t* nodes = malloc(MERKLE_N_LEAVES * sizeof(uint32_t));
+    size_t n_nodes = 1;
+    nodes[0] = 0;
+    int level;
+    for (level = 0; level < MERKLE_DEPTH; level++) {
+        size_t n_next_nodes = 0;
+        size_t n_done = 0;
+        while (n_done < n_nodes) {
+            // the other side may answer only some of the nodes at once
+            const unsigned char* children;
+            ssize_t n_answered = fetcher->fetch_children(fetcher->context, level,
+                    nodes + n_done, n_nodes - n_done, &children);
+            if (n_answered <= 0 || (size_t)n_answered > n_nodes - n_done) {
+                free(nodes);
+                return -1;
+            }
+            ssize_t i;
+            for (i = 0; i < n_answered; i++) {
+                uint32_t first_child = nodes[n_done + i] * MERKLE_FANOUT;
+                int child;
+                for (child = 0; child < MERKLE_FANOUT; child++) {
+                    if (memcmp(children, merkle_node_hash(tree, level + 1, first_child + child),
+                                MERKLE_HASH_LEN) != 0) {
+                        leaves[n_next_nodes++] = first_child + child;
+                    }
+                    children += MERKLE_HASH_LEN;
+                }
+            }
+            n_done += n_answered;
+        }
+        memcpy(nodes, leaves, n_next_nodes * sizeof(uint32_t));
+        n_nodes = n_next_nodes;
+    }
+    free(nodes);
+    return n_nodes;
+}
+
+
+/**
+ * Join the other tree's files of the leaves that differ, and the tree's
+ * files of the other leaves
+ * @param  leaf_files Catalog of each leaf that differs
+ */
+static struct FileCatalog* join_leaf_files(const struct MerkleTree* tree, const uint32_t* leaves,
+        size_t n_leaves, struct FileCatalog* const* leaf_files) {
+    const struct FileCatalog* catalog = tree->catalog;
+    size_t max_files = catalog->n_files;
+    size_t max_names_len = catalog->names_len;
+    size_t i;
+    for (i = 0; i < n_leaves; i++) {
+        max_files += leaf_files[i]->n_files;
+        max_names_len += leaf_files[i]->names_len;
+    }
+    struct FileCatalog* files = create_file_catalog(max_files, max_names_len);
+    bool* is_leaf_different = calloc(MERKLE_N_LEAVES, sizeof(bool));
+    for (i = 0; i < n_leaves; i++) {
+        is_leaf_different[leaves[i]] = true;
+        size_t j;
+        for (j = 0; j < leaf_files[i]->n_files; j++) {
+            add_catalog_file(files, catalog_file_name(leaf_files[i], j), leaf_files[i]->checksums[j]);
+        }
+    }
+    uint32_t leaf;
+    for (leaf = 0; leaf < MERKLE_N_LEAVES; leaf++) {
+        if (is_leaf_different[leaf]) {
+            continue;
+        }
+        uint32_t j;
+        for (j = tree->leaf_starts[leaf]; j < tree->leaf_starts[leaf + 1]; j++) {
+            uint32_t file = tree->leaf_files[j];
+            add_catalog_file(files, catalog_file_name(catalog, file), catalog->checksums[file]);
+        }
+    }
+    free(is_leaf_different);
+    return files;
+}
+
+
+/*
+ * Public functions
+ */
+
+
+struct MerkleTree* build_merkle_tree(struct FileCatalog* catalog) {
+    struct MerkleTree* tree = malloc(sizeof(struct MerkleTree));
+    tree->catalog = catalog;
+
+    // the hashes of all levels share a single allocation
+    size_t n_nodes = 0;
+    int level;
+    for (level = 0; level <= MERKLE_DEPTH; level++) {
+        n_nodes += merkle_level_len(level);
+    }
+    unsigned char* hashes = malloc(n_nodes * MERKLE_HASH_LEN);
+    for (level = 0; level <= MERKLE_DEPTH; level++) {
+        tree->levels[level] = hashes;
+        hashes += merkle_level_len(level) * MERKLE_HASH_LEN;
+    }
+
+    // group the files by leaf. Files are taken in catalog order,
+    // so they stay sorted by name within each leaf.
+    uint32_t* file_leaves = malloc(catalog->n_files * sizeof(uint32_t));
+    memset(tree->leaf_starts, 0, sizeof(tree->leaf_starts));
+    size_t i;
+    for (i = 0; i < catalog->n_files; i++) {
+        file_leaves[i] = find_leaf(catalog_file_name(catalog, i));
+        tree->leaf_starts[file_leaves[i] + 1]++;
+    }
+    for (i = 0; i < MERKLE_N_LEAVES; i++) {
+        tree->leaf_starts[i + 1] += tree->leaf_starts[i];
+    }
+    tree->leaf_files = malloc(catalog->n_files * sizeof(uint32_t));
+    uint32_t next_positions[MERKLE_N_LEAVES];
+    memcpy(next_positions, tree->leaf_starts, sizeof(next_positions));
+    for (i = 0; i < catalog->n_files; i++) {
+        tree->leaf_files[next_positions[file_leaves[i]]++] = i;
+    }
+    free(file_leaves);
+
+    // hash the leaves, then each level from its children, up to the root
+    for (i = 0; i < MERKLE_N_LEAVES; i++) {
+        hash_leaf(tree, i, tree->levels[MERKLE_DEPTH] + i * MERKLE_HASH_LEN);
+    }
+    for (level = MERKLE_DEPTH - 1; level >= 0; level--) {
+        const unsigned char* children = tree->levels[level + 1];
+        uint32_t node;
+        for (node = 0; node < merkle_level_len(level); node++) {
+            unsigned char* hash = tree->levels[level] + node * MERKLE_HASH_LEN;
+            const unsigned char* node_children = children + node * MERKLE_FANOUT * MERKLE_HASH_LEN;
+            bool is_empty = true;
+            int child;
+            for (child = 0; child < MERKLE_FANOUT && is_empty; child++) {
+                is_empty = is_zero_hash(node_children + child * MERKLE_HASH_LEN);
+            }
+            if (is_empty) {
+                memset(hash, 0, MERKLE_HASH_LEN);
+            } else {
+                sha256(node_children, MERKLE_FANOUT * MERKLE_HASH_LEN, hash);
+            }
+        }
+    }
+    return tree;
+}
+
+
+uint32_t merkle_level_len(int level) {
+    uint32_t len = 1;
+    while (level-- > 0) {
+        len *= MERKLE_FANOUT;
+    }
+    return len;
+}
+
+
+const unsigned char* merkle_node_hash(const struct MerkleTree* tree, int level, uint32_t node) {
+    return tree->levels[level] + node * MERKLE_HASH_LEN;
+}
+
+
+struct FileCatalog* fetch_merkle_files(const struct MerkleTree* tree, const unsigned char* other_root_hash,
+        const struct MerkleFetcher* fetcher) {
+    if (memcmp(other_root_hash, merkle_node_hash(tree, 0, 0), MERKLE_HASH_LEN) == 0) {
+        // nothing differs
+        return join_file_catalogs(&tree->catalog, 1);
+    }
+    uint32_t* leaves = malloc(MERKLE_N_LEAVES * sizeof(uint32_t));
+    ssize_t n_leaves = find_different_leaves(tree, fetcher, leaves);
+    if (n_leaves < 0) {
+        free(leaves);
+        return NULL;
+    }
+
+    // fetch the other tree's files of the leaves that differ
+    struct FileCatalog** leaf_files = malloc(n_leaves * sizeof(struct FileCatalog*));
+    ssize_t n_done = 0;
+    while (n_done < n_leaves) {
+        ssize_t n_answered = fetcher->fetch_leaves(fetcher->context, leaves + n_done,
+                n_leaves - n_done, leaf_files + n_done);
+        if (n_answered <= 0 || n_answered > n_leaves - n_done) {
+            break;
+        }
+        n_done += n_answered;
+    }
+    struct FileCatalog* files = NULL;
+    if (n_done == n_leaves) {
+        files = join_leaf_files(tree, leaves, n_leaves, leaf_files);
+    }
+    ssize_t i;
+    for (i = 0; i < n_done; i++) {
+        free_file_catalog(leaf_files[i]);
+    }
+    free(leaf_files);
+    free(leaves);
+    return files;
+}
+
+
+void free_merkle_tree(struct MerkleTree* tree) {
+    free_file_catalog(tree->catalog);
+    free(tree->levels[0]);
+    free(tree->leaf_files);
+    free(tree);
+}
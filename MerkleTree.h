@@ -0,0 +1,117 @@
+/**
+ * Contains a hash tree summarizing a catalog of files, so that two catalogs
+ * are compared by their root hash, and their differences found by
+ * descending only into the subtrees whose hashes differ.
+ *
+ * Each file goes in one of the leaves, chosen by the hash of its name, so
+ * that adding or removing a file only changes the hashes on a single path.
+ * Each node has MERKLE_FANOUT children, and the leaves are MERKLE_DEPTH
+ * levels below the root.
+ */
+
+#ifndef MERKLE_TREE_H_
+#define MERKLE_TREE_H_
+
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+#include "FileCatalog.h"
+#include "Sha256.h"
+
+
+#define MERKLE_FANOUT 16
+#define MERKLE_DEPTH 3
+#define MERKLE_N_LEAVES (MERKLE_FANOUT * MERKLE_FANOUT * MERKLE_FANOUT)
+#define MERKLE_HASH_LEN SHA256_DIGEST_LEN
+
+
+/**
+ * A hash tree over the files of a catalog
+ */
+struct MerkleTree {
+    struct FileCatalog* catalog;
+    /**
+     * Hashes of the nodes of each level, from the root (level 0) to the
+     * leaves (level MERKLE_DEPTH). The hash of a subtree without files
+     * is all zeros.
+     */
+    unsigned char* levels[MERKLE_DEPTH + 1];
+    /**
+     * Positions of the files of each leaf in the catalog, sorted by name.
+     * The files of leaf i are from leaf_starts[i] to leaf_starts[i+1].
+     */
+    uint32_t* leaf_files;
+    uint32_t leaf_starts[MERKLE_N_LEAVES + 1];
+};
+
+
+/**
+ * Asks the other side of a comparison for parts of its tree
+ */
+struct MerkleFetcher {
+    /** Passed to the functions below */
+    void* context;
+    /**
+     * Fetch the hashes of the children of nodes of the other tree
+     * @param  level    Level of the nodes
+     * @param  children [out] Address of the variable to store the address of
+     *                  the MERKLE_FANOUT child hashes of each node answered,
+     *                  one node after the other, valid until the next fetch
+     * @return Number of nodes answered, from the first one, or -1 if error
+     */
+    ssize_t (*fetch_children)(void* context, int level, const uint32_t* nodes, size_t n_nodes,
+            const unsigned char** children);
+    /**
+     * Fetch the files of leaves of the other tree
+     * @param  leaf_files [out] Array to store the catalog of each leaf
+     *                    answered, freed by the caller
+     * @return Number of leaves answered, from the first one, 0 if the files
+     *         of the first leaf can't be fetched at once, or -1 if error
+     */
+    ssize_t (*fetch_leaves)(void* context, const uint32_t* leaves, size_t n_leaves,
+            struct FileCatalog** leaf_files);
+};
+
+
+/**
+ * Build the tree of a catalog
+ * @param  catalog Catalog sorted by name, which the tree takes ownership of
+ * @return The tree. Must be freed with free_merkle_tree()
+ */
+struct MerkleTree* build_merkle_tree(struct FileCatalog* catalog);
+
+
+/**
+ * @return Number of nodes at the given level of a tree
+ */
+uint32_t merkle_level_len(int level);
+
+
+/**
+ * @return Hash of the node at the given level and position in the level.
+ *         The children of node i are nodes i * MERKLE_FANOUT to
+ *         (i + 1) * MERKLE_FANOUT - 1 of the next level.
+ */
+const unsigned char* merkle_node_hash(const struct MerkleTree* tree, int level, uint32_t node);
+
+
+/**
+ * Find the files of another tree from its root hash, descending only into
+ * the subtrees whose hashes differ from the tree's. The other leaves hold
+ * the same files in both trees, and their files are taken from the tree.
+ * @return Catalog of the files of the other tree, in no particular order,
+ *         or NULL if a fetch failed. Must be freed with free_file_catalog()
+ */
+struct FileCatalog* fetch_merkle_files(const struct MerkleTree* tree, const unsigned char* other_root_hash,
+        const struct MerkleFetcher* fetcher);
+
+
+/**
+ * Release the tree and its catalog
+ */
+void free_merkle_tree(struct MerkleTree* tree);
+
+
+#endif // MERKLE_TREE_H_
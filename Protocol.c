@@ -1,23 +1,28 @@
 #include "Protocol.h"
 
 #include <arpa/inet.h>  /* htons, ntohs */
+#include <endian.h>     /* htobe64, be64toh */
 #include <stdio.h>      /* file IO */
 #include <string.h>     /* memcpy */
 
 
 /**
- * Read from TCP connection until the number of bytes read is at least the target specified
+ * Read from TCP connection until the number of bytes read is the target specified.
+ * No byte past the target is read, so that the next packet stays in the socket.
  * @param  socket      TCP Socket to read from
  * @param  buffer      Buffer to read into
  * @param  buff_len    Maximum length of the buffer
  * @param  n_received  Number of bytes already received before this call
- * @param  target_len  The least number of bytes to be received in total
+ * @param  target_len  The number of bytes to be received in total
  * @return Number of bytes read in total, or -1 if error
  */
 ssize_t receive_packet_until(int socket, char* buffer, size_t buff_len, int n_received, int target_len) {
+    if (target_len > buff_len) {
+        return -1;
+    }
     while(n_received < target_len) {
         int n_new_bytes = recv(socket, buffer + n_received, 
-                               buff_len - n_received, 0);
+                               target_len - n_received, 0);
         if (n_new_bytes <= 0) {
             // fail to recv
             return -1;
@@ -44,9 +49,10 @@ ssize_t receive_packet(int socket ,char* buffer, size_t buff_len) {
     struct PacketHeader* header = (struct PacketHeader*)buffer;
     int packet_len = ntohs(header->packet_len);
     
-    // don't receive entire packet if it's too large
-    if (packet_len > buff_len) {
-        packet_len = buff_len;
+    // a packet that doesn't fit can't be received without losing
+    // track of where the next one starts
+    if (packet_len < HEADER_LEN || packet_len > buff_len) {
+        return -1;
     }
 
     // receive the rest of the packet
@@ -59,6 +65,105 @@ ssize_t receive_packet(int socket ,char* buffer, size_t buff_len) {
 }
 
 
+void init_packet_reader(struct PacketReader* reader, size_t capacity) {
+    reader->buffer = malloc(capacity);
+    reader->capacity = capacity;
+    reader->start = 0;
+    reader->end = 0;
+}
+
+
+void free_packet_reader(struct PacketReader* reader) {
+    free(reader->buffer);
+    reader->buffer = NULL;
+}
+
+
+size_t buffered_len(const struct PacketReader* reader) {
+    return reader->end - reader->start;
+}
+
+
+ssize_t fill_packet_reader(struct PacketReader* reader, int socket) {
+    // make room after the bytes not taken yet. Those are at most a partial
+    // packet, so moving them is cheap, and whole packets stay contiguous.
+    if (reader->start == reader->end) {
+        reader->start = 0;
+        reader->end = 0;
+    } else if (reader->start > 0 && reader->end > reader->capacity / 2) {
+        memmove(reader->buffer, reader->buffer + reader->start, reader->end - reader->start);
+        reader->end -= reader->start;
+        reader->start = 0;
+    }
+    if (reader->end == reader->capacity) {
+        // the buffer is full of bytes not taken
+        return -1;
+    }
+
+    ssize_t n_new_bytes = recv(socket, reader->buffer + reader->end,
+            reader->capacity - reader->end, 0);
+    if (n_new_bytes > 0) {
+        reader->end += n_new_bytes;
+    }
+    return n_new_bytes;
+}
+
+
+const struct PacketHeader* peek_packet_header(const struct PacketReader* reader) {
+    if (buffered_len(reader) < HEADER_LEN) {
+        return NULL;
+    }
+    return (const struct PacketHeader*)(reader->buffer + reader->start);
+}
+
+
+char* take_bytes(struct PacketReader* reader, size_t len) {
+    if (buffered_len(reader) < len) {
+        return NULL;
+    }
+    char* bytes = reader->buffer + reader->start;
+    reader->start += len;
+    return bytes;
+}
+
+
+size_t copy_bytes(struct PacketReader* reader, char* buffer, size_t max_len) {
+    size_t len = buffered_len(reader);
+    if (len > max_len) {
+        len = max_len;
+    }
+    memcpy(buffer, reader->buffer + reader->start, len);
+    reader->start += len;
+    return len;
+}
+
+
+ssize_t next_packet(struct PacketReader* reader, char** packet) {
+    const struct PacketHeader* header = peek_packet_header(reader);
+    if (header == NULL) {
+        return 0;
+    }
+    size_t packet_len = ntohs(header->packet_len);
+    if (packet_len < HEADER_LEN || packet_len > reader->capacity) {
+        return -1;
+    }
+    *packet = take_bytes(reader, packet_len);
+    return *packet == NULL ? 0 : packet_len;
+}
+
+
+ssize_t read_packet(struct PacketReader* reader, int socket, char** packet) {
+    ssize_t packet_len;
+    while ((packet_len = next_packet(reader, packet)) == 0) {
+        if (fill_packet_reader(reader, socket) <= 0) {
+            // fail to recv
+            return -1;
+        }
+    }
+    return packet_len;
+}
+
+
 /**
  * Helper function to write packet header 
  */
@@ -125,40 +230,624 @@ ssize_t make_leave_request(char* buffer, size_t buff_len, uint32_t token) {
 }
 
 
-ssize_t make_list_request(char* buffer, size_t buff_len, uint32_t token) {
-    return make_header_only_packet(buffer, buff_len, TYPE_LIST_REQUEST, token);
+ssize_t make_list_request(char* buffer, size_t buff_len, uint32_t token, const char* cursor) {
+    if (cursor == NULL) {
+        return make_header_only_packet(buffer, buff_len, TYPE_LIST_REQUEST, token);
+    }
+    size_t cursor_len = strnlen(cursor, MAX_FILE_NAME_LEN - 1) + 1;  // include null terminator
+    size_t packet_len = HEADER_LEN + cursor_len;
+    if (buff_len < packet_len) {
+        return -1;
+    }
+    make_header(buffer, TYPE_LIST_REQUEST, packet_len, token);
+    memcpy(buffer + HEADER_LEN, cursor, cursor_len - 1);
+    buffer[packet_len - 1] = 0;
+    return packet_len;
 }
 
 
-ssize_t make_list_response(char* buffer, size_t buff_len, uint32_t token, 
-        struct FileInfo* file_info, int n_files) {
-    // make sure buffer is big enough for packet
-    size_t packet_len = HEADER_LEN + (MAX_FILE_NAME_LEN + 4) * n_files;
-    if (buff_len < packet_len) {
-        return -1;
+/**
+ * @return Number of bytes of a varint: 7 bits of the value per byte, from
+ *         the lowest ones, with the high bit set on all bytes but the last
+ */
+static size_t varint_len(uint32_t value) {
+    size_t len = 1;
+    while (value >= 0x80) {
+        value >>= 7;
+        len++;
     }
+    return len;
+}
 
-    // write header
-    make_header(buffer, TYPE_LIST_RESPONSE, packet_len, token);
-    buffer += HEADER_LEN;
 
-    // write data
-    int i;
-    for (i = 0; i < n_files; i++) {
-        // file name
-        memcpy(buffer, file_info->name, MAX_FILE_NAME_LEN);
+/**
+ * @return End of the varint written
+ */
+static char* write_varint(char* buffer, uint32_t value) {
+    while (value >= 0x80) {
+        *buffer++ = (char)(value | 0x80);
+        value >>= 7;
+    }
+    *buffer++ = (char)value;
+    return buffer;
+}
+
+
+/**
+ * Read a varint, of at most 5 bytes
+ * @param  data [in,out] Address of the pointer to the varint, moved past it
+ * @return false if the varint is malformed or doesn't end before data_end
+ */
+static bool read_varint(const char** data, const char* data_end, uint32_t* value) {
+    *value = 0;
+    int shift;
+    for (shift = 0; shift < 35 && *data < data_end; shift += 7) {
+        unsigned char byte = *(*data)++;
+        *value |= (uint32_t)(byte & 0x7f) << shift;
+        if ((byte & 0x80) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+
+/**
+ * @return Number of leading bytes the 2 names have in common
+ */
+static size_t shared_prefix_len(const char* name1, const char* name2) {
+    size_t len = 0;
+    while (name1[len] != 0 && name1[len] == name2[len]) {
+        len++;
+    }
+    return len;
+}
+
+
+/**
+ * Write the files of a LIST page, each as a 64-byte name padded with
+ * zeros followed by its 4-byte checksum, as many as fit before buffer_end
+ * @param  next_file [in,out] Position of the first file to write,
+ *                   moved past the files written
+ * @return End of the files written
+ */
+static char* write_list_files(char* buffer, const char* buffer_end,
+        const struct FileCatalog* catalog, size_t* next_file) {
+    size_t i;
+    for (i = *next_file; i < catalog->n_files && buffer_end - buffer >= MAX_FILE_NAME_LEN + 4; i++) {
+        // file name, padded with zeros
+        const char* name = catalog_file_name(catalog, i);
+        size_t name_len = strlen(name);
+        memcpy(buffer, name, name_len);
+        memset(buffer + name_len, 0, MAX_FILE_NAME_LEN - name_len);
         buffer += MAX_FILE_NAME_LEN;
         // 4-byte checksum
-        uint32_t checksum_network_endian = htonl(file_info->checksum);
+        uint32_t checksum_network_endian = htonl(catalog->checksums[i]);
+        memcpy(buffer, &checksum_network_endian, 4);
+        buffer += 4;
+    }
+    *next_file = i;
+    return buffer;
+}
+
+
+/**
+ * Write the files of a LIST page in the compact encoding, as many as fit
+ * before buffer_end. The first name of the page shares no prefix, so that
+ * each page is parsed on its own.
+ * @param  next_file [in,out] Position of the first file to write,
+ *                   moved past the files written
+ * @return End of the files written
+ */
+static char* write_compact_list_files(char* buffer, const char* buffer_end,
+        const struct FileCatalog* catalog, size_t* next_file) {
+    // count the files that fit, leaving room for the longest count
+    // a packet can hold
+    size_t page_len = varint_len(UINT16_MAX);
+    const char* previous_name = "";
+    size_t end_file;
+    for (end_file = *next_file; end_file < catalog->n_files; end_file++) {
+        const char* name = catalog_file_name(catalog, end_file);
+        size_t shared_len = shared_prefix_len(previous_name, name);
+        size_t suffix_len = strlen(name + shared_len);
+        size_t file_len = 4 + varint_len(shared_len) + varint_len(suffix_len) + suffix_len;
+        if (page_len + file_len > (size_t)(buffer_end - buffer)) {
+            break;
+        }
+        page_len += file_len;
+        previous_name = name;
+    }
+
+    // number of files, then their checksums, then their names
+    buffer = write_varint(buffer, end_file - *next_file);
+    size_t i;
+    for (i = *next_file; i < end_file; i++) {
+        uint32_t checksum_network_endian = htonl(catalog->checksums[i]);
         memcpy(buffer, &checksum_network_endian, 4);
         buffer += 4;
-        file_info = file_info->next;
     }
+    previous_name = "";
+    for (i = *next_file; i < end_file; i++) {
+        const char* name = catalog_file_name(catalog, i);
+        size_t shared_len = shared_prefix_len(previous_name, name);
+        size_t suffix_len = strlen(name + shared_len);
+        buffer = write_varint(buffer, shared_len);
+        buffer = write_varint(buffer, suffix_len);
+        memcpy(buffer, name + shared_len, suffix_len);
+        buffer += suffix_len;
+        previous_name = name;
+    }
+    *next_file = end_file;
+    return buffer;
+}
+
+
+ssize_t make_list_response(char* buffer, size_t buff_len, uint32_t token, 
+        const struct FileCatalog* catalog, uint8_t version, size_t* next_file) {
+    // the page takes as many files as fit in the packet
+    if (buff_len > UINT16_MAX) {
+        buff_len = UINT16_MAX;
+    }
+    if (buff_len < HEADER_LEN + MAX_FILE_NAME_LEN + 4) {
+        return -1;
+    }
+    char* end;
+    if (has_compact_lists(version)) {
+        end = write_compact_list_files(buffer + HEADER_LEN, buffer + buff_len, catalog, next_file);
+    } else {
+        end = write_list_files(buffer + HEADER_LEN, buffer + buff_len, catalog, next_file);
+    }
+    enum PacketType type = *next_file < catalog->n_files ? TYPE_LIST_PAGE : TYPE_LIST_RESPONSE;
+    make_header(buffer, type, end - buffer, token);
+    ((struct PacketHeader*)buffer)->version = version;
+    return end - buffer;
+}
+
+
+struct FileCatalog* parse_list_files(const char* packet, size_t packet_len) {
+    const struct PacketHeader* header = (const struct PacketHeader*) packet;
+    const char* data = packet + HEADER_LEN;
+    const char* data_end = packet + packet_len;
+    if (!has_compact_lists(header->version)) {
+        size_t n_files = (packet_len - HEADER_LEN) / (MAX_FILE_NAME_LEN + 4);
+        struct FileCatalog* catalog = create_file_catalog(n_files, n_files * MAX_FILE_NAME_LEN);
+        size_t i;
+        for (i = 0; i < n_files; i++) {
+            add_catalog_file(catalog, data, parse_file_checksum(data + MAX_FILE_NAME_LEN));
+            data += MAX_FILE_NAME_LEN + 4;
+        }
+        return catalog;
+    }
+
+    // each file takes at least its checksum and 2 varints
+    uint32_t n_files;
+    if (!read_varint(&data, data_end, &n_files) || n_files > (size_t)(data_end - data) / 6) {
+        return NULL;
+    }
+    const char* checksums = data;
+    data += 4 * (size_t)n_files;
+    struct FileCatalog* catalog = create_file_catalog(n_files, (size_t)n_files * MAX_FILE_NAME_LEN);
+    char name[MAX_FILE_NAME_LEN];
+    size_t name_len = 0;
+    uint32_t i;
+    for (i = 0; i < n_files; i++) {
+        // the name keeps a prefix of the previous name, and ends with the new bytes
+        uint32_t shared_len;
+        uint32_t suffix_len;
+        if (!read_varint(&data, data_end, &shared_len) || !read_varint(&data, data_end, &suffix_len)
+                || shared_len > name_len || suffix_len > (size_t)(data_end - data)
+                || shared_len + suffix_len >= MAX_FILE_NAME_LEN) {
+            free_file_catalog(catalog);
+            return NULL;
+        }
+        memcpy(name + shared_len, data, suffix_len);
+        data += suffix_len;
+        name_len = shared_len + suffix_len;
+        name[name_len] = 0;
+        add_catalog_file(catalog, name, parse_file_checksum(checksums + 4 * i));
+    }
+    return catalog;
+}
+
+
+/**
+ * Write a file of a catalog in the format of DIFF packets
+ * @return End of the file written, or NULL if it doesn't fit before buffer_end
+ */
+static char* write_diff_file(char* buffer, const char* buffer_end, const struct FileCatalog* catalog, size_t i) {
+    // file name with null terminator, then 4-byte checksum
+    const char* name = catalog_file_name(catalog, i);
+    size_t name_len = strlen(name) + 1;
+    if (buffer_end - buffer < (ssize_t)(name_len + 4)) {
+        return NULL;
+    }
+    memcpy(buffer, name, name_len);
+    buffer += name_len;
+    uint32_t checksum_network_endian = htonl(catalog->checksums[i]);
+    memcpy(buffer, &checksum_network_endian, 4);
+    return buffer + 4;
+}
+
+
+/**
+ * Write the files of a catalog in the format of DIFF packets
+ * @return End of the files written, or NULL if they don't fit before buffer_end
+ */
+static char* write_diff_files(char* buffer, const char* buffer_end, const struct FileCatalog* catalog) {
+    size_t i;
+    for (i = 0; i < catalog->n_files && buffer != NULL; i++) {
+        buffer = write_diff_file(buffer, buffer_end, catalog, i);
+    }
+    return buffer;
+}
+
+
+/**
+ * Write 2-byte node positions
+ * @return End of the positions written, or NULL if they don't fit before buffer_end
+ */
+static char* write_tree_nodes(char* buffer, const char* buffer_end, const uint32_t* nodes, size_t n_nodes) {
+    if ((size_t)(buffer_end - buffer) < 2 * n_nodes) {
+        return NULL;
+    }
+    size_t i;
+    for (i = 0; i < n_nodes; i++) {
+        uint16_t node_network_endian = htons(nodes[i]);
+        memcpy(buffer, &node_network_endian, 2);
+        buffer += 2;
+    }
+    return buffer;
+}
+
+
+ssize_t make_diff_request(char* buffer, size_t buff_len, uint32_t token,
+        const struct FileCatalog* client_files) {
+    // the packet length must fit in the header
+    if (buff_len > UINT16_MAX) {
+        buff_len = UINT16_MAX;
+    }
+    if (buff_len < HEADER_LEN) {
+        return -1;
+    }
+    char* end = write_diff_files(buffer + HEADER_LEN, buffer + buff_len, client_files);
+    if (end == NULL) {
+        return -1;
+    }
+    size_t packet_len = end - buffer;
+    make_header(buffer, TYPE_DIFF_REQUEST, packet_len, token);
+    return packet_len;
+}
+
+
+ssize_t make_diff_response(char* buffer, size_t buff_len, uint32_t token,
+        const struct FileCatalog* server_only, const struct FileCatalog* client_only) {
+    if (buff_len > UINT16_MAX) {
+        buff_len = UINT16_MAX;
+    }
+    if (buff_len < HEADER_LEN + 4) {
+        return -1;
+    }
+    uint32_t n_server_only = htonl(server_only->n_files);
+    memcpy(buffer + HEADER_LEN, &n_server_only, 4);
+    char* end = write_diff_files(buffer + HEADER_LEN + 4, buffer + buff_len, server_only);
+    if (end != NULL) {
+        end = write_diff_files(end, buffer + buff_len, client_only);
+    }
+    if (end == NULL) {
+        return -1;
+    }
+    size_t packet_len = end - buffer;
+    make_header(buffer, TYPE_DIFF_RESPONSE, packet_len, token);
+    return packet_len;
+}
+
+
+struct FileCatalog* parse_diff_files(const char** data, const char* data_end, size_t max_files) {
+    // each file takes at least a null terminator and a checksum
+    size_t data_len = data_end - *data;
+    size_t n_files = data_len / 5;
+    if (n_files > max_files) {
+        n_files = max_files;
+    }
+    struct FileCatalog* catalog = create_file_catalog(n_files, data_len);
+    const char* cur_file = *data;
+    while (catalog->n_files < max_files && cur_file < data_end) {
+        // the name must end within the packet, and be followed by the checksum
+        const char* name_end = memchr(cur_file, 0, data_end - cur_file);
+        if (name_end == NULL || data_end - (name_end + 1) < 4
+                || name_end - cur_file >= MAX_FILE_NAME_LEN) {
+            free_file_catalog(catalog);
+            return NULL;
+        }
+        add_catalog_file(catalog, cur_file, parse_file_checksum(name_end + 1));
+        cur_file = name_end + 1 + 4;
+    }
+    if (max_files != SIZE_MAX && catalog->n_files < max_files) {
+        free_file_catalog(catalog);
+        return NULL;
+    }
+    *data = cur_file;
+    return catalog;
+}
+
+
+ssize_t make_tree_request(char* buffer, size_t buff_len, uint32_t token,
+        uint8_t level, const uint32_t* nodes, size_t n_nodes) {
+    if (buff_len > UINT16_MAX) {
+        buff_len = UINT16_MAX;
+    }
+    if (buff_len < HEADER_LEN + 1) {
+        return -1;
+    }
+    char* end = buffer + HEADER_LEN;
+    if (n_nodes > 0) {
+        *end++ = level;
+        end = write_tree_nodes(end, buffer + buff_len, nodes, n_nodes);
+        if (end == NULL) {
+            return -1;
+        }
+    }
+    size_t packet_len = end - buffer;
+    make_header(buffer, TYPE_TREE_REQUEST, packet_len, token);
+    return packet_len;
+}
+
+
+ssize_t make_tree_response(char* buffer, size_t buff_len, uint32_t token,
+        const struct MerkleTree* tree, uint8_t level, const uint32_t* nodes, size_t n_nodes) {
+    if (buff_len > UINT16_MAX) {
+        buff_len = UINT16_MAX;
+    }
+    if (buff_len < HEADER_LEN + MERKLE_HASH_LEN) {
+        return -1;
+    }
+    char* end = buffer + HEADER_LEN;
+    if (n_nodes == 0) {
+        memcpy(end, merkle_node_hash(tree, 0, 0), MERKLE_HASH_LEN);
+        end += MERKLE_HASH_LEN;
+    } else {
+        // the hashes of the children of a node are next to each other
+        size_t children_len = MERKLE_FANOUT * MERKLE_HASH_LEN;
+        size_t n_answered = (buff_len - HEADER_LEN - 2) / children_len;
+        if (n_answered > n_nodes) {
+            n_answered = n_nodes;
+        }
+        uint16_t n_answered_network_endian = htons(n_answered);
+        memcpy(end, &n_answered_network_endian, 2);
+        end += 2;
+        size_t i;
+        for (i = 0; i < n_answered; i++) {
+            memcpy(end, merkle_node_hash(tree, level + 1, nodes[i] * MERKLE_FANOUT), children_len);
+            end += children_len;
+        }
+    }
+    size_t packet_len = end - buffer;
+    make_header(buffer, TYPE_TREE_RESPONSE, packet_len, token);
+    return packet_len;
+}
+
+
+ssize_t make_leaf_request(char* buffer, size_t buff_len, uint32_t token,
+        const uint32_t* leaves, size_t n_leaves) {
+    if (buff_len > UINT16_MAX) {
+        buff_len = UINT16_MAX;
+    }
+    if (buff_len < HEADER_LEN) {
+        return -1;
+    }
+    char* end = write_tree_nodes(buffer + HEADER_LEN, buffer + buff_len, leaves, n_leaves);
+    if (end == NULL) {
+        return -1;
+    }
+    size_t packet_len = end - buffer;
+    make_header(buffer, TYPE_LEAF_REQUEST, packet_len, token);
+    return packet_len;
+}
 
+
+ssize_t make_leaf_response(char* buffer, size_t buff_len, uint32_t token,
+        const struct MerkleTree* tree, const uint32_t* leaves, size_t n_leaves) {
+    if (buff_len > UINT16_MAX) {
+        buff_len = UINT16_MAX;
+    }
+    if (buff_len < HEADER_LEN + 2) {
+        return -1;
+    }
+    const char* buffer_end = buffer + buff_len;
+    char* end = buffer + HEADER_LEN + 2;
+    size_t n_answered;
+    for (n_answered = 0; n_answered < n_leaves; n_answered++) {
+        // a leaf is only answered if all its files fit
+        uint32_t first_file = tree->leaf_starts[leaves[n_answered]];
+        uint32_t n_files = tree->leaf_starts[leaves[n_answered] + 1] - first_file;
+        char* leaf_end = buffer_end - end >= 2 ? end + 2 : NULL;
+        uint32_t i;
+        for (i = 0; i < n_files && leaf_end != NULL; i++) {
+            leaf_end = write_diff_file(leaf_end, buffer_end, tree->catalog, tree->leaf_files[first_file + i]);
+        }
+        if (leaf_end == NULL) {
+            break;
+        }
+        uint16_t n_files_network_endian = htons(n_files);
+        memcpy(end, &n_files_network_endian, 2);
+        end = leaf_end;
+    }
+    uint16_t n_answered_network_endian = htons(n_answered);
+    memcpy(buffer + HEADER_LEN, &n_answered_network_endian, 2);
+    size_t packet_len = end - buffer;
+    make_header(buffer, TYPE_LEAF_RESPONSE, packet_len, token);
     return packet_len;
 }
 
 
+ssize_t parse_tree_response(const char* packet, size_t packet_len, size_t n_nodes,
+        const unsigned char** children) {
+    const struct PacketHeader* header = (const struct PacketHeader*) packet;
+    if (packet_len < HEADER_LEN + 2 || header->type != TYPE_TREE_RESPONSE) {
+        return -1;
+    }
+    uint16_t n_answered;
+    memcpy(&n_answered, packet + HEADER_LEN, 2);
+    n_answered = ntohs(n_answered);
+    size_t children_len = MERKLE_FANOUT * MERKLE_HASH_LEN;
+    if (n_answered == 0 || n_answered > n_nodes
+            || packet_len != HEADER_LEN + 2 + n_answered * children_len) {
+        return -1;
+    }
+    *children = (const unsigned char*)packet + HEADER_LEN + 2;
+    return n_answered;
+}
+
+
+ssize_t parse_leaf_response(const char* packet, size_t packet_len, size_t n_leaves,
+        struct FileCatalog** leaf_files) {
+    const struct PacketHeader* header = (const struct PacketHeader*) packet;
+    if (packet_len < HEADER_LEN + 2 || header->type != TYPE_LEAF_RESPONSE) {
+        return -1;
+    }
+    uint16_t n_answered;
+    memcpy(&n_answered, packet + HEADER_LEN, 2);
+    n_answered = ntohs(n_answered);
+    if (n_answered > n_leaves) {
+        return -1;
+    }
+    // each leaf is its 2-byte number of files, then the files
+    const char* data = packet + HEADER_LEN + 2;
+    const char* data_end = packet + packet_len;
+    uint16_t i;
+    for (i = 0; i < n_answered; i++) {
+        uint16_t n_files;
+        leaf_files[i] = NULL;
+        if (data_end - data >= 2) {
+            memcpy(&n_files, data, 2);
+            data += 2;
+            leaf_files[i] = parse_diff_files(&data, data_end, ntohs(n_files));
+        }
+        if (leaf_files[i] == NULL) {
+            while (i-- > 0) {
+                free_file_catalog(leaf_files[i]);
+            }
+            return -1;
+        }
+    }
+    return n_answered;
+}
+
+
+ssize_t parse_tree_nodes(const char* data, const char* data_end, uint32_t* nodes, size_t max_nodes) {
+    size_t data_len = data_end - data;
+    if (data_len % 2 != 0 || data_len / 2 > max_nodes) {
+        return -1;
+    }
+    size_t i;
+    for (i = 0; i < data_len / 2; i++) {
+        uint16_t node_network_endian;
+        memcpy(&node_network_endian, data + 2 * i, 2);
+        nodes[i] = ntohs(node_network_endian);
+    }
+    return data_len / 2;
+}
+
+
+ssize_t make_changes_request(char* buffer, size_t buff_len, uint32_t token,
+        uint32_t log_id, uint64_t since_generation) {
+    size_t packet_len = HEADER_LEN + 4 + 8;
+    if (buff_len < packet_len) {
+        return -1;
+    }
+    make_header(buffer, TYPE_CHANGES_REQUEST, packet_len, token);
+    uint32_t log_id_network_endian = htonl(log_id);
+    memcpy(buffer + HEADER_LEN, &log_id_network_endian, 4);
+    uint64_t generation_network_endian = htobe64(since_generation);
+    memcpy(buffer + HEADER_LEN + 4, &generation_network_endian, 8);
+    return packet_len;
+}
+
+
+ssize_t make_changes_response(char* buffer, size_t buff_len, uint32_t token,
+        const struct ChangeLog* log) {
+    if (buff_len > UINT16_MAX) {
+        buff_len = UINT16_MAX;
+    }
+    const char* buffer_end = buffer + buff_len;
+    char* end = buffer + HEADER_LEN;
+    if (buffer_end - end < 4 + 8 + 1 + 4) {
+        return -1;
+    }
+    uint32_t log_id_network_endian = htonl(log->log_id);
+    memcpy(end, &log_id_network_endian, 4);
+    uint64_t generation_network_endian = htobe64(log->generation);
+    memcpy(end + 4, &generation_network_endian, 8);
+    end[12] = log->is_complete;
+    size_t n_entries = log->is_complete ? log->n_entries : 0;
+    uint32_t n_entries_network_endian = htonl(n_entries);
+    memcpy(end + 13, &n_entries_network_endian, 4);
+    end += 17;
+
+    size_t i;
+    for (i = 0; i < n_entries; i++) {
+        // name with null terminator, whether removed, then 4-byte checksum
+        const struct ChangeLogEntry* entry = &log->entries[i];
+        size_t name_len = strlen(entry->name) + 1;
+        if ((size_t)(buffer_end - end) < name_len + 1 + 4) {
+            return -1;
+        }
+        memcpy(end, entry->name, name_len);
+        end += name_len;
+        *end++ = entry->is_removed;
+        uint32_t checksum_network_endian = htonl(entry->checksum);
+        memcpy(end, &checksum_network_endian, 4);
+        end += 4;
+    }
+
+    make_header(buffer, TYPE_CHANGES_RESPONSE, end - buffer, token);
+    return end - buffer;
+}
+
+
+int parse_changes_response(const char* packet, size_t packet_len, struct ChangeLog* log) {
+    memset(log, 0, sizeof(*log));
+    const char* data = packet + HEADER_LEN;
+    const char* data_end = packet + packet_len;
+    if (data_end - data < 4 + 8 + 1 + 4) {
+        return -1;
+    }
+    uint32_t log_id_network_endian;
+    memcpy(&log_id_network_endian, data, 4);
+    log->log_id = ntohl(log_id_network_endian);
+    uint64_t generation_network_endian;
+    memcpy(&generation_network_endian, data + 4, 8);
+    log->generation = be64toh(generation_network_endian);
+    log->is_complete = data[12] != 0;
+    uint32_t n_entries_network_endian;
+    memcpy(&n_entries_network_endian, data + 13, 4);
+    uint32_t n_entries = ntohl(n_entries_network_endian);
+    data += 17;
+    // each change takes at least a null terminator, a byte and a checksum
+    if (n_entries > (size_t)(data_end - data) / 6) {
+        return -1;
+    }
+
+    log->entries = malloc(n_entries * sizeof(struct ChangeLogEntry));
+    while (log->n_entries < n_entries) {
+        const char* name_end = memchr(data, 0, data_end - data);
+        if (name_end == NULL || data_end - (name_end + 1) < 5
+                || name_end - data >= MAX_FILE_NAME_LEN) {
+            free_change_log(log);
+            return -1;
+        }
+        struct ChangeLogEntry* entry = &log->entries[log->n_entries++];
+        memset(entry, 0, sizeof(*entry));
+        memcpy(entry->name, data, name_end - data);
+        entry->is_removed = name_end[1] != 0;
+        entry->checksum = parse_file_checksum(name_end + 2);
+        entry->is_valid = 1;
+        data = name_end + 6;
+    }
+    return 0;
+}
+
+
 ssize_t make_file_request(
         char* buffer, size_t buff_len, uint32_t token, const char* file_name) {
     size_t file_name_len = strlen(file_name) + 1;  // include null terminator
@@ -176,15 +865,93 @@ ssize_t make_file_request(
 }
 
 
-ssize_t make_file_transfer_header(char* buffer, size_t buff_len, uint32_t token, uint16_t data_len) {
+ssize_t make_file_transfer_header(char* buffer, size_t buff_len, uint32_t token, uint64_t file_size) {
+    size_t packet_len = HEADER_LEN + 8;
+    if (buff_len < packet_len) {
+        return -1;
+    }
+    make_header(buffer, TYPE_FILE_TRANSFER, packet_len, token);
+    uint64_t size_network_endian = htobe64(file_size);
+    memcpy(buffer + HEADER_LEN, &size_network_endian, 8);
+    return packet_len;
+}
+
+
+ssize_t make_file_upload_header(char* buffer, size_t buff_len, uint32_t token,
+        const char* file_name, uint64_t file_size, uint32_t checksum) {
+    size_t packet_len = HEADER_LEN + MAX_FILE_NAME_LEN + 8 + 4;
+    if (buff_len < packet_len) {
+        return -1;
+    }
+    make_header(buffer, TYPE_FILE_TRANSFER, packet_len, token);
+    buffer += HEADER_LEN;
+
+    // file name, padded with null characters
+    memset(buffer, 0, MAX_FILE_NAME_LEN);
+    strncpy(buffer, file_name, MAX_FILE_NAME_LEN - 1);
+    buffer += MAX_FILE_NAME_LEN;
+
+    // 8-byte file size
+    uint64_t size_network_endian = htobe64(file_size);
+    memcpy(buffer, &size_network_endian, 8);
+    buffer += 8;
+
+    // 4-byte checksum of the file content
+    uint32_t checksum_network_endian = htonl(checksum);
+    memcpy(buffer, &checksum_network_endian, 4);
+    return packet_len;
+}
+
+
+ssize_t make_v1_file_transfer_header(char* buffer, size_t buff_len, uint32_t token, uint16_t data_len) {
     if (buff_len < HEADER_LEN) {
         return -1;
     }
     make_header(buffer, TYPE_FILE_TRANSFER, HEADER_LEN + data_len, token);
+    // a version 1 client expects a version 1 packet
+    ((struct PacketHeader*)buffer)->version = MIN_VERSION;
     return HEADER_LEN;
 }
 
 
+ssize_t make_file_data_header(char* buffer, size_t buff_len, uint32_t token, uint16_t data_len) {
+    if (buff_len < HEADER_LEN || data_len > MAX_FILE_DATA_LEN) {
+        return -1;
+    }
+    make_header(buffer, TYPE_FILE_DATA, HEADER_LEN + data_len, token);
+    return HEADER_LEN;
+}
+
+
+bool has_framed_transfers(uint8_t version) {
+    return version >= 0x2;
+}
+
+
+bool has_paged_lists(uint8_t version) {
+    return version >= 0x3;
+}
+
+
+bool has_compact_lists(uint8_t version) {
+    return version >= 0x3;
+}
+
+
+uint64_t parse_file_size(const char* size_field) {
+    uint64_t size_network_endian;
+    memcpy(&size_network_endian, size_field, 8);
+    return be64toh(size_network_endian);
+}
+
+
+uint32_t parse_file_checksum(const char* checksum_field) {
+    uint32_t checksum_network_endian;
+    memcpy(&checksum_network_endian, checksum_field, 4);
+    return ntohl(checksum_network_endian);
+}
+
+
 ssize_t make_file_transfer_body(char* buffer, size_t buff_len, FILE* file) {
     return fread(buffer, 1, buff_len, file);
 }
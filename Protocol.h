@@ -12,11 +12,31 @@
 #include <stdio.h>      /* file IO */
 #include <sys/types.h>
 
+#include "ChangeLog.h"
+#include "MerkleTree.h"
 #include "StorageService.h"
 
 
-/** Protocol version */
-static const uint8_t VERSION = 0x1;
+/**
+ * Protocol version. From version 3, LIST responses are sent in pages, in
+ * the compact encoding described at make_list_response(). Older versions
+ * get a single LIST_RESPONSE packet.
+ */
+static const uint8_t VERSION = 0x3;
+
+/**
+ * Oldest protocol version still accepted. In version 1, a file is sent as
+ * a single FILE_TRANSFER packet, so it can't be larger than about 64KB.
+ * From version 2, a FILE_TRANSFER packet only carries the 64-bit file size,
+ * and the content follows in FILE_DATA packets.
+ */
+static const uint8_t MIN_VERSION = 0x1;
+
+/** Max length of the file content carried by a FILE_DATA packet */
+#define MAX_FILE_DATA_LEN 61440
+
+/** Max length of a request, which the server receives whole */
+#define MAX_REQUEST_LEN 16384
 
 /* 
  * Packet types 
@@ -33,6 +53,16 @@ enum PacketType {
     TYPE_FILE_TRANSFER,
     TYPE_FILE_RECEIVED,
     TYPE_ERROR,
+    TYPE_FILE_DATA,
+    TYPE_DIFF_REQUEST,
+    TYPE_DIFF_RESPONSE,
+    TYPE_TREE_REQUEST,
+    TYPE_TREE_RESPONSE,
+    TYPE_LEAF_REQUEST,
+    TYPE_LEAF_RESPONSE,
+    TYPE_LIST_PAGE,
+    TYPE_CHANGES_REQUEST,
+    TYPE_CHANGES_RESPONSE,
 };
 
 
@@ -44,6 +74,11 @@ enum ErrorType {
     ERROR_INVALID_PASSWORD,
     ERROR_FILE_NOT_EXIST,
     ERROR_FILE_UPLOAD_FAILED,
+    ERROR_FILE_TOO_LARGE,
+    ERROR_CHECKSUM_MISMATCH,
+    ERROR_DIFF_TOO_LARGE,
+    ERROR_CHANGES_UNAVAILABLE,
+    ERROR_LIST_TOO_LARGE,
 };
 
 
@@ -64,6 +99,88 @@ struct PacketHeader {
 static const size_t HEADER_LEN = sizeof(struct PacketHeader);
 
 
+/**
+ * Buffers the bytes received from a socket, and splits them into packets.
+ * Bytes are received in large chunks, so that small pipelined packets don't
+ * take a recv() each. Packets are returned in place, without copying.
+ */
+struct PacketReader {
+    char* buffer;
+    size_t capacity;
+    /** The bytes received and not taken yet are from start to end */
+    size_t start;
+    size_t end;
+};
+
+
+/**
+ * Initialize a reader. It must be released with free_packet_reader()
+ * @param capacity Size of the buffer, which is also the max length of a packet
+ */
+void init_packet_reader(struct PacketReader* reader, size_t capacity);
+
+
+void free_packet_reader(struct PacketReader* reader);
+
+
+/**
+ * @return Number of bytes received and not taken yet
+ */
+size_t buffered_len(const struct PacketReader* reader);
+
+
+/**
+ * Receive as many bytes as fit in the reader, with a single recv().
+ * Bytes previously taken from the reader may be overwritten.
+ * @return Number of bytes received, 0 if the connection was closed,
+ *         or -1 if error (with errno set, e.g. EAGAIN for a non-blocking socket)
+ */
+ssize_t fill_packet_reader(struct PacketReader* reader, int socket);
+
+
+/**
+ * @return The header of the next packet, or NULL if it isn't fully received yet
+ */
+const struct PacketHeader* peek_packet_header(const struct PacketReader* reader);
+
+
+/**
+ * Take the next len bytes received
+ * @return Address of the bytes in the reader's buffer, valid until the
+ *         next call to fill_packet_reader(), or NULL if fewer bytes were received
+ */
+char* take_bytes(struct PacketReader* reader, size_t len);
+
+
+/**
+ * Take up to max_len bytes received, and copy them out of the reader
+ * @return Number of bytes copied
+ */
+size_t copy_bytes(struct PacketReader* reader, char* buffer, size_t max_len);
+
+
+/**
+ * Take the next packet, if it is fully received
+ * @param  packet [out] Address of the variable to store the address of the
+ *                packet, valid until the next call to fill_packet_reader()
+ * @return Length of the packet, 0 if it isn't fully received yet, or -1
+ *         if its length is invalid (shorter than a header, or longer than the buffer)
+ */
+ssize_t next_packet(struct PacketReader* reader, char** packet);
+
+
+/**
+ * Receive the next packet from a blocking socket
+ * @param  packet [out] Address of the variable to store the address of the packet
+ * @return Length of the packet, or -1 if error
+ */
+ssize_t read_packet(struct PacketReader* reader, int socket, char** packet);
+
+
+/**
+ * Receive a whole packet
+ * @return Length of the packet, or -1 if error or if the packet is longer than buff_len
+ */
 ssize_t receive_packet(int socket ,char* buffer, size_t buff_len);
 
 /**
@@ -87,18 +204,255 @@ ssize_t make_token_response(char* buffer, size_t buff_len, uint32_t token);
 ssize_t make_leave_request(char* buffer, size_t buff_len, uint32_t token);
 
 
-ssize_t make_list_request(char* buffer, size_t buff_len, uint32_t token);
+/**
+ * Make the packet asking for the list of files
+ * @param  cursor Name of the file after which the list starts,
+ *                or NULL to list all files
+ * @return Length of packet, or -1 if error
+ */
+ssize_t make_list_request(char* buffer, size_t buff_len, uint32_t token, const char* cursor);
 
 
+/**
+ * Make a page of the response to a LIST request, with as many files as fit
+ * in the packet. Every page but the last is a LIST_PAGE packet, and the
+ * last page is a LIST_RESPONSE packet, so a list fitting in a single
+ * packet is sent as before.
+ *
+ * Each file is either a 64-byte name padded with zeros followed by its
+ * 4-byte checksum, or, in the compact encoding, the page is the varint
+ * number of files, their 4-byte checksums, then each name as the varint
+ * length of the prefix it shares with the previous name of the page, the
+ * varint length of the rest of the name, and the rest of the name.
+ * @param  version   Protocol version of the requester, which chooses the
+ *                   encoding and is stamped on the packet, so that
+ *                   parse_list_files() decodes the page the same way
+ * @param  next_file [in,out] Position in the catalog of the first file of
+ *                   the page, moved past the files of the page
+ * @return Length of packet, or -1 if error
+ */
 ssize_t make_list_response(char* buffer, size_t buff_len, uint32_t token, 
-        struct FileInfo* file_info, int n_files);
+        const struct FileCatalog* catalog, uint8_t version, size_t* next_file);
+
+
+/**
+ * Parse the files of a LIST_PAGE or LIST_RESPONSE packet, in the encoding
+ * of the packet's protocol version
+ * @return Catalog of the files, or NULL if the files are malformed.
+ *         Must be freed with free_file_catalog()
+ */
+struct FileCatalog* parse_list_files(const char* packet, size_t packet_len);
+
+
+/**
+ * Make the packet asking the server which files only it has, and which
+ * only the client has. The packet carries the client's files, each as
+ * its null-terminated name followed by its 4-byte checksum.
+ * @return Length of packet, or -1 if the files don't fit in a packet
+ */
+ssize_t make_diff_request(char* buffer, size_t buff_len, uint32_t token,
+        const struct FileCatalog* client_files);
+
+
+/**
+ * Make the response to a DIFF request: the 4-byte number of files only in
+ * the server, then these files, then the files only in the client, each
+ * in the format of the request
+ * @return Length of packet, or -1 if the files don't fit in a packet
+ */
+ssize_t make_diff_response(char* buffer, size_t buff_len, uint32_t token,
+        const struct FileCatalog* server_only, const struct FileCatalog* client_only);
+
+
+/**
+ * Parse the files of a DIFF request or response
+ * @param  data     [in,out] Address of the pointer to the first file,
+ *                  moved past the files parsed
+ * @param  data_end End of the packet
+ * @param  max_files Number of files to parse, or SIZE_MAX to parse
+ *                  until the end of the packet
+ * @return Catalog of the files, or NULL if the files are malformed.
+ *         Must be freed with free_file_catalog()
+ */
+struct FileCatalog* parse_diff_files(const char** data, const char* data_end, size_t max_files);
+
+
+/**
+ * Make the packet asking for the hashes of the children of nodes of the
+ * user's hash tree: the 1-byte level of the nodes, then the 2-byte position
+ * of each node in its level. With no nodes, the packet asks for the root
+ * hash, and the server builds the tree used by the following TREE and
+ * LEAF requests.
+ * @return Length of packet, or -1 if the nodes don't fit in a packet
+ */
+ssize_t make_tree_request(char* buffer, size_t buff_len, uint32_t token,
+        uint8_t level, const uint32_t* nodes, size_t n_nodes);
+
+
+/**
+ * Make the response to a TREE request: the root hash if no nodes are given,
+ * else the 2-byte number of nodes answered, then the hashes of the children
+ * of each node. As many of the nodes as fit in the packet are answered.
+ * @return Length of packet, or -1 if error
+ */
+ssize_t make_tree_response(char* buffer, size_t buff_len, uint32_t token,
+        const struct MerkleTree* tree, uint8_t level, const uint32_t* nodes, size_t n_nodes);
+
+
+/**
+ * Make the packet asking for the files of leaves of the user's hash tree:
+ * the 2-byte position of each leaf
+ * @return Length of packet, or -1 if the leaves don't fit in a packet
+ */
+ssize_t make_leaf_request(char* buffer, size_t buff_len, uint32_t token,
+        const uint32_t* leaves, size_t n_leaves);
+
+
+/**
+ * Make the response to a LEAF request: the 2-byte number of leaves answered,
+ * then for each leaf the 2-byte number of files, then the files in the format
+ * of DIFF packets. As many of the leaves as fit in the packet are answered.
+ * @return Length of packet, or -1 if error
+ */
+ssize_t make_leaf_response(char* buffer, size_t buff_len, uint32_t token,
+        const struct MerkleTree* tree, const uint32_t* leaves, size_t n_leaves);
+
+
+/**
+ * Parse a TREE response answering a request for the children of nodes
+ * @param  n_nodes  Number of nodes of the request
+ * @param  children [out] Address of the variable to store the address of
+ *                  the child hashes of the nodes answered, in the packet
+ * @return Number of nodes answered, or -1 if the response is malformed
+ */
+ssize_t parse_tree_response(const char* packet, size_t packet_len, size_t n_nodes,
+        const unsigned char** children);
+
+
+/**
+ * Parse a LEAF response
+ * @param  n_leaves   Number of leaves of the request
+ * @param  leaf_files [out] Array to store the catalog of each leaf answered.
+ *                    Each must be freed with free_file_catalog()
+ * @return Number of leaves answered, 0 if the files of the first leaf
+ *         don't fit in a packet, or -1 if the response is malformed
+ */
+ssize_t parse_leaf_response(const char* packet, size_t packet_len, size_t n_leaves,
+        struct FileCatalog** leaf_files);
+
+
+/**
+ * Parse the 2-byte node positions of a TREE or LEAF request
+ * @param  nodes     [out] Array to store the positions
+ * @param  max_nodes Length of the array
+ * @return Number of nodes, or -1 if malformed
+ */
+ssize_t parse_tree_nodes(const char* data, const char* data_end, uint32_t* nodes, size_t max_nodes);
+
+
+/**
+ * Make the packet asking for the files changed since the given generation
+ * of the user's change log: the 4-byte log id, then the 8-byte generation
+ * @return Length of packet, or -1 if error
+ */
+ssize_t make_changes_request(char* buffer, size_t buff_len, uint32_t token,
+        uint32_t log_id, uint64_t since_generation);
+
+
+/**
+ * Make the response to a CHANGES request: the 4-byte log id, the 8-byte
+ * generation of the log, a byte telling whether the changes are complete,
+ * the 4-byte number of changes, then each change as the file's
+ * null-terminated name, a byte telling whether it was removed, and its
+ * 4-byte checksum. Incomplete changes are left out.
+ * @return Length of packet, or -1 if the changes don't fit in a packet
+ */
+ssize_t make_changes_response(char* buffer, size_t buff_len, uint32_t token,
+        const struct ChangeLog* log);
+
+
+/**
+ * Parse the changes of a CHANGES response
+ * @param  log [out] Address of the struct to store the changes.
+ *             Must be freed with free_change_log()
+ * @return 0 if success, -1 if the changes are malformed
+ */
+int parse_changes_response(const char* packet, size_t packet_len, struct ChangeLog* log);
 
 
 ssize_t make_file_request(
         char* buffer, size_t buff_len, uint32_t token, const char* file_name);
 
 
-ssize_t make_file_transfer_header(char* buffer, size_t buff_len, uint32_t token, uint16_t data_len);
+/**
+ * Make the FILE_TRANSFER packet starting a download, containing the file size.
+ * The file content follows in FILE_DATA packets.
+ * @return Length of packet, or -1 if error
+ */
+ssize_t make_file_transfer_header(char* buffer, size_t buff_len, uint32_t token, uint64_t file_size);
+
+
+/**
+ * Make the FILE_TRANSFER packet starting an upload, containing the file name,
+ * size and checksum. The file content follows in FILE_DATA packets.
+ * The checksum is optional for the server, which checks the received
+ * content against it when present.
+ * @return Length of packet, or -1 if error
+ */
+ssize_t make_file_upload_header(char* buffer, size_t buff_len, uint32_t token,
+        const char* file_name, uint64_t file_size, uint32_t checksum);
+
+
+/**
+ * Make the header of a version 1 FILE_TRANSFER packet, directly followed by
+ * the file content
+ * @return Length of header, or -1 if error
+ */
+ssize_t make_v1_file_transfer_header(char* buffer, size_t buff_len, uint32_t token, uint16_t data_len);
+
+
+/**
+ * Make the header of a FILE_DATA packet, followed by data_len bytes of
+ * file content (at most MAX_FILE_DATA_LEN)
+ * @return Length of header, or -1 if error
+ */
+ssize_t make_file_data_header(char* buffer, size_t buff_len, uint32_t token, uint16_t data_len);
+
+
+/**
+ * @return Whether file content is sent in FILE_DATA packets in the given
+ *         protocol version, instead of a single FILE_TRANSFER packet
+ */
+bool has_framed_transfers(uint8_t version);
+
+
+/**
+ * @return Whether a LIST response may be sent in several pages in the
+ *         given protocol version, instead of a single packet
+ */
+bool has_paged_lists(uint8_t version);
+
+
+/**
+ * @return Whether LIST pages use the compact encoding in the given
+ *         protocol version
+ */
+bool has_compact_lists(uint8_t version);
+
+
+/**
+ * Read the file size from a FILE_TRANSFER packet of version 2 or later
+ * @param  size_field Address of the size in the packet, after the header
+ *                    and the file name (if any)
+ */
+uint64_t parse_file_size(const char* size_field);
+
+
+/**
+ * Read the file checksum from a FILE_TRANSFER packet starting an upload
+ * @param  checksum_field Address of the checksum in the packet, after the file size
+ */
+uint32_t parse_file_checksum(const char* checksum_field);
 
 
 ssize_t make_file_transfer_body(char* buffer, size_t buff_len, FILE* file);
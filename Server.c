@@ -2,10 +2,25 @@
  * Run a server
  */
 
-#include <time.h>  // for setting random seed
+#define _GNU_SOURCE        // for CPU affinity
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdbool.h>
+#include <sys/resource.h>  // for descriptor limit
+#include <time.h>          // for setting random seed
 
 #include "NetworkHeader.h"
 #include "ClientHandler.h"
+#include "EventLoop.h"
+#include "FileChecksum.h"
+
+
+/** Max number of ready sockets handled per wait */
+#define MAX_EVENTS 256
+
+/** Default number of worker threads for disk work, for each reactor */
+#define N_WORKERS 4
 
 
 /**
@@ -18,6 +33,25 @@
 void die_with_error(const char* message, const char* detail);
 
 
+/**
+ * Options of the server, set by command line arguments
+ */
+struct ServerOptions {
+	int port;
+	/** Max number of clients, shared evenly by the reactors */
+	int max_connections;
+	/** Number of worker threads of each reactor */
+	int n_workers;
+	/** Number of reactor threads, each with its own listening socket */
+	int n_reactors;
+	bool edge_triggered;
+	/** Whether file content of transfers is moved with io_uring */
+	bool use_io_uring;
+	/** How files are read to be checksummed */
+	enum ChecksumReadMode checksum_read_mode;
+};
+
+
 /**
  * Parse the argument supplied to the main program
  * and extract arguments into output parameters.
@@ -26,17 +60,47 @@ void die_with_error(const char* message, const char* detail);
  *
  * @param argc        Number of command line arguments
  * @param argv        Array of command line arguments
- * @param server      [out] Address of the variable to store server IP
- * @param port        [out] Address of the variable to store the port string
+ * @param options     [out] Address of the struct to store the server options
  */
-void parse_arguments(int argc, char* argv[], int* port);
+void parse_arguments(int argc, char* argv[], struct ServerOptions* options);
 
 
 /**
- * Create the server socket at the specified port
+ * Create the non-blocking server socket at the specified port
+ * @param  reuse_port Whether other sockets may bind to the same port,
+ *                    in which case the kernel spreads connections among them
  * @return the socket descriptor, or -1 if fail to create socket
  */
-int create_socket(int server_port);
+int create_socket(int server_port, bool reuse_port);
+
+
+/**
+ * Raise the limit on open descriptors so that the given number of
+ * clients can be connected at the same time
+ */
+void raise_descriptor_limit(int max_connections);
+
+
+/**
+ * Run a reactor: accept clients on its own listening socket, and serve
+ * them with its own event loop, client table and workers. Nothing is
+ * shared with the other reactors.
+ * @param  arg Address of the reactor's struct Reactor
+ * @return Never returns
+ */
+void* run_reactor(void* arg);
+
+
+/**
+ * State of a reactor thread
+ */
+struct Reactor {
+	pthread_t thread;
+	/** Index of the reactor, also the CPU it is pinned to */
+	int id;
+	int server_socket;
+	const struct ServerOptions* options;
+};
 
 
 int main(int argc, char *argv[])
@@ -44,8 +108,15 @@ int main(int argc, char *argv[])
 	/*
      * Parse arguments supplied to main program
      */
-	int server_port = atoi(SERVER_PORT);  // init with default value
-	parse_arguments(argc, argv, &server_port);
+	struct ServerOptions options;
+	options.port = atoi(SERVER_PORT);  // init with default value
+	options.max_connections = MAX_CONNECTIONS;
+	options.n_workers = N_WORKERS;
+	options.n_reactors = 1;
+	options.edge_triggered = false;
+	options.use_io_uring = false;
+	options.checksum_read_mode = CHECKSUM_READ_CACHED;
+	parse_arguments(argc, argv, &options);
 
 
 	/*
@@ -53,73 +124,126 @@ int main(int argc, char *argv[])
 	 */
 	// set seed for random calls in other services
 	srand(time(0));
-	int i;
-	int server_socket = create_socket(server_port);
-
- 	// keep track of which sockets has incoming data
-	fd_set activated_sockets;
-
-	// initial infos about connected clients
-	struct ClientInfo client_infos[MAX_CONNECTIONS];
-	memset(client_infos, 0, MAX_CONNECTIONS * sizeof(struct ClientInfo));
+	set_checksum_read_mode(options.checksum_read_mode);
+	raise_descriptor_limit(options.max_connections);
 
 	// intialize client handler
 	initialize_client_handler();
 
+	// create all listening sockets first, so that the port is taken
+	// before any reactor starts
+	int i;
+	struct Reactor* reactors = calloc(options.n_reactors, sizeof(struct Reactor));
+	for (i = 0; i < options.n_reactors; i++) {
+		reactors[i].id = i;
+		reactors[i].options = &options;
+		reactors[i].server_socket = create_socket(options.port, options.n_reactors > 1);
+	}
+
 	/*
-	 * Do all the work here
+	 * Do all the work in the reactors,
+	 * the first one runs on the main thread
 	 */
-	while (1) {
-		/*
-		 * add all sockets to monitored set
-		 */
-		// store the maximum socket descriptor for select()
-		int max_descriptor = server_socket;
-
-		// clear the set
-		FD_ZERO(&activated_sockets);
-		// add server socket into set
-		FD_SET(server_socket, &activated_sockets);
-		// add all client sockets to set
-		for (i = 0; i < MAX_CONNECTIONS; i++) {
-			// check for val
-			int client_socket = client_infos[i].client_socket;
-			if (client_socket > 0) {
-				FD_SET(client_socket, &activated_sockets);   
-            }
-            if(client_socket > max_descriptor) {
-                max_descriptor = client_socket;
-            }
+	for (i = 1; i < options.n_reactors; i++) {
+		if (pthread_create(&reactors[i].thread, NULL, run_reactor, &reactors[i]) != 0) {
+			die_with_error("Failed to initialize server", "cannot start reactor threads");
 		}
+	}
+	run_reactor(&reactors[0]);
+
+	// not reached
+	return 0;
+}
+
+
+void* run_reactor(void* arg) {
+	struct Reactor* reactor = arg;
+	const struct ServerOptions* options = reactor->options;
+	int server_socket = reactor->server_socket;
+	int i;
+
+	// with one reactor per core, keep each reactor (and the cache holding
+	// its clients' state) on its own core
+	if (options->n_reactors > 1) {
+		cpu_set_t cpus;
+		CPU_ZERO(&cpus);
+		CPU_SET(reactor->id % sysconf(_SC_NPROCESSORS_ONLN), &cpus);
+		pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+	}
+
+	// watch the server socket and all client sockets for activity
+	struct EventLoop* loop = create_event_loop(MAX_EVENTS, options->edge_triggered);
+	if (loop == NULL) {
+		die_with_error("Failed to initialize server", "epoll_create1() failed");
+	}
+	add_to_event_loop(loop, server_socket, EVENT_READ);
 
+	// infos about connected clients, indexed by socket,
+	// and the workers running their disk work
+	int max_connections = options->max_connections / options->n_reactors;
+	if (max_connections <= 0) {
+		max_connections = 1;
+	}
+	struct ClientTable client_table;
+	if (initialize_client_table(&client_table, loop, options->n_workers,
+			max_connections, options->use_io_uring) < 0) {
+		die_with_error("Failed to initialize server", "cannot start worker threads");
+	}
+
+	while (1) {
 		/*
 		 * Wait for activity on some of the sockets
+		 * (don't wait if some clients still have work to resume)
 		 */
-		int n_activities = select(max_descriptor + 1, &activated_sockets, NULL, NULL, NULL);
-		if (n_activities <= 0) {
-			continue;
-		}
+		int timeout = has_pending_clients(&client_table) ? 0 : -1;
+		int n_activities = wait_for_events(loop, timeout);
 
 		/*
 		 * Handle activity for each activated socket
 		 */
-		// connection from new client
-		if (FD_ISSET(server_socket, &activated_sockets)) {
-			printf("\nHandling connection request\n");				
-			accept_client(server_socket, client_infos, MAX_CONNECTIONS);
-		}
-		// request from connected clients
-		for (i = 0; i < MAX_CONNECTIONS; i++) {
-			if (FD_ISSET(client_infos[i].client_socket, &activated_sockets)) {
-				printf("\nHandling client with client ID = %d\n", i);				
-				handle_client(&client_infos[i]);
+		for (i = 0; i < n_activities; i++) {
+			int fd = loop->ready_events[i].fd;
+			if (fd == server_socket) {
+				// connection from new clients
+				printf("\nHandling connection request\n");
+				accept_client(server_socket, &client_table);
+				continue;
+			}
+			if (fd == client_table.workers->notify_fd) {
+				// disk work completed by the workers
+				handle_completed_work(&client_table);
+				continue;
+			}
+			if (client_table.ring != NULL && fd == client_table.ring->notify_fd) {
+				// file content moved by io_uring
+				handle_ring_completions(&client_table);
+				continue;
+			}
+
+			// request from connected client
+			// (the client may have been removed earlier in this batch)
+			if (fd >= client_table.capacity || client_table.clients[fd] == NULL) {
+				continue;
 			}
+			handle_client(&client_table, fd, loop->ready_events[i].events);
 		}
+
+		/*
+		 * Resume clients that used up their share of work in the previous round,
+		 * so that large transfers interleave with other requests
+		 */
+		handle_pending_clients(&client_table);
+
+		/*
+		 * Submit the io_uring operations queued for all clients at once
+		 */
+		submit_queued_io(&client_table);
 	}
 
 	// not reached
+	free_event_loop(loop);
 	close(server_socket);
-	return 0;
+	return NULL;
 }
 
 
@@ -137,12 +261,13 @@ void die_with_error(const char* message, const char* detail) {
 }
 
 
-void parse_arguments(int argc, char* argv[], int* port) {
+void parse_arguments(int argc, char* argv[], struct ServerOptions* options) {
 	static const char* USAGE_MESSAGE = 
-            "Usage:\n ./server [-p <port>]";
+            "Usage:\n ./server [-p <port>] [-c <max connections>] [-w <workers>]"
+            " [-t <reactors>] [-m <level|edge>] [-b <epoll|uring>] [-r <cached|stream>]";
     
     // there must be an odd number of arguments (program name and flag-value pairs)
-    if (argc % 2 == 0 || argc > 3) {
+    if (argc % 2 == 0 || argc > 15) {
         die_with_error(USAGE_MESSAGE, NULL);
     }
 
@@ -162,7 +287,55 @@ void parse_arguments(int argc, char* argv[], int* port) {
         char* value = argv[i+1];
         switch (argv[i][1]) {
             case 'p':  // server port
-                *port = atoi(value);
+                options->port = atoi(value);
+                break;
+            case 'c':  // max number of connected clients
+                options->max_connections = atoi(value);
+                if (options->max_connections <= 0) {
+                    die_with_error(USAGE_MESSAGE, "Invalid max connections");
+                }
+                break;
+            case 'w':  // number of worker threads
+                options->n_workers = atoi(value);
+                if (options->n_workers <= 0) {
+                    die_with_error(USAGE_MESSAGE, "Invalid number of workers");
+                }
+                break;
+            case 't':  // number of reactor threads, 0 for one per core
+                options->n_reactors = atoi(value);
+                if (options->n_reactors == 0) {
+                    options->n_reactors = sysconf(_SC_NPROCESSORS_ONLN);
+                }
+                if (options->n_reactors <= 0) {
+                    die_with_error(USAGE_MESSAGE, "Invalid number of reactors");
+                }
+                break;
+            case 'm':  // event trigger mode
+                if (strcmp(value, "edge") == 0) {
+                    options->edge_triggered = true;
+                } else if (strcmp(value, "level") == 0) {
+                    options->edge_triggered = false;
+                } else {
+                    die_with_error(USAGE_MESSAGE, "Unknown trigger mode");
+                }
+                break;
+            case 'b':  // I/O backend for file transfers
+                if (strcmp(value, "uring") == 0) {
+                    options->use_io_uring = true;
+                } else if (strcmp(value, "epoll") == 0) {
+                    options->use_io_uring = false;
+                } else {
+                    die_with_error(USAGE_MESSAGE, "Unknown I/O backend");
+                }
+                break;
+            case 'r':  // how files are read to be checksummed
+                if (strcmp(value, "stream") == 0) {
+                    options->checksum_read_mode = CHECKSUM_READ_STREAM;
+                } else if (strcmp(value, "cached") == 0) {
+                    options->checksum_read_mode = CHECKSUM_READ_CACHED;
+                } else {
+                    die_with_error(USAGE_MESSAGE, "Unknown checksum read mode");
+                }
                 break;
             default:   // unknown flag
                 die_with_error(USAGE_MESSAGE, "Unknown flag");
@@ -171,15 +344,21 @@ void parse_arguments(int argc, char* argv[], int* port) {
 }
 
 
-int create_socket(int server_port) {
+int create_socket(int server_port, bool reuse_port) {
 	int server_socket;
 	/*
 	 * Create the socket descriptor
 	 */
-	if ((server_socket = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP)) < 0) {
+	if ((server_socket = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, IPPROTO_TCP)) < 0) {
 		die_with_error("Failed to initialize server", "socket() failed");
 	}
 
+	// let each reactor bind its own socket to the port
+	int enable = 1;
+	if (reuse_port && setsockopt(server_socket, SOL_SOCKET, SO_REUSEPORT, &enable, sizeof(enable)) < 0) {
+		die_with_error("Failed to initialize server", "setsockopt() failed");
+	}
+
 	/*
 	 * Bind socket to local address
 	 */
@@ -198,9 +377,27 @@ int create_socket(int server_port) {
 	/*
 	 * Set to listen for multiple incomming connections
 	 */
-	if (listen(server_socket, MAX_CONNECTIONS) < 0) {
+	if (listen(server_socket, SOMAXCONN) < 0) {
 		die_with_error("Failed to initialize server", "listen() failed");
 	}
 
 	return server_socket;
 }
+
+
+void raise_descriptor_limit(int max_connections) {
+	struct rlimit limit;
+	if (getrlimit(RLIMIT_NOFILE, &limit) < 0) {
+		return;
+	}
+	// leave some room for the server socket, files, etc.
+	rlim_t wanted = max_connections + 64;
+	if (limit.rlim_cur >= wanted) {
+		return;
+	}
+	limit.rlim_cur = (limit.rlim_max < wanted) ? limit.rlim_max : wanted;
+	if (setrlimit(RLIMIT_NOFILE, &limit) < 0 || limit.rlim_cur < wanted) {
+		printf("Warning: descriptor limit allows fewer than %d clients\n", max_connections);
+	}
+}
+
@@ -0,0 +1,146 @@
+#include "Sha256.h"
+
+#include <string.h>
+
+
+/** First 32 bits of the fractional parts of the cube roots of the first 64 primes */
+static const uint32_t ROUND_CONSTANTS[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+
+/*
+ * Helper functions
+ */
+
+static inline uint32_t rotate_right(uint32_t x, int n) {
+    return (x >> n) | (x << (32 - n));
+}
+
+
+/**
+ * Hash a 64-byte block into the state
+ */
+static void hash_block(uint32_t* state, const unsigned char* block) {
+    // message schedule, from the big-endian words of the block
+    uint32_t w[64];
+    int i;
+    for (i = 0; i < 16; i++) {
+        w[i] = (uint32_t)block[4*i] << 24 | (uint32_t)block[4*i + 1] << 16
+                | (uint32_t)block[4*i + 2] << 8 | block[4*i + 3];
+    }
+    for (i = 16; i < 64; i++) {
+        uint32_t s0 = rotate_right(w[i - 15], 7) ^ rotate_right(w[i - 15], 18) ^ (w[i - 15] >> 3);
+        uint32_t s1 = rotate_right(w[i - 2], 17) ^ rotate_right(w[i - 2], 19) ^ (w[i - 2] >> 10);
+        w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+    }
+
+    uint32_t a = state[0], b = state[1], c = state[2], d = state[3];
+    uint32_t e = state[4], f = state[5], g = state[6], h = state[7];
+    for (i = 0; i < 64; i++) {
+        uint32_t s1 = rotate_right(e, 6) ^ rotate_right(e, 11) ^ rotate_right(e, 25);
+        uint32_t choice = (e & f) ^ (~e & g);
+        uint32_t temp1 = h + s1 + choice + ROUND_CONSTANTS[i] + w[i];
+        uint32_t s0 = rotate_right(a, 2) ^ rotate_right(a, 13) ^ rotate_right(a, 22);
+        uint32_t majority = (a & b) ^ (a & c) ^ (b & c);
+        uint32_t temp2 = s0 + majority;
+        h = g;
+        g = f;
+        f = e;
+        e = d + temp1;
+        d = c;
+        c = b;
+        b = a;
+        a = temp1 + temp2;
+    }
+    state[0] += a;
+    state[1] += b;
+    state[2] += c;
+    state[3] += d;
+    state[4] += e;
+    state[5] += f;
+    state[6] += g;
+    state[7] += h;
+}
+
+
+/*
+ * Public functions
+ */
+
+
+void sha256_init(struct Sha256Context* context) {
+    // first 32 bits of the fractional parts of the square roots of the first 8 primes
+    static const uint32_t INITIAL_STATE[8] = {
+        0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19,
+    };
+    memcpy(context->state, INITIAL_STATE, sizeof(INITIAL_STATE));
+    context->len = 0;
+}
+
+
+void sha256_update(struct Sha256Context* context, const void* data, size_t len) {
+    const unsigned char* bytes = data;
+    size_t n_buffered = context->len % 64;
+    context->len += len;
+
+    // complete the buffered block first
+    if (n_buffered > 0) {
+        size_t n_copied = 64 - n_buffered < len ? 64 - n_buffered : len;
+        memcpy(context->block + n_buffered, bytes, n_copied);
+        bytes += n_copied;
+        len -= n_copied;
+        if (n_buffered + n_copied < 64) {
+            return;
+        }
+        hash_block(context->state, context->block);
+    }
+    // then hash whole blocks in place, and buffer the rest
+    while (len >= 64) {
+        hash_block(context->state, bytes);
+        bytes += 64;
+        len -= 64;
+    }
+    memcpy(context->block, bytes, len);
+}
+
+
+void sha256_final(struct Sha256Context* context, unsigned char* digest) {
+    // pad with a 1 bit, zeros, then the 64-bit length in bits
+    uint64_t bit_len = context->len * 8;
+    size_t n_buffered = context->len % 64;
+    context->block[n_buffered++] = 0x80;
+    if (n_buffered > 56) {
+        memset(context->block + n_buffered, 0, 64 - n_buffered);
+        hash_block(context->state, context->block);
+        n_buffered = 0;
+    }
+    memset(context->block + n_buffered, 0, 56 - n_buffered);
+    int i;
+    for (i = 0; i < 8; i++) {
+        context->block[56 + i] = bit_len >> (56 - 8 * i);
+    }
+    hash_block(context->state, context->block);
+
+    for (i = 0; i < 8; i++) {
+        digest[4*i] = context->state[i] >> 24;
+        digest[4*i + 1] = context->state[i] >> 16;
+        digest[4*i + 2] = context->state[i] >> 8;
+        digest[4*i + 3] = context->state[i];
+    }
+}
+
+
+void sha256(const void* data, size_t len, unsigned char* digest) {
+    struct Sha256Context context;
+    sha256_init(&context);
+    sha256_update(&context, data, len);
+    sha256_final(&context, digest);
+}
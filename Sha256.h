@@ -0,0 +1,51 @@
+/**
+ * Contains the SHA-256 hash function (FIPS 180-4)
+ */
+
+#ifndef SHA256_H_
+#define SHA256_H_
+
+
+#include <stddef.h>
+#include <stdint.h>
+
+
+#define SHA256_DIGEST_LEN 32
+
+
+/**
+ * State of a hash being computed
+ */
+struct Sha256Context {
+    uint32_t state[8];
+    /** Number of bytes hashed so far */
+    uint64_t len;
+    /** Bytes not hashed yet, until a whole block is received */
+    unsigned char block[64];
+};
+
+
+void sha256_init(struct Sha256Context* context);
+
+
+/**
+ * Hash more data
+ */
+void sha256_update(struct Sha256Context* context, const void* data, size_t len);
+
+
+/**
+ * Finish the hash
+ * @param digest [out] Buffer of SHA256_DIGEST_LEN bytes to store the hash
+ */
+void sha256_final(struct Sha256Context* context, unsigned char* digest);
+
+
+/**
+ * Hash the given data at once
+ * @param digest [out] Buffer of SHA256_DIGEST_LEN bytes to store the hash
+ */
+void sha256(const void* data, size_t len, unsigned char* digest);
+
+
+#endif // SHA256_H_
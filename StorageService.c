@@ -1,14 +1,93 @@
 #include "StorageService.h"
 
 #include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
 #include <stdbool.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/random.h>
+#include <sys/syscall.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <unistd.h>
+
+#include "FileIndex.h"
 
 
 #define DATABASE_DIR "serverdata"
+#define INDEX_EXTENSION ".idx"
+#define LOG_EXTENSION ".log"
+
+/** Size of the buffer receiving directory entries, so that each system call returns many */
+#define DIRENT_BUFFER_LEN (32 * 1024)
+
+/** Max number of threads checksumming files, for all listings together */
+#define MAX_CHECKSUM_THREADS 16
+
+
+/**
+ * A directory entry, as returned by getdents64()
+ */
+struct LinuxDirent64 {
+	uint64_t d_ino;
+	int64_t d_off;
+	unsigned short d_reclen;
+	unsigned char d_type;
+	char d_name[];
+};
+
+
+/**
+ * A regular file found when scanning a directory
+ */
+struct ScannedFile {
+	struct stat file_stat;
+	uint32_t checksum;
+	/** Whether the checksum is computed, rather than taken from the index */
+	bool is_checksummed;
+	/** false if the file couldn't be opened or read to be checksummed */
+	bool is_readable;
+	/** Listing the file belongs to, while it waits to be checksummed */
+	struct ChecksumBatch* batch;
+	/** Next file waiting to be checksummed */
+	struct ScannedFile* next_pending;
+	/** Whole name of the file, which is only truncated once listed */
+	char name[];
+};
+
+
+/**
+ * Files of a listing handed to the checksum pool
+ */
+struct ChecksumBatch {
+	int dir_fd;
+	/** Number of files of the listing not checksummed yet */
+	size_t n_pending;
+	/** Signaled when the last file of the listing is checksummed */
+	pthread_cond_t is_done;
+};
+
+
+/**
+ * Files waiting to be checksummed, taken by the pool's threads as soon as
+ * a directory scan finds them. The pool is shared by all listings, so that
+ * listings running at the same time don't multiply the threads.
+ */
+struct ChecksumPool {
+	pthread_mutex_t lock;
+	pthread_cond_t has_files;
+	struct ScannedFile* head;
+	struct ScannedFile* tail;
+	int n_threads;
+	int max_threads;
+};
+
+
+static struct ChecksumPool checksum_pool = {
+	PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, NULL, NULL, 0, 0
+};
 
 
 /*
@@ -16,13 +95,195 @@
  */
 
 /**
- * Check if the path refers to a regular file (as opposed to a directory/sym link/etc.)
+ * Find the status of a directory entry, if it may be a regular file
+ * (as opposed to a directory/device/etc.)
+ * @return true if the entry is a regular file, or a link to one
+ */
+static bool stat_regular_file(int dir_fd, const struct LinuxDirent64* entry, struct stat* file_stat) {
+	// the entry type tells directories and special files apart without a
+	// system call. Links, and entries of file systems not filling the type,
+	// need a look at the file.
+	if (entry->d_type != DT_REG && entry->d_type != DT_LNK && entry->d_type != DT_UNKNOWN) {
+		return false;
+	}
+	return fstatat(dir_fd, entry->d_name, file_stat, 0) == 0 && S_ISREG(file_stat->st_mode);
+}
+
+
+/**
+ * Compute the checksum of a scanned file
+ */
+static void checksum_scanned_file(int dir_fd, struct ScannedFile* file) {
+	int file_fd = openat(dir_fd, file->name, O_RDONLY | O_CLOEXEC);
+	if (file_fd < 0) {
+		file->is_readable = false;
+		return;
+	}
+	// the pool's threads share the cores between files, rather than
+	// splitting a file between more threads
+	uint_fast32_t checksum;
+	if (crc32_parallel_file_checksum(file_fd, 1, &checksum) < 0) {
+		file->is_readable = false;
+	}
+	file->checksum = checksum;
+	close(file_fd);
+}
+
+
+/**
+ * Checksum the file at the head of the pool's queue.
+ * The pool's lock must be held, and is released while checksumming.
+ */
+static void checksum_next_file(struct ChecksumPool* pool) {
+	struct ScannedFile* file = pool->head;
+	pool->head = file->next_pending;
+	if (pool->head == NULL) {
+		pool->tail = NULL;
+	}
+	pthread_mutex_unlock(&pool->lock);
+
+	struct ChecksumBatch* batch = file->batch;
+	checksum_scanned_file(batch->dir_fd, file);
+
+	pthread_mutex_lock(&pool->lock);
+	if (--batch->n_pending == 0) {
+		pthread_cond_signal(&batch->is_done);
+	}
+}
+
+
+/**
+ * Checksum the queued files, for as long as the process runs.
+ * Main function of each thread of the checksum pool.
+ */
+static void* run_checksum_pool(void* arg) {
+	struct ChecksumPool* pool = arg;
+	pthread_mutex_lock(&pool->lock);
+	while (true) {
+		while (pool->head == NULL) {
+			pthread_cond_wait(&pool->has_files, &pool->lock);
+		}
+		checksum_next_file(pool);
+	}
+	return NULL;
+}
+
+
+static void init_checksum_batch(struct ChecksumBatch* batch, int dir_fd) {
+	batch->dir_fd = dir_fd;
+	batch->n_pending = 0;
+	pthread_cond_init(&batch->is_done, NULL);
+}
+
+
+/**
+ * Queue a file of a listing to be checksummed by the pool. A thread is
+ * started for each queued file until the pool has its max number of
+ * threads, so that listing indexed files starts none.
+ */
+static void queue_checksum(struct ChecksumBatch* batch, struct ScannedFile* file) {
+	struct ChecksumPool* pool = &checksum_pool;
+	file->batch = batch;
+	file->next_pending = NULL;
+	pthread_mutex_lock(&pool->lock);
+	if (pool->tail == NULL) {
+		pool->head = file;
+	} else {
+		pool->tail->next_pending = file;
+	}
+	pool->tail = file;
+	batch->n_pending++;
+	pthread_cond_signal(&pool->has_files);
+
+	if (pool->max_threads == 0) {
+		int n_cores = sysconf(_SC_NPROCESSORS_ONLN);
+		pool->max_threads = n_cores < MAX_CHECKSUM_THREADS ? n_cores : MAX_CHECKSUM_THREADS;
+	}
+	pthread_t thread;
+	if (pool->n_threads < pool->max_threads
+			&& pthread_create(&thread, NULL, run_checksum_pool, pool) == 0) {
+		pthread_detach(thread);
+		pool->n_threads++;
+	}
+	pthread_mutex_unlock(&pool->lock);
+}
+
+
+/**
+ * Wait until all files of the listing are checksummed, checksumming queued
+ * files with the calling thread too while there are some
+ */
+static void finish_checksum_batch(struct ChecksumBatch* batch) {
+	struct ChecksumPool* pool = &checksum_pool;
+	pthread_mutex_lock(&pool->lock);
+	while (batch->n_pending > 0) {
+		if (pool->head != NULL) {
+			checksum_next_file(pool);
+		} else {
+			pthread_cond_wait(&batch->is_done, &pool->lock);
+		}
+	}
+	pthread_mutex_unlock(&pool->lock);
+	pthread_cond_destroy(&batch->is_done);
+}
+
+
+static int compare_scanned_files(const void* a, const void* b) {
+	const struct ScannedFile* file_a = *(struct ScannedFile* const*)a;
+	const struct ScannedFile* file_b = *(struct ScannedFile* const*)b;
+	return strcmp(file_a->name, file_b->name);
+}
+
+
+/**
+ * @return Path of a file next to the user directory, named <username><extension>
+ */
+static char* path_next_to_user(const char* username, const char* extension) {
+	char* dir_path = path_to_user(username);
+	size_t dir_path_len = strlen(dir_path);
+	size_t extension_len = strlen(extension);
+	char* path = realloc(dir_path, dir_path_len + extension_len + 1);
+	memcpy(path + dir_path_len, extension, extension_len + 1);
+	return path;
+}
+
+
+/**
+ * @return Random number identifying a new change log. 0 is left for
+ *         clients that know no log.
  */
-bool is_regular_file(const char *path)
-{
-    struct stat path_stat;
-    stat(path, &path_stat);
-    return S_ISREG(path_stat.st_mode);
+static uint32_t new_change_log_id() {
+	// the kernel's random source can be read by any thread without a lock,
+	// and gives all 32 bits
+	uint32_t log_id = 0;
+	while (log_id == 0) {
+		ssize_t n_bytes = getrandom(&log_id, sizeof(log_id), 0);
+		if (n_bytes < 0 && errno != EINTR) {
+			printf("Error when generating change log id\n");
+			return 1;
+		}
+	}
+	return log_id;
+}
+
+
+/**
+ * Start a new log of the changes made to a user directory
+ * @param  first_generation Generation the log starts from. A log replacing
+ *                          another one starts above its generation, so that
+ *                          a client of the old log can't take a generation
+ *                          of the new log for its own, even if their ids are
+ *                          the same.
+ * @param  is_replaced      Whether an existing log is replaced
+ */
+static void create_user_change_log(const char* username, uint64_t first_generation, bool is_replaced) {
+	// the log starts with the files already in the directory,
+	// each one being a change
+	struct FileCatalog* files = list_user_files(username);
+	char* log_path = path_to_user_log(username);
+	create_change_log(log_path, new_change_log_id(), first_generation + files->n_files, files, is_replaced);
+	free(log_path);
+	free_file_catalog(files);
 }
 
 
@@ -46,83 +307,229 @@ int create_user_directory(const char* username) {
 }
 
 
-struct FileInfo* list_user_files(const char* username, int* n_files) {
+struct FileCatalog* list_user_files(const char* username) {
 	/*
 	 * Construct path to user's directory
 	 */
 	char* dir_path = path_to_user(username);
 
 	/*
-	 * Get a list of all user files
+	 * Get a list of all user files, checksumming only the ones
+	 * changed since the last listing
 	 */
-	struct FileInfo* file_list = list_files(dir_path, n_files);
+	char* index_path = path_to_user_index(username);
+	struct FileCatalog* catalog = list_indexed_files(dir_path, index_path);
 
+	free(index_path);
 	free(dir_path);
-	return file_list;
+	return catalog;
 }
 
 
+void update_user_file_index(const char* username, const char* file_name,
+		const struct stat* file_stat, uint32_t checksum) {
+	char* index_path = path_to_user_index(username);
+	update_file_index(index_path, file_name, file_stat, checksum);
+	free(index_path);
+}
+
 
-struct FileInfo* list_files(const char* dir_path, int* n_files) {
-	*n_files = 0;
-	
-	// open the directory 
-	DIR* dir;
-	struct dirent* entry;
-	dir = opendir(dir_path);
-	if (dir == NULL) {
-		return NULL;
+void start_user_change_log(const char* username) {
+	char* log_path = path_to_user_log(username);
+	int log_fd = lock_change_log(log_path);
+	if (log_fd < 0) {
+		free(log_path);
+		create_user_change_log(username, 0, false);
+		return;
 	}
 
-	// prepare buffer to concat dir_path with file name in dir
-	// in the form "<dir_path>/<file_name>"
-	size_t dir_path_len = strlen(dir_path);
-	char* file_path = malloc(dir_path_len + 1 + MAX_FILE_NAME_LEN);
-	memcpy(file_path, dir_path, dir_path_len);
-	file_path[dir_path_len] = '/';
-	char* file_path_name_part = file_path + dir_path_len + 1;
-
-	// go through all regular files in directory, store the name and checksum
-	// in a linked list
-	struct FileInfo* info_list = NULL;
-	while ((entry = readdir(dir)) != NULL) {
-		// create the path to this file (stored in file_path buffer)
-		memcpy(file_path_name_part, entry->d_name, MAX_FILE_NAME_LEN);
-		
-		// if not regular file, skip this entry
-		if (!is_regular_file(file_path)) {
-			continue;
+	// files copied into or removed from the directory without going
+	// through the server aren't in the log. The log is then started over,
+	// so that clients list all files again. It stays locked meanwhile, so
+	// that no change is appended to the old log.
+	struct ChangeLog log;
+	struct FileCatalog* files = list_user_files(username);
+	bool is_loaded = load_locked_change_log(log_fd, 0, &log) == 0;
+	if (!is_loaded || !matches_change_log(&log, files)) {
+		printf("Change log of %s is out of date, starting it over\n", username);
+		create_change_log(log_path, new_change_log_id(), log.generation + 1 + files->n_files, files, true);
+	}
+	free_change_log(&log);
+	free_file_catalog(files);
+	close(log_fd);
+	free(log_path);
+}
+
+
+void record_user_file_change(const char* username, const char* file_name,
+		uint32_t checksum, bool is_valid, bool is_removed) {
+	char* log_path = path_to_user_log(username);
+	append_change_log(log_path, file_name, checksum, is_valid, is_removed);
+	free(log_path);
+}
+
+
+int list_user_changes(const char* username, uint32_t log_id, uint64_t since_generation,
+		struct ChangeLog* log) {
+	char* log_path = path_to_user_log(username);
+	if (load_change_log(log_path, since_generation, log) < 0) {
+		// start over, and the client with the old log lists all files. The
+		// generation of the old log is lost, the client's is the latest known.
+		create_user_change_log(username, since_generation + 1, true);
+		if (load_change_log(log_path, since_generation, log) < 0) {
+			free(log_path);
+			return -1;
 		}
+	}
+	free(log_path);
 
-		// create a new linked list node to store file info
-		struct FileInfo* node = malloc(sizeof(struct FileInfo));
-		// store name with null terminator
-		memcpy(node->name, entry->d_name, MAX_FILE_NAME_LEN-1);
-		node->name[MAX_FILE_NAME_LEN-1] = 0;
-		// store checksum
-		FILE* fd = fopen(file_path, "r");
-		node->checksum = crc32_file_checksum(fd);
-		fclose(fd);
+	// a generation of another log means nothing in this one
+	if (log->log_id != log_id) {
+		free_change_log(log);
+		log->is_complete = false;
+		return 0;
+	}
 
-		// add node to linked list
-		// here, we add the node to the top of list, because it's easier
-		node->next = info_list;
-		info_list = node;
-		(*n_files)++;
+	// checksum the files whose checksum wasn't known when they changed.
+	// A file that can't be read anymore has been removed since, and one
+	// that fails to read is left out, like in a listing.
+	char* dir_path = path_to_user(username);
+	int dir_fd = open(dir_path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	free(dir_path);
+	size_t i;
+	for (i = 0; i < log->n_entries; i++) {
+		struct ChangeLogEntry* entry = &log->entries[i];
+		if (entry->is_valid || entry->is_removed) {
+			continue;
+		}
+		int file_fd = dir_fd >= 0 ? openat(dir_fd, entry->name, O_RDONLY | O_CLOEXEC) : -1;
+		uint_fast32_t checksum;
+		if (file_fd >= 0 && crc32_parallel_file_checksum(file_fd, 1, &checksum) == 0) {
+			entry->checksum = checksum;
+			entry->is_valid = 1;
+		} else {
+			entry->is_removed = 1;
+		}
+		if (file_fd >= 0) {
+			close(file_fd);
+		}
 	}
+	if (dir_fd >= 0) {
+		close(dir_fd);
+	}
+	return 0;
+}
 
-	free(file_path);
-	return info_list;
+
+struct FileCatalog* list_files(const char* dir_path) {
+	return list_indexed_files(dir_path, NULL);
 }
 
 
-void free_file_info(struct FileInfo* file_info_list) {
-	struct FileInfo* head = file_info_list;
-	while (file_info_list != NULL) {
-		head = file_info_list;
-		file_info_list = file_info_list->next;
-		free(head);
+struct FileCatalog* list_indexed_files(const char* dir_path, const char* index_path) {
+	// open the directory, the files are then opened relative to it
+	int dir_fd = open(dir_path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (dir_fd < 0) {
+		return create_file_catalog(0, 0);
+	}
+	char* dirents = malloc(DIRENT_BUFFER_LEN);
+
+	// the files found are indexed again, dropping the removed ones
+	struct FileIndex old_index = { NULL, 0, 0, 0, 0, 0 };
+	if (index_path != NULL) {
+		load_file_index(index_path, &old_index);
 	}
+
+	// the files to checksum are handed to the checksum pool while the
+	// directory is still being scanned
+	struct ChecksumBatch batch;
+	init_checksum_batch(&batch, dir_fd);
+
+	// go through all regular files in directory, store the name, status
+	// and checksum if indexed. Entries are received in batches.
+	struct ScannedFile** files = NULL;
+	size_t n_scanned = 0;
+	size_t capacity = 0;
+	size_t names_len = 0;
+	long n_read;
+	while ((n_read = syscall(SYS_getdents64, dir_fd, dirents, DIRENT_BUFFER_LEN)) > 0) {
+		long position = 0;
+		while (position < n_read) {
+			struct LinuxDirent64* entry = (struct LinuxDirent64*)(dirents + position);
+			position += entry->d_reclen;
+
+			// if not regular file, skip this entry
+			struct stat file_stat;
+			if (!stat_regular_file(dir_fd, entry, &file_stat)) {
+				continue;
+			}
+
+			// store name with null terminator
+			size_t name_len = strlen(entry->d_name);
+			struct ScannedFile* file = malloc(sizeof(struct ScannedFile) + name_len + 1);
+			memcpy(file->name, entry->d_name, name_len + 1);
+			// the catalog holds the names truncated
+			names_len += (name_len < MAX_FILE_NAME_LEN-1 ? name_len : MAX_FILE_NAME_LEN-1) + 1;
+			file->file_stat = file_stat;
+			file->is_readable = true;
+			// store checksum from the index if the file didn't change,
+			// else checksum it
+			struct FileIndexEntry* index_entry = NULL;
+			if (index_path != NULL) {
+				index_entry = find_index_entry(&old_index, file->name);
+			}
+			file->is_checksummed = index_entry == NULL || !matches_index_entry(index_entry, &file_stat);
+			if (!file->is_checksummed) {
+				file->checksum = index_entry->checksum;
+			} else {
+				queue_checksum(&batch, file);
+			}
+
+			if (n_scanned == capacity) {
+				capacity = capacity > 0 ? 2 * capacity : 64;
+				files = realloc(files, capacity * sizeof(struct ScannedFile*));
+			}
+			files[n_scanned++] = file;
+		}
+	}
+	free(dirents);
+
+	finish_checksum_batch(&batch);
+	close(dir_fd);
+
+	// the threads finish in any order, the files are merged by name
+	if (n_scanned > 1) {
+		qsort(files, n_scanned, sizeof(struct ScannedFile*), compare_scanned_files);
+	}
+	struct FileIndex new_index = { NULL, 0, 0, 0, 0, 0 };
+	bool is_index_changed = false;
+	struct FileCatalog* catalog = create_file_catalog(n_scanned, names_len);
+	size_t i;
+	for (i = 0; i < n_scanned; i++) {
+		struct ScannedFile* file = files[i];
+		if (file->is_readable) {
+			if (index_path != NULL) {
+				add_index_entry(&new_index, file->name, &file->file_stat, file->checksum);
+			}
+			is_index_changed = is_index_changed || file->is_checksummed;
+			add_catalog_file(catalog, file->name, file->checksum);
+		}
+		free(file);
+	}
+	free(files);
+
+	if (index_path != NULL) {
+		// save the index only if files were added, changed or removed,
+		// or to drop the records replaced by updates. The updates made
+		// during the scan are kept.
+		if (is_index_changed || new_index.n_entries != old_index.n_entries
+				|| old_index.n_outdated > 0) {
+			save_file_index(index_path, &new_index, &old_index);
+		}
+		free_file_index(&old_index);
+		free_file_index(&new_index);
+	}
+	return catalog;
 }
 
 
@@ -141,4 +548,16 @@ char* join_path(const char* p1, const char* p2) {
 
 char* path_to_user(const char* username) {
 	return join_path(DATABASE_DIR, username);
+}
+
+
+char* path_to_user_index(const char* username) {
+	// the index is next to the user directory, named <username>.idx
+	return path_next_to_user(username, INDEX_EXTENSION);
+}
+
+
+char* path_to_user_log(const char* username) {
+	// the log is next to the user directory, named <username>.log
+	return path_next_to_user(username, LOG_EXTENSION);
 }
\ No newline at end of file
@@ -2,20 +2,11 @@
 #define STORAGE_SERVICE_H_
 
 
-#include "FileChecksum.h"
-
-
-#define MAX_FILE_NAME_LEN 64 // this includes null-terminator
+#include <sys/stat.h>
 
-
-/**
- * Define a linked list node to contain all file infos
- */
-struct FileInfo {
-	char name[MAX_FILE_NAME_LEN];
-	uint32_t checksum;
-	struct FileInfo* next;
-};
+#include "ChangeLog.h"
+#include "FileCatalog.h"
+#include "FileChecksum.h"
 
 
 /**
@@ -34,32 +25,83 @@ int create_user_directory(const char* username);
 /**
  * Find the info of all files of a given user
  * @param  username  Name of user
- * @param  n_files   [out] Number of files found
- * @return Linked list of file infos.
- *         The memory for the linked list is dynamically allocated,
- *         so user must call free_file_info on the returned pointer
- *         after finishes using the linked list.
+ * @return Catalog of the files, sorted by name.
+ *         The catalog is dynamically allocated,
+ *         so user must call free_file_catalog on the returned pointer
+ *         after finishes using the catalog.
  */
-struct FileInfo* list_user_files(const char* username, int* n_files);
+struct FileCatalog* list_user_files(const char* username);
+
+
+/**
+ * Record the checksum of a file written to a user directory in the
+ * user's index, so that it isn't computed again by list_user_files()
+ * @param  username  Name of user
+ * @param  file_name Name of the file
+ * @param  file_stat Status of the file, or NULL if its checksum is unknown
+ *                   (it is then computed by the next listing)
+ * @param  checksum  Checksum of the file
+ */
+void update_user_file_index(const char* username, const char* file_name,
+		const struct stat* file_stat, uint32_t checksum);
+
+
+/**
+ * Start the log of the changes made to a user directory, with the files
+ * already in it, unless the log exists and matches the files
+ * @param  username  Name of user
+ */
+void start_user_change_log(const char* username);
+
+
+/**
+ * Record a change made to a user directory in the user's change log
+ * @param  username   Name of user
+ * @param  file_name  Name of the file
+ * @param  checksum   Checksum of the file
+ * @param  is_valid   Whether the checksum is known (otherwise the file is
+ *                    checksummed when the change is listed)
+ * @param  is_removed Whether the file was removed
+ */
+void record_user_file_change(const char* username, const char* file_name,
+		uint32_t checksum, bool is_valid, bool is_removed);
+
+
+/**
+ * Find the changes made to a user directory after the given generation,
+ * one per file. A missing or corrupted log is started over.
+ * @param  username         Name of user
+ * @param  log_id           Id of the change log known to the client
+ * @param  since_generation Generation of the user directory known to the client
+ * @param  log              [out] Address of the struct to store the changes.
+ *                          Must be freed with free_change_log(). There are
+ *                          none if the log isn't the one known to the client.
+ * @return 0 if success, -1 if the log can't be read
+ */
+int list_user_changes(const char* username, uint32_t log_id, uint64_t since_generation,
+		struct ChangeLog* log);
 
 
 /**
  * Find the info of all files in the given directory
  * @param  dir_path  path to directory
- * @param  n_files   [out] Number of files found
- * @return Pointer to a FileInfo struct, which represents the
- *         head of a linked list of FileInfo.
- *         The memory for the linked list is dynamically allocated,
- *         so user must call free_file_info on the returned pointer
- *         after finishes using the linked list.
+ * @return Catalog of the files, sorted by name. Empty if the directory
+ *         can't be opened.
+ *         The catalog is dynamically allocated,
+ *         so user must call free_file_catalog on the returned pointer
+ *         after finishes using the catalog.
  */
-struct FileInfo* list_files(const char* dir_path, int* n_files);
+struct FileCatalog* list_files(const char* dir_path);
 
 
 /**
- * Free the dynamically allocated list of file info
+ * Find the info of all files in the given directory, as list_files().
+ * The checksums stored in an index are used for the files that didn't
+ * change since they were indexed, and the index is updated with the others.
+ * @param  dir_path   path to directory
+ * @param  index_path path to the index file, or NULL to checksum all files
  */
-void free_file_info(struct FileInfo* file_info_list);
+struct FileCatalog* list_indexed_files(const char* dir_path, const char* index_path);
 
 
 /**
@@ -76,4 +118,20 @@ char* join_path(const char* p1, const char* p2);
 char* path_to_user(const char* username);
 
 
+/**
+ * @return A string representing the path to the checksum index of an user.
+ *         The string is dynamically allocated, and needed to be
+ *         freed afterward.
+ */
+char* path_to_user_index(const char* username);
+
+
+/**
+ * @return A string representing the path to the change log of an user.
+ *         The string is dynamically allocated, and needed to be
+ *         freed afterward.
+ */
+char* path_to_user_log(const char* username);
+
+
 #endif // STORAGE_SERVICE_H_
@@ -0,0 +1,145 @@
+#include "WorkerPool.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+
+/*
+ * Helper functions
+ */
+
+/**
+ * Push a completed item, and wake up the event loop if the list was empty.
+ * Safe to be called from multiple workers at the same time.
+ */
+static void push_completed_work(struct WorkerPool* pool, struct WorkItem* item) {
+    struct WorkItem* head = atomic_load_explicit(&pool->completed, memory_order_relaxed);
+    do {
+        item->next = head;
+    } while (!atomic_compare_exchange_weak_explicit(&pool->completed, &head, item,
+                memory_order_release, memory_order_relaxed));
+
+    // if the list wasn't empty, the event loop has already been notified
+    // and will take this item together with the others
+    if (head == NULL) {
+        uint64_t one = 1;
+        ssize_t n_written = write(pool->notify_fd, &one, sizeof(one));
+        (void)n_written;
+    }
+}
+
+
+/**
+ * Main function of each worker thread
+ */
+static void* run_worker(void* arg) {
+    struct WorkerPool* pool = arg;
+    while (true) {
+        // wait for work
+        pthread_mutex_lock(&pool->queue_lock);
+        while (pool->queue_head == NULL && !pool->is_stopping) {
+            pthread_cond_wait(&pool->has_work, &pool->queue_lock);
+        }
+        struct WorkItem* item = pool->queue_head;
+        if (item == NULL) {
+            // stopping, and no more work
+            pthread_mutex_unlock(&pool->queue_lock);
+            return NULL;
+        }
+        pool->queue_head = item->next;
+        if (pool->queue_head == NULL) {
+            pool->queue_tail = NULL;
+        }
+        pthread_mutex_unlock(&pool->queue_lock);
+
+        // do the work, then hand it back
+        item->run(item->context);
+        push_completed_work(pool, item);
+    }
+}
+
+
+/*
+ * Public functions
+ */
+
+
+struct WorkerPool* create_worker_pool(int n_threads) {
+    struct WorkerPool* pool = calloc(1, sizeof(struct WorkerPool));
+    pool->notify_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (pool->notify_fd < 0) {
+        free(pool);
+        return NULL;
+    }
+    pthread_mutex_init(&pool->queue_lock, NULL);
+    pthread_cond_init(&pool->has_work, NULL);
+    atomic_init(&pool->completed, NULL);
+
+    pool->threads = malloc(n_threads * sizeof(pthread_t));
+    for (pool->n_threads = 0; pool->n_threads < n_threads; pool->n_threads++) {
+        if (pthread_create(&pool->threads[pool->n_threads], NULL, run_worker, pool) != 0) {
+            break;
+        }
+    }
+    if (pool->n_threads == 0) {
+        free_worker_pool(pool);
+        return NULL;
+    }
+    return pool;
+}
+
+
+void submit_work(struct WorkerPool* pool, struct WorkItem* item) {
+    item->next = NULL;
+    pthread_mutex_lock(&pool->queue_lock);
+    if (pool->queue_tail == NULL) {
+        pool->queue_head = item;
+    } else {
+        pool->queue_tail->next = item;
+    }
+    pool->queue_tail = item;
+    pthread_cond_signal(&pool->has_work);
+    pthread_mutex_unlock(&pool->queue_lock);
+}
+
+
+struct WorkItem* take_completed_work(struct WorkerPool* pool) {
+    // clear the notification before taking the items, so that an item
+    // completed right after this call notifies again
+    uint64_t count;
+    ssize_t n_read = read(pool->notify_fd, &count, sizeof(count));
+    (void)n_read;
+
+    struct WorkItem* items = atomic_exchange_explicit(&pool->completed, NULL, memory_order_acquire);
+
+    // the list is most recent first, reverse it into completion order
+    struct WorkItem* ordered = NULL;
+    while (items != NULL) {
+        struct WorkItem* next = items->next;
+        items->next = ordered;
+        ordered = items;
+        items = next;
+    }
+    return ordered;
+}
+
+
+void free_worker_pool(struct WorkerPool* pool) {
+    pthread_mutex_lock(&pool->queue_lock);
+    pool->is_stopping = true;
+    pthread_cond_broadcast(&pool->has_work);
+    pthread_mutex_unlock(&pool->queue_lock);
+
+    int i;
+    for (i = 0; i < pool->n_threads; i++) {
+        pthread_join(pool->threads[i], NULL);
+    }
+
+    close(pool->notify_fd);
+    pthread_mutex_destroy(&pool->queue_lock);
+    pthread_cond_destroy(&pool->has_work);
+    free(pool->threads);
+    free(pool);
+}
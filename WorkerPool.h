@@ -0,0 +1,85 @@
+/**
+ * Contains a fixed-size pool of worker threads, used by the server to run
+ * blocking disk work (directory scans, checksums, file reads and writes)
+ * away from the event loop
+ */
+
+#ifndef WORKER_POOL_H_
+#define WORKER_POOL_H_
+
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+
+
+/**
+ * A unit of work. It is run on a worker thread, then handed back to the
+ * event loop thread through take_completed_work()
+ */
+struct WorkItem {
+    /** Function run on a worker thread */
+    void (*run)(void* context);
+    /** Argument passed to the function */
+    void* context;
+    /** Link used by the pool's queues */
+    struct WorkItem* next;
+};
+
+
+/**
+ * Contains the state of a worker pool
+ */
+struct WorkerPool {
+    pthread_t* threads;
+    int n_threads;
+
+    /** Work waiting for a worker, protected by queue_lock */
+    pthread_mutex_t queue_lock;
+    pthread_cond_t has_work;
+    struct WorkItem* queue_head;
+    struct WorkItem* queue_tail;
+    bool is_stopping;
+
+    /**
+     * Completed work, pushed by workers without locking, and taken all
+     * at once by the event loop thread. Most recently completed first.
+     */
+    _Atomic(struct WorkItem*) completed;
+    /** Readable when there is completed work, so it can be watched by an event loop */
+    int notify_fd;
+};
+
+
+/**
+ * Create a pool and start its worker threads
+ * @param  n_threads Number of worker threads
+ * @return The pool, or NULL if fail. Must be freed with free_worker_pool()
+ */
+struct WorkerPool* create_worker_pool(int n_threads);
+
+
+/**
+ * Queue a work item to be run by a worker thread. The item must stay
+ * valid until it is returned by take_completed_work()
+ */
+void submit_work(struct WorkerPool* pool, struct WorkItem* item);
+
+
+/**
+ * Take all work completed since the last call. Must only be called from
+ * a single thread (the one running the event loop).
+ * @return Linked list of completed work items, in the order of completion,
+ *         or NULL if none
+ */
+struct WorkItem* take_completed_work(struct WorkerPool* pool);
+
+
+/**
+ * Stop the worker threads, after they finish the queued work,
+ * and release all resources used by the pool
+ */
+void free_worker_pool(struct WorkerPool* pool);
+
+
+#endif // WORKER_POOL_H_
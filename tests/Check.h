@@ -0,0 +1,42 @@
+/**
+ * Contains the checks shared by the tests. Each test is a program that
+ * prints the checks that failed, and exits with 1 if any did.
+ */
+
+#ifndef CHECK_H_
+#define CHECK_H_
+
+
+#include <stdio.h>
+
+
+/** Number of checks that failed so far */
+static int n_failed_checks = 0;
+
+
+/**
+ * Check that the condition holds, printing it with its line otherwise
+ */
+#define CHECK(condition) do { \
+    if (!(condition)) { \
+        printf("%s:%d: check failed: %s\n", __FILE__, __LINE__, #condition); \
+        n_failed_checks++; \
+    } \
+} while (0)
+
+
+/**
+ * Print the outcome of the test
+ * @return Exit status of the test
+ */
+static inline int finish_checks(const char* test_name) {
+    if (n_failed_checks > 0) {
+        printf("%s: %d checks failed\n", test_name, n_failed_checks);
+        return 1;
+    }
+    printf("%s: passed\n", test_name);
+    return 0;
+}
+
+
+#endif // CHECK_H_
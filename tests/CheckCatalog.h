@@ -0,0 +1,36 @@
+/**
+ * Contains the checks of file catalogs shared by the tests
+ */
+
+#ifndef CHECK_CATALOG_H_
+#define CHECK_CATALOG_H_
+
+
+#include <stdbool.h>
+#include <string.h>
+
+#include "../FileCatalog.h"
+
+
+/**
+ * @return Whether the catalogs hold the same files, in the same order,
+ *         and a diff of them finds nothing
+ */
+static inline bool is_same_catalog(const struct FileCatalog* catalog1, const struct FileCatalog* catalog2) {
+    struct FileCatalog* only_in_1;
+    struct FileCatalog* only_in_2;
+    diff_file_catalogs(catalog1, catalog2, &only_in_1, &only_in_2);
+    bool is_same = only_in_1->n_files == 0 && only_in_2->n_files == 0
+            && catalog1->n_files == catalog2->n_files;
+    size_t i;
+    for (i = 0; is_same && i < catalog1->n_files; i++) {
+        is_same = strcmp(catalog_file_name(catalog1, i), catalog_file_name(catalog2, i)) == 0
+                && catalog1->checksums[i] == catalog2->checksums[i];
+    }
+    free_file_catalog(only_in_1);
+    free_file_catalog(only_in_2);
+    return is_same;
+}
+
+
+#endif // CHECK_CATALOG_H_
@@ -0,0 +1,298 @@
+/**
+ * Checks that the changes of a log, applied to the files a client knew,
+ * give the files of a full listing, and that a user's log is started over
+ * when the files change without going through the server
+ */
+
+#define _GNU_SOURCE  // for nftw()
+
+#include <fcntl.h>
+#include <ftw.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "../ChangeLog.h"
+#include "../StorageService.h"
+#include "Check.h"
+#include "CheckCatalog.h"
+
+
+#define N_NAMES 50
+#define N_INITIAL_FILES 20
+#define N_CHANGES 300
+
+
+/**
+ * Files of a directory, by position of their name
+ */
+struct DirectoryState {
+    bool exists[N_NAMES];
+    uint32_t checksums[N_NAMES];
+};
+
+
+/*
+ * Helper functions
+ */
+
+static void make_file_name(char* name, int i) {
+    snprintf(name, MAX_FILE_NAME_LEN, "Track %03d.mp3", i);
+}
+
+
+/**
+ * @return Catalog of the files of the state, sorted by name, like a listing
+ */
+static struct FileCatalog* list_state(const struct DirectoryState* state) {
+    struct FileCatalog* catalog = create_file_catalog(N_NAMES, N_NAMES * MAX_FILE_NAME_LEN);
+    char name[MAX_FILE_NAME_LEN];
+    int i;
+    for (i = 0; i < N_NAMES; i++) {
+        if (state->exists[i]) {
+            make_file_name(name, i);
+            add_catalog_file(catalog, name, state->checksums[i]);
+        }
+    }
+    return catalog;
+}
+
+
+/**
+ * Apply random changes to a log, and check that the changes since every
+ * generation, applied to the files known at that generation, give the
+ * files of the directory after all changes
+ */
+static void check_applied_changes(const char* log_path) {
+    // snapshots[g] is the files known at generation g. The log starts
+    // with a record for each initial file.
+    struct FileCatalog* snapshots[N_INITIAL_FILES + N_CHANGES + 1];
+    struct DirectoryState state;
+    memset(&state, 0, sizeof(state));
+    int g;
+    for (g = 0; g <= N_INITIAL_FILES; g++) {
+        snapshots[g] = list_state(&state);
+        if (g < N_INITIAL_FILES) {
+            state.exists[g * 2] = true;
+            state.checksums[g * 2] = rand();
+        }
+    }
+    CHECK(create_change_log(log_path, 7, N_INITIAL_FILES, snapshots[N_INITIAL_FILES], false) == 0);
+    CHECK(create_change_log(log_path, 8, N_INITIAL_FILES, snapshots[N_INITIAL_FILES], false) == -1);
+
+    char name[MAX_FILE_NAME_LEN];
+    for (g = N_INITIAL_FILES + 1; g <= N_INITIAL_FILES + N_CHANGES; g++) {
+        int i = rand() % N_NAMES;
+        bool is_removed = state.exists[i] && rand() % 3 == 0;
+        state.exists[i] = !is_removed;
+        state.checksums[i] = rand();
+        make_file_name(name, i);
+        CHECK(append_change_log(log_path, name, state.checksums[i], true, is_removed) == 0);
+        snapshots[g] = list_state(&state);
+    }
+    struct FileCatalog* files = snapshots[N_INITIAL_FILES + N_CHANGES];
+
+    struct ChangeLog log;
+    for (g = 0; g <= N_INITIAL_FILES + N_CHANGES; g++) {
+        CHECK(load_change_log(log_path, g, &log) == 0);
+        CHECK(log.log_id == 7 && log.generation == N_INITIAL_FILES + N_CHANGES && log.is_complete);
+        struct FileCatalog* applied = apply_change_log(snapshots[g], &log);
+        if (!is_same_catalog(applied, files)) {
+            printf("changes since generation %d don't give the listed files\n", g);
+            CHECK(false);
+        }
+        if (g == 0) {
+            CHECK(matches_change_log(&log, files));
+        }
+        free_file_catalog(applied);
+        free_change_log(&log);
+    }
+
+    // a generation newer than the log has no changes
+    CHECK(load_change_log(log_path, N_INITIAL_FILES + N_CHANGES + 1, &log) == 0);
+    CHECK(!log.is_complete && log.n_entries == 0);
+    free_change_log(&log);
+
+    for (g = 0; g <= N_INITIAL_FILES + N_CHANGES; g++) {
+        free_file_catalog(snapshots[g]);
+    }
+}
+
+
+/**
+ * Check that all the changes of a log match the files left, and only them
+ */
+static void check_matched_files(const char* log_path) {
+    struct ChangeLog log;
+    CHECK(load_change_log(log_path, 0, &log) == 0);
+    struct FileCatalog* empty = create_file_catalog(0, 0);
+    struct FileCatalog* files = apply_change_log(empty, &log);
+    free_file_catalog(empty);
+    CHECK(matches_change_log(&log, files));
+    CHECK(files->n_files > 1);
+
+    // a file missing, changed, or added
+    struct FileCatalog* changed = create_file_catalog(files->n_files + 1,
+            files->names_len + MAX_FILE_NAME_LEN);
+    size_t i;
+    for (i = 1; i < files->n_files; i++) {
+        add_catalog_file(changed, catalog_file_name(files, i), files->checksums[i]);
+    }
+    CHECK(!matches_change_log(&log, changed));
+    add_catalog_file(changed, "Track 999.mp3", 0);
+    CHECK(!matches_change_log(&log, changed));
+    free_file_catalog(changed);
+
+    files->checksums[0] ^= 1;
+    CHECK(!matches_change_log(&log, files));
+
+    // unless the checksum is unknown to the log
+    for (i = 0; i < log.n_entries; i++) {
+        if (strcmp(log.entries[i].name, catalog_file_name(files, 0)) == 0) {
+            log.entries[i].is_valid = 0;
+        }
+    }
+    CHECK(matches_change_log(&log, files));
+
+    free_file_catalog(files);
+    free_change_log(&log);
+}
+
+
+static void write_file(const char* username, const char* file_name, const char* content) {
+    char* dir_path = path_to_user(username);
+    char* file_path = join_path(dir_path, file_name);
+    FILE* file = fopen(file_path, "w");
+    fputs(content, file);
+    fclose(file);
+    free(file_path);
+    free(dir_path);
+}
+
+
+static void remove_file(const char* username, const char* file_name) {
+    char* dir_path = path_to_user(username);
+    char* file_path = join_path(dir_path, file_name);
+    remove(file_path);
+    free(file_path);
+    free(dir_path);
+}
+
+
+/**
+ * @return Id of the user's change log, which a client knowing no log gets
+ */
+static uint32_t find_log_id(const char* username) {
+    struct ChangeLog log;
+    CHECK(list_user_changes(username, 0, 0, &log) == 0);
+    CHECK(!log.is_complete && log.n_entries == 0 && log.log_id != 0);
+    uint32_t log_id = log.log_id;
+    free_change_log(&log);
+    return log_id;
+}
+
+
+/**
+ * Check that all the changes of the user's log, which a generation older
+ * than the log gets, give the files of a listing
+ */
+static void check_user_changes(const char* username, uint32_t log_id) {
+    struct ChangeLog log;
+    CHECK(list_user_changes(username, log_id, 0, &log) == 0);
+    CHECK(log.log_id == log_id);
+    struct FileCatalog* files = list_user_files(username);
+    struct FileCatalog* empty = create_file_catalog(0, 0);
+    struct FileCatalog* applied = apply_change_log(empty, &log);
+    CHECK(is_same_catalog(applied, files));
+    free_file_catalog(applied);
+    free_file_catalog(empty);
+    free_file_catalog(files);
+    free_change_log(&log);
+}
+
+
+/**
+ * Check that a user's log follows the changes recorded by the server,
+ * and is started over when the files change out of band, or it is corrupted
+ */
+static void check_user_log_recovery() {
+    const char* username = "alice";
+    initialize_storage_service();
+    CHECK(create_user_directory(username) == 0);
+    write_file(username, "a.mp3", "a");
+    write_file(username, "b.mp3", "b");
+    start_user_change_log(username);
+    uint32_t log_id = find_log_id(username);
+    check_user_changes(username, log_id);
+
+    // a change recorded without its checksum is checksummed when listed
+    write_file(username, "c.mp3", "c");
+    record_user_file_change(username, "c.mp3", 0, false, false);
+    struct ChangeLog log;
+    CHECK(list_user_changes(username, log_id, 2, &log) == 0);
+    CHECK(log.is_complete && log.generation == 3 && log.n_entries == 1);
+    uint32_t checksum = crc32_running_checksum((const unsigned char*)"c", 1, 0xFFFFFFFF) ^ 0xFFFFFFFF;
+    CHECK(log.n_entries == 1 && log.entries[0].is_valid && log.entries[0].checksum == checksum);
+    free_change_log(&log);
+    check_user_changes(username, log_id);
+
+    // the log still matches the files at the next logon
+    start_user_change_log(username);
+    CHECK(find_log_id(username) == log_id);
+
+    // files added and removed out of band start a new log, and a client
+    // of the old log gets no changes
+    write_file(username, "d.mp3", "d");
+    remove_file(username, "a.mp3");
+    start_user_change_log(username);
+    uint32_t new_log_id = find_log_id(username);
+    CHECK(new_log_id != log_id);
+    CHECK(list_user_changes(username, log_id, 3, &log) == 0);
+    CHECK(!log.is_complete && log.n_entries == 0 && log.log_id == new_log_id);
+    free_change_log(&log);
+    // nor would it with the id of the new log, which starts above the old one
+    CHECK(list_user_changes(username, new_log_id, 3, &log) == 0);
+    CHECK(!log.is_complete && log.generation > 3);
+    free_change_log(&log);
+    check_user_changes(username, new_log_id);
+
+    // so does a file rewritten out of band
+    write_file(username, "b.mp3", "bb");
+    start_user_change_log(username);
+    log_id = new_log_id;
+    new_log_id = find_log_id(username);
+    CHECK(new_log_id != log_id);
+    check_user_changes(username, new_log_id);
+
+    // a corrupted log is started over when listed
+    char* log_path = path_to_user_log(username);
+    CHECK(truncate(log_path, 10) == 0);
+    free(log_path);
+    log_id = new_log_id;
+    new_log_id = find_log_id(username);
+    CHECK(new_log_id != log_id);
+    check_user_changes(username, new_log_id);
+}
+
+
+static int remove_entry(const char* path, const struct stat* path_stat, int type, struct FTW* ftw) {
+    return remove(path);
+}
+
+
+int main() {
+    srand(1);
+    char dir_path[] = "/tmp/TestChangeLog.XXXXXX";
+    if (mkdtemp(dir_path) == NULL || chdir(dir_path) < 0) {
+        perror("TestChangeLog");
+        return 1;
+    }
+
+    check_applied_changes("test.log");
+    check_matched_files("test.log");
+    check_user_log_recovery();
+
+    CHECK(chdir("/") == 0);
+    nftw(dir_path, remove_entry, 16, FTW_DEPTH | FTW_PHYS);
+    return finish_checks("TestChangeLog");
+}
@@ -0,0 +1,179 @@
+/**
+ * Checks the CRC-32 kernels, the combination of checksums and the checksum
+ * of files against the byte-at-a-time table implementation. The kernels are
+ * private to FileChecksum.c, which is included here.
+ */
+
+#include "../FileChecksum.c"
+
+#include "Check.h"
+
+
+#define DATA_LEN 4096
+/** Long enough for 3 ranges of a parallel checksum, and a few bytes more */
+#define FILE_LEN (3 * MIN_PARALLEL_RANGE_LEN + 1000)
+
+
+/*
+ * Helper functions
+ */
+
+/**
+ * Checksum one byte at a time with CRC32_TABLE, as a reference
+ */
+static uint32_t table_checksum(const unsigned char* data, size_t data_len, uint32_t checksum) {
+    size_t i;
+    for (i = 0; i < data_len; i++) {
+        checksum = (checksum >> 8) ^ CRC32_TABLE[(checksum ^ data[i]) & 0xFF];
+    }
+    return checksum;
+}
+
+
+static void fill_random(unsigned char* data, size_t data_len) {
+    size_t i;
+    for (i = 0; i < data_len; i++) {
+        data[i] = rand();
+    }
+}
+
+
+static void check_known_value() {
+    const char* data = "123456789";
+    uint32_t checksum = table_checksum((const unsigned char*)data, 9, 0xFFFFFFFF) ^ 0xFFFFFFFF;
+    CHECK(checksum == 0xCBF43926);
+}
+
+
+static void check_slicing_kernels(const unsigned char* data) {
+    size_t n_blocks;
+    for (n_blocks = 0; n_blocks <= 64; n_blocks++) {
+        CHECK(crc32_slicing_by_16(data + 1, n_blocks, 0x12345678)
+                == table_checksum(data + 1, n_blocks * 16, 0x12345678));
+        CHECK(crc32_slicing_by_8(data + 3, n_blocks, 0xFFFFFFFF)
+                == table_checksum(data + 3, n_blocks * 8, 0xFFFFFFFF));
+    }
+}
+
+
+/**
+ * Check a clmul kernel on every length it takes, from unaligned data
+ */
+static void check_clmul_kernel(const char* kernel_name,
+        uint32_t (*kernel)(const unsigned char*, size_t, uint32_t), const unsigned char* data) {
+    size_t len;
+    for (len = 64; len <= DATA_LEN - 16; len += 16) {
+        uint32_t expected = table_checksum(data + 5, len, 0xFFFFFFFF);
+        uint32_t checksum = kernel(data + 5, len, 0xFFFFFFFF);
+        if (checksum != expected) {
+            printf("%s: wrong checksum of %zu bytes\n", kernel_name, len);
+        }
+        CHECK(checksum == expected);
+    }
+    CHECK(kernel(data, 1024, 0xCAFEBABE) == table_checksum(data, 1024, 0xCAFEBABE));
+}
+
+
+static void check_clmul_kernels(const unsigned char* data) {
+#ifdef HAS_CLMUL_KERNELS
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("pclmul") && __builtin_cpu_supports("sse4.1")) {
+        check_clmul_kernel("crc32_pclmul", crc32_pclmul, data);
+    } else {
+        printf("crc32_pclmul: not supported by the CPU, skipped\n");
+    }
+    if (__builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512vl")
+            && __builtin_cpu_supports("vpclmulqdq")) {
+        check_clmul_kernel("crc32_vpclmul", crc32_vpclmul, data);
+    } else {
+        printf("crc32_vpclmul: not supported by the CPU, skipped\n");
+    }
+#endif
+}
+
+
+/**
+ * Check the dispatch of crc32_running_checksum() on every length,
+ * and on data checksummed in several calls
+ */
+static void check_running_checksum(const unsigned char* data) {
+    size_t len;
+    for (len = 0; len <= 1024; len++) {
+        CHECK(crc32_running_checksum(data + 7, len, 0xFFFFFFFF)
+                == table_checksum(data + 7, len, 0xFFFFFFFF));
+    }
+    uint32_t checksum = 0xFFFFFFFF;
+    size_t offset = 0;
+    for (len = 1; offset + len <= DATA_LEN; offset += len, len = len * 3 + 1) {
+        checksum = crc32_running_checksum(data + offset, len, checksum);
+    }
+    CHECK(checksum == table_checksum(data, offset, 0xFFFFFFFF));
+}
+
+
+static void check_combine(const unsigned char* data) {
+    size_t split;
+    for (split = 0; split <= DATA_LEN; split += 61) {
+        uint32_t checksum1 = table_checksum(data, split, 0xFFFFFFFF) ^ 0xFFFFFFFF;
+        uint32_t checksum2 = table_checksum(data + split, DATA_LEN - split, 0xFFFFFFFF) ^ 0xFFFFFFFF;
+        CHECK(crc32_combine(checksum1, checksum2, DATA_LEN - split)
+                == (table_checksum(data, DATA_LEN, 0xFFFFFFFF) ^ 0xFFFFFFFF));
+    }
+}
+
+
+/**
+ * Check the checksum of a file split in ranges, in each read mode,
+ * of a file shorter than a range, and of a file that can't be read
+ */
+static void check_file_checksum() {
+    unsigned char* data = malloc(FILE_LEN);
+    fill_random(data, FILE_LEN);
+    uint32_t expected = table_checksum(data, FILE_LEN, 0xFFFFFFFF) ^ 0xFFFFFFFF;
+
+    FILE* file = tmpfile();
+    CHECK(fwrite(data, 1, FILE_LEN, file) == FILE_LEN);
+    fflush(file);
+    int fd = fileno(file);
+
+    enum ChecksumReadMode modes[] = { CHECKSUM_READ_CACHED, CHECKSUM_READ_STREAM };
+    int n_threads[] = { 1, 2, 3, 8 };
+    size_t i, j;
+    for (i = 0; i < sizeof(modes) / sizeof(modes[0]); i++) {
+        set_checksum_read_mode(modes[i]);
+        for (j = 0; j < sizeof(n_threads) / sizeof(n_threads[0]); j++) {
+            UINT32 checksum = 0;
+            CHECK(crc32_parallel_file_checksum(fd, n_threads[j], &checksum) == 0);
+            CHECK(checksum == expected);
+        }
+    }
+    rewind(file);
+    CHECK(crc32_file_checksum(file) == expected);
+
+    CHECK(ftruncate(fd, 1000) == 0);
+    UINT32 checksum = 0;
+    CHECK(crc32_parallel_file_checksum(fd, 4, &checksum) == 0);
+    CHECK(checksum == (table_checksum(data, 1000, 0xFFFFFFFF) ^ 0xFFFFFFFF));
+
+    fclose(file);
+    free(data);
+    CHECK(crc32_parallel_file_checksum(fd, 1, &checksum) == -1);
+}
+
+
+int main() {
+    srand(1);
+    pthread_once(&checksum_once, init_checksum);
+    unsigned char* data = malloc(DATA_LEN);
+    fill_random(data, DATA_LEN);
+
+    check_known_value();
+    check_slicing_kernels(data);
+    check_clmul_kernels(data);
+    check_running_checksum(data);
+    check_combine(data);
+    check_file_checksum();
+
+    free(data);
+    return finish_checks("TestFileChecksum");
+}
@@ -0,0 +1,103 @@
+/**
+ * Checks that saving an index keeps the updates appended to the index file
+ * since it was loaded, such as the files uploaded during a listing
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "../FileIndex.h"
+#include "Check.h"
+
+
+#define INDEX_PATH "test.idx"
+
+
+/*
+ * Helper functions
+ */
+
+static struct stat make_file_stat(uint64_t size) {
+    struct stat file_stat;
+    memset(&file_stat, 0, sizeof(file_stat));
+    file_stat.st_size = size;
+    file_stat.st_ino = 1000 + size;
+    return file_stat;
+}
+
+
+/**
+ * @return Checksum of the file in the index file, or 0 if it isn't indexed
+ *         or its checksum is unknown
+ */
+static uint32_t find_checksum(const char* file_name) {
+    struct FileIndex index;
+    load_file_index(INDEX_PATH, &index);
+    struct FileIndexEntry* entry = find_index_entry(&index, file_name);
+    uint32_t checksum = entry != NULL && entry->is_valid ? entry->checksum : 0;
+    free_file_index(&index);
+    return checksum;
+}
+
+
+/**
+ * Check that the updates made between loading and saving an index,
+ * to files of the index or new ones, replace the entries saved
+ */
+static void check_appended_updates() {
+    struct stat stat_a = make_file_stat(1);
+    struct stat stat_b = make_file_stat(2);
+    struct stat stat_c = make_file_stat(3);
+    CHECK(update_file_index(INDEX_PATH, "a.mp3", &stat_a, 11) == 0);
+    CHECK(update_file_index(INDEX_PATH, "b.mp3", &stat_b, 22) == 0);
+
+    struct FileIndex old_index;
+    load_file_index(INDEX_PATH, &old_index);
+    CHECK(old_index.n_entries == 2);
+
+    // a file is uploaded, and another one is changed, while listing
+    CHECK(update_file_index(INDEX_PATH, "c.mp3", &stat_c, 33) == 0);
+    CHECK(update_file_index(INDEX_PATH, "b.mp3", NULL, 0) == 0);
+
+    struct FileIndex new_index = { NULL, 0, 0, 0, 0, 0 };
+    add_index_entry(&new_index, "a.mp3", &stat_a, 11);
+    add_index_entry(&new_index, "b.mp3", &stat_b, 22);
+    CHECK(save_file_index(INDEX_PATH, &new_index, &old_index) == 0);
+    free_file_index(&old_index);
+    free_file_index(&new_index);
+
+    CHECK(find_checksum("a.mp3") == 11);
+    CHECK(find_checksum("b.mp3") == 0);
+    CHECK(find_checksum("c.mp3") == 33);
+
+    // the records merged aren't merged again by the next save
+    load_file_index(INDEX_PATH, &old_index);
+    CHECK(old_index.n_entries == 3 && old_index.n_outdated == 0);
+    CHECK(update_file_index(INDEX_PATH, "b.mp3", &stat_b, 44) == 0);
+    add_index_entry(&new_index, "a.mp3", &stat_a, 55);
+    add_index_entry(&new_index, "c.mp3", &stat_c, 33);
+    CHECK(save_file_index(INDEX_PATH, &new_index, &old_index) == 0);
+    free_file_index(&old_index);
+    free_file_index(&new_index);
+
+    CHECK(find_checksum("a.mp3") == 55);
+    CHECK(find_checksum("b.mp3") == 44);
+    CHECK(find_checksum("c.mp3") == 33);
+}
+
+
+int main() {
+    char dir_path[] = "/tmp/TestFileIndex.XXXXXX";
+    if (mkdtemp(dir_path) == NULL || chdir(dir_path) < 0) {
+        perror("TestFileIndex");
+        return 1;
+    }
+
+    check_appended_updates();
+
+    unlink(INDEX_PATH);
+    CHECK(chdir("/") == 0);
+    rmdir(dir_path);
+    return finish_checks("TestFileIndex");
+}
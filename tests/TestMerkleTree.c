@@ -0,0 +1,232 @@
+/**
+ * Checks that fetch_merkle_files(), through TREE and LEAF responses, fetches
+ * exactly the leaves whose files differ, and rebuilds the files of the other
+ * side from them
+ */
+
+#include <stdbool.h>
+#include <string.h>
+
+#include "../MerkleTree.h"
+#include "../NetworkHeader.h"
+#include "../Protocol.h"
+#include "Check.h"
+
+
+#define N_FILES 3000
+#define N_CHANGES 40
+
+
+/*
+ * Helper functions
+ */
+
+/**
+ * Make the catalogs of a client and a server, sorted by name. The server
+ * has some files the client doesn't have, lacks some, and has other
+ * checksums for some.
+ */
+static void make_catalogs(struct FileCatalog** client_files, struct FileCatalog** server_files) {
+    *client_files = create_file_catalog(N_FILES, N_FILES * MAX_FILE_NAME_LEN);
+    *server_files = create_file_catalog(N_FILES, N_FILES * MAX_FILE_NAME_LEN);
+    char name[MAX_FILE_NAME_LEN];
+    int i;
+    for (i = 0; i < N_FILES; i++) {
+        snprintf(name, sizeof(name), "Track %05d.mp3", i);
+        uint32_t checksum = i * 2654435761u;
+        int change = i % (N_FILES / N_CHANGES) == 0 ? i / (N_FILES / N_CHANGES) % 3 : -1;
+        if (change != 0) {
+            add_catalog_file(*client_files, name, checksum);
+        }
+        if (change != 1) {
+            add_catalog_file(*server_files, name, change == 2 ? ~checksum : checksum);
+        }
+    }
+}
+
+
+/**
+ * @return Whether a leaf holds the same files in both trees
+ */
+static bool is_same_leaf(const struct MerkleTree* tree1, const struct MerkleTree* tree2, uint32_t leaf) {
+    uint32_t n_files = tree1->leaf_starts[leaf + 1] - tree1->leaf_starts[leaf];
+    if (n_files != tree2->leaf_starts[leaf + 1] - tree2->leaf_starts[leaf]) {
+        return false;
+    }
+    uint32_t i;
+    for (i = 0; i < n_files; i++) {
+        uint32_t file1 = tree1->leaf_files[tree1->leaf_starts[leaf] + i];
+        uint32_t file2 = tree2->leaf_files[tree2->leaf_starts[leaf] + i];
+        if (strcmp(catalog_file_name(tree1->catalog, file1), catalog_file_name(tree2->catalog, file2)) != 0
+                || tree1->catalog->checksums[file1] != tree2->catalog->checksums[file2]) {
+            return false;
+        }
+    }
+    return true;
+}
+
+
+/**
+ * Server side of a comparison, answering from packets of a given length
+ */
+struct TestFetcher {
+    const struct MerkleTree* server_tree;
+    char* response;
+    size_t tree_response_len;
+    size_t leaf_response_len;
+    /** Leaves whose files were fetched, in order */
+    uint32_t fetched_leaves[MERKLE_N_LEAVES];
+    size_t n_fetched_leaves;
+    size_t n_fetches;
+};
+
+
+static ssize_t fetch_test_children(void* context, int level, const uint32_t* nodes, size_t n_nodes,
+        const unsigned char** children) {
+    struct TestFetcher* fetcher = context;
+    fetcher->n_fetches++;
+    ssize_t packet_len = make_tree_response(fetcher->response, fetcher->tree_response_len, 0,
+            fetcher->server_tree, level, nodes, n_nodes);
+    CHECK(packet_len > 0);
+    return parse_tree_response(fetcher->response, packet_len, n_nodes, children);
+}
+
+
+static ssize_t fetch_test_leaves(void* context, const uint32_t* leaves, size_t n_leaves,
+        struct FileCatalog** leaf_files) {
+    struct TestFetcher* fetcher = context;
+    fetcher->n_fetches++;
+    ssize_t packet_len = make_leaf_response(fetcher->response, fetcher->leaf_response_len, 0,
+            fetcher->server_tree, leaves, n_leaves);
+    CHECK(packet_len > 0);
+    ssize_t n_answered = parse_leaf_response(fetcher->response, packet_len, n_leaves, leaf_files);
+    CHECK(n_answered >= 0);
+    ssize_t i;
+    for (i = 0; i < n_answered; i++) {
+        fetcher->fetched_leaves[fetcher->n_fetched_leaves++] = leaves[i];
+    }
+    return n_answered;
+}
+
+
+/**
+ * Fetch the server's files from TREE and LEAF responses of the given lengths
+ * @return The files fetched, or NULL if a leaf doesn't fit in a response
+ */
+static struct FileCatalog* fetch_server_files(const struct MerkleTree* client_tree,
+        const struct MerkleTree* server_tree, size_t tree_response_len, size_t leaf_response_len,
+        struct TestFetcher* test_fetcher) {
+    memset(test_fetcher, 0, sizeof(*test_fetcher));
+    test_fetcher->server_tree = server_tree;
+    test_fetcher->response = malloc(tree_response_len > leaf_response_len
+            ? tree_response_len : leaf_response_len);
+    test_fetcher->tree_response_len = tree_response_len;
+    test_fetcher->leaf_response_len = leaf_response_len;
+    struct MerkleFetcher fetcher = { test_fetcher, fetch_test_children, fetch_test_leaves };
+    struct FileCatalog* files = fetch_merkle_files(client_tree, merkle_node_hash(server_tree, 0, 0),
+            &fetcher);
+    free(test_fetcher->response);
+    return files;
+}
+
+
+static void check_tree_diff(size_t response_len) {
+    struct FileCatalog* client_files;
+    struct FileCatalog* server_files;
+    make_catalogs(&client_files, &server_files);
+    struct MerkleTree* client_tree = build_merkle_tree(client_files);
+    struct MerkleTree* server_tree = build_merkle_tree(join_file_catalogs(&server_files, 1));
+
+    // the files fetched are the server's files
+    struct TestFetcher* test_fetcher = malloc(sizeof(struct TestFetcher));
+    struct FileCatalog* files = fetch_server_files(client_tree, server_tree, response_len, response_len,
+            test_fetcher);
+    CHECK(files != NULL);
+    if (files != NULL) {
+        struct FileCatalog* only_in_fetched;
+        struct FileCatalog* only_in_server;
+        diff_file_catalogs(files, server_files, &only_in_fetched, &only_in_server);
+        CHECK(files->n_files == server_files->n_files);
+        CHECK(only_in_fetched->n_files == 0 && only_in_server->n_files == 0);
+        free_file_catalog(only_in_fetched);
+        free_file_catalog(only_in_server);
+        free_file_catalog(files);
+    }
+
+    // from the leaves whose files differ, in order
+    size_t n_leaves = test_fetcher->n_fetched_leaves;
+    CHECK(n_leaves > 0 && n_leaves <= N_CHANGES);
+    size_t n_found = 0;
+    uint32_t leaf;
+    for (leaf = 0; leaf < MERKLE_N_LEAVES; leaf++) {
+        if (!is_same_leaf(client_tree, server_tree, leaf)) {
+            CHECK(n_found < n_leaves && test_fetcher->fetched_leaves[n_found] == leaf);
+            n_found++;
+        }
+    }
+    CHECK(n_found == n_leaves);
+    printf("%zu-byte responses: %zu leaves differ, fetched in %zu requests\n",
+            response_len, n_leaves, test_fetcher->n_fetches);
+
+    // a tree of the same files is fetched without requests
+    files = fetch_server_files(server_tree, server_tree, response_len, response_len, test_fetcher);
+    CHECK(files != NULL && test_fetcher->n_fetches == 0);
+    if (files != NULL) {
+        CHECK(files->n_files == server_files->n_files);
+        free_file_catalog(files);
+    }
+
+    free(test_fetcher);
+    free_file_catalog(server_files);
+    free_merkle_tree(client_tree);
+    free_merkle_tree(server_tree);
+}
+
+
+/**
+ * Nothing is fetched when the files of a leaf don't fit in a response
+ */
+static void check_leaf_too_large() {
+    struct FileCatalog* client_files;
+    struct FileCatalog* server_files;
+    make_catalogs(&client_files, &server_files);
+    struct MerkleTree* client_tree = build_merkle_tree(client_files);
+    struct MerkleTree* server_tree = build_merkle_tree(server_files);
+    struct TestFetcher* test_fetcher = malloc(sizeof(struct TestFetcher));
+    CHECK(fetch_server_files(client_tree, server_tree, BUFFSIZE, HEADER_LEN + 4, test_fetcher) == NULL);
+    CHECK(test_fetcher->n_fetched_leaves == 0);
+    free(test_fetcher);
+    free_merkle_tree(client_tree);
+    free_merkle_tree(server_tree);
+}
+
+
+/**
+ * Trees of the same files have the same root, and a tree without
+ * files has a root of zeros
+ */
+static void check_root_hashes() {
+    struct FileCatalog* client_files;
+    struct FileCatalog* server_files;
+    make_catalogs(&client_files, &server_files);
+    struct MerkleTree* tree1 = build_merkle_tree(client_files);
+    struct MerkleTree* tree2 = build_merkle_tree(join_file_catalogs(&client_files, 1));
+    CHECK(memcmp(merkle_node_hash(tree1, 0, 0), merkle_node_hash(tree2, 0, 0), MERKLE_HASH_LEN) == 0);
+    free_merkle_tree(tree1);
+    free_merkle_tree(tree2);
+    free_file_catalog(server_files);
+
+    struct MerkleTree* empty_tree = build_merkle_tree(create_file_catalog(0, 0));
+    unsigned char zeros[MERKLE_HASH_LEN] = { 0 };
+    CHECK(memcmp(merkle_node_hash(empty_tree, 0, 0), zeros, MERKLE_HASH_LEN) == 0);
+    free_merkle_tree(empty_tree);
+}
+
+
+int main() {
+    check_tree_diff(BUFFSIZE);
+    check_tree_diff(HEADER_LEN + 2 + 3 * MERKLE_FANOUT * MERKLE_HASH_LEN);
+    check_leaf_too_large();
+    check_root_hashes();
+    return finish_checks("TestMerkleTree");
+}
@@ -0,0 +1,133 @@
+/**
+ * Checks that LIST pages made for each protocol version are parsed back
+ * into the files they were made from
+ */
+
+#include <arpa/inet.h>
+#include <string.h>
+
+#include "../NetworkHeader.h"
+#include "../Protocol.h"
+#include "Check.h"
+#include "CheckCatalog.h"
+
+
+#define N_FILES 1000
+
+
+/*
+ * Helper functions
+ */
+
+/**
+ * Make a catalog sorted by name, whose names share prefixes of various
+ * lengths, up to the longest name a file can have
+ */
+static struct FileCatalog* make_sorted_catalog() {
+    struct FileCatalog* catalog = create_file_catalog(N_FILES + 2, (N_FILES + 2) * MAX_FILE_NAME_LEN);
+    char name[MAX_FILE_NAME_LEN];
+    add_catalog_file(catalog, "A", 1);
+    int i;
+    for (i = 0; i < N_FILES; i++) {
+        snprintf(name, sizeof(name), "Artist %02d - Album %d - Track %03d.mp3", i / 40, i / 10 % 4, i);
+        add_catalog_file(catalog, name, i * 2654435761u);
+    }
+    memset(name, 'z', MAX_FILE_NAME_LEN - 1);
+    name[MAX_FILE_NAME_LEN - 1] = 0;
+    add_catalog_file(catalog, name, 0xFFFFFFFF);
+    return catalog;
+}
+
+
+/**
+ * Send the catalog in pages of the given version, and parse them back
+ * @return The files of all the pages, or NULL if a page is malformed
+ */
+static struct FileCatalog* round_trip_list(const struct FileCatalog* catalog,
+        uint8_t version, size_t buff_len, size_t* n_pages) {
+    char* buffer = malloc(buff_len);
+    struct FileCatalog** pages = malloc((catalog->n_files + 1) * sizeof(struct FileCatalog*));
+    size_t next_file = 0;
+    bool is_last_page = false;
+    *n_pages = 0;
+    while (!is_last_page) {
+        ssize_t packet_len = make_list_response(buffer, buff_len, 42, catalog, version, &next_file);
+        CHECK(packet_len >= (ssize_t)HEADER_LEN && packet_len <= (ssize_t)buff_len);
+        if (packet_len < (ssize_t)HEADER_LEN) {
+            break;
+        }
+        const struct PacketHeader* header = (const struct PacketHeader*)buffer;
+        CHECK(header->version == version);
+        CHECK(ntohs(header->packet_len) == packet_len);
+        is_last_page = header->type == TYPE_LIST_RESPONSE;
+        CHECK(is_last_page == (next_file == catalog->n_files));
+        CHECK(is_last_page || header->type == TYPE_LIST_PAGE);
+
+        pages[*n_pages] = parse_list_files(buffer, packet_len);
+        CHECK(pages[*n_pages] != NULL);
+        if (pages[*n_pages] == NULL) {
+            break;
+        }
+        (*n_pages)++;
+    }
+    struct FileCatalog* files = is_last_page ? join_file_catalogs(pages, *n_pages) : NULL;
+    size_t i;
+    for (i = 0; i < *n_pages; i++) {
+        free_file_catalog(pages[i]);
+    }
+    free(pages);
+    free(buffer);
+    return files;
+}
+
+
+static void check_list_pages(const struct FileCatalog* catalog, uint8_t version, size_t buff_len) {
+    size_t n_pages;
+    struct FileCatalog* files = round_trip_list(catalog, version, buff_len, &n_pages);
+    CHECK(files != NULL && is_same_catalog(files, catalog));
+    if (files != NULL) {
+        free_file_catalog(files);
+    }
+    printf("version %d, %zu-byte packets: %zu files in %zu pages\n",
+            version, buff_len, catalog->n_files, n_pages);
+}
+
+
+/**
+ * A compact page cut short, or whose names are corrupted, isn't parsed
+ */
+static void check_malformed_page(const struct FileCatalog* catalog) {
+    char buffer[BUFFSIZE];
+    size_t next_file = 0;
+    ssize_t packet_len = make_list_response(buffer, sizeof(buffer), 42, catalog, 3, &next_file);
+    CHECK(parse_list_files(buffer, packet_len - 1) == NULL);
+    CHECK(parse_list_files(buffer, HEADER_LEN) == NULL);
+
+    // the first name can't share a prefix with a previous name. It follows
+    // the varint number of files and their checksums.
+    char* first_name = buffer + HEADER_LEN;
+    while (*first_name & 0x80) {
+        first_name++;
+    }
+    first_name += 1 + 4 * next_file;
+    CHECK(first_name[0] == 0);
+    first_name[0] = 1;
+    CHECK(parse_list_files(buffer, packet_len) == NULL);
+}
+
+
+int main() {
+    struct FileCatalog* catalog = make_sorted_catalog();
+    struct FileCatalog* empty = create_file_catalog(0, 0);
+    uint8_t version;
+    for (version = MIN_VERSION; version <= VERSION; version++) {
+        check_list_pages(catalog, version, BUFFSIZE);
+        check_list_pages(catalog, version, UINT16_MAX);
+        check_list_pages(empty, version, BUFFSIZE);
+    }
+    check_malformed_page(catalog);
+
+    free_file_catalog(empty);
+    free_file_catalog(catalog);
+    return finish_checks("TestProtocol");
+}